@@ -0,0 +1,111 @@
+// Handshake request parsing, in handshakes/s, for a browser's upgrade request arriving in one piece, in 64 B and in
+// 16 B reads. "old" is the terminator scan and strstr lookups MicroWSTryAccept used before, "new" is the incremental
+// MicroWSFindTerminator plus MicroWSParseRequest. microws.cpp is included so its static parser can be called.
+// From the repository root:
+//   g++ -std=c++17 -O2 bench/handshake_bench.cpp -o handshake_bench -lpthread && ./handshake_bench
+
+#include "../microws.cpp"
+
+#include <chrono>
+
+static const char* Request = "GET /chat HTTP/1.1\r\n"
+							 "Host: example.com:13338\r\n"
+							 "Connection: Upgrade\r\n"
+							 "Pragma: no-cache\r\n"
+							 "Cache-Control: no-cache\r\n"
+							 "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+							 "Chrome/120.0.0.0 Safari/537.36\r\n"
+							 "Upgrade: websocket\r\n"
+							 "Origin: http://example.com\r\n"
+							 "Sec-WebSocket-Version: 13\r\n"
+							 "Accept-Encoding: gzip, deflate, br\r\n"
+							 "Accept-Language: en-US,en;q=0.9\r\n"
+							 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+							 "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+							 "\r\n";
+
+// rescans everything received on every read
+static bool ParseOld(uint8_t* Data, uint32_t Start, uint32_t Size)
+{
+	(void)Start;
+	int Terminated = -1;
+	for(int i = 0; i < (int)Size - 3; ++i)
+	{
+		if(0 == memcmp(Data + i, "\r\n\r\n", 4))
+		{
+			Terminated = i + 3;
+			break;
+		}
+	}
+	if(Terminated == -1)
+		return false;
+	uint8_t Temp	   = Data[Terminated];
+	Data[Terminated]   = 0;
+	const char* Req	   = (const char*)Data;
+	bool		Result = strstr(Req, "HTTP/") && strstr(Req, "GET /") && strstr(Req, "Host: ") && strstr(Req, "Sec-WebSocket-Key: ");
+	Data[Terminated]   = Temp;
+	return Result;
+}
+
+// only scans what the last read added
+static bool ParseNew(uint8_t* Data, uint32_t Start, uint32_t Size)
+{
+	uint32_t Length = MicroWSFindTerminator(Data, Start, Size);
+	if(!Length)
+		return false;
+	MicroWSHttpRequest Req;
+	return MicroWSParseRequest((const char*)Data, Length, Req) && Req.Key;
+}
+
+struct HandshakeParser
+{
+	const char* Name;
+	bool (*Func)(uint8_t* Data, uint32_t Start, uint32_t Size);
+};
+
+static const HandshakeParser Parsers[] = {
+	{"old", ParseOld},
+	{"new", ParseNew},
+};
+
+static uint8_t Data[2048];
+
+int main()
+{
+	uint32_t Length = (uint32_t)strlen(Request);
+	memcpy(Data, Request, Length);
+	const uint32_t Chunks[] = {Length, 64, 16};
+	for(const HandshakeParser& P : Parsers)
+	{
+		printf("%-4s", P.Name);
+		for(uint32_t Chunk : Chunks)
+		{
+			uint64_t Total = 0;
+			double	 Elapsed;
+			auto	 Start = std::chrono::steady_clock::now();
+			do
+			{
+				for(int r = 0; r < 1000; ++r)
+				{
+					uint32_t Scanned = 0;
+					uint32_t Size	 = MicroWSMin(Chunk, Length);
+					while(!P.Func(Data, Scanned, Size))
+					{
+						if(Size == Length)
+						{
+							printf("\n%s: request not accepted\n", P.Name);
+							return 1;
+						}
+						Scanned = Size;
+						Size	= MicroWSMin(Size + Chunk, Length);
+					}
+					Total++;
+				}
+				Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+			} while(Elapsed < 0.2);
+			printf("  %3u B reads: %7.0f k/s", Chunk, Total / Elapsed / 1e3);
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,96 @@
+// Payload unmasking throughput of each kernel, in GB/s at 125 B, 8 KB and 64 KB. Every kernel is checked against the
+// bytewise loop MicroWSTryRead used before first. microws.cpp is included so its static kernels can be called.
+// From the repository root:
+//   g++ -std=c++17 -O2 bench/unmask_bench.cpp -o unmask_bench -lpthread && ./unmask_bench
+
+#include "../microws.cpp"
+
+#include <chrono>
+
+static void UnmaskBytewise(uint8_t* Data, uint32_t Size, uint32_t Mask)
+{
+	const uint8_t* MaskBytes = (const uint8_t*)&Mask;
+	for(uint32_t i = 0; i < Size; ++i)
+		Data[i] ^= MaskBytes[i & 3];
+}
+
+struct UnmaskKernel
+{
+	const char*		  Name;
+	MicroWSUnmaskFunc Func;
+};
+
+static const UnmaskKernel Kernels[] = {
+	{"bytewise", UnmaskBytewise},
+	{"scalar64", MicroWSUnmaskScalar},
+#if MICROWS_SIMD_X64
+	{"sse2", MicroWSUnmaskSSE2},
+	{"avx2", MicroWSUnmaskAVX2},
+#endif
+#if MICROWS_SIMD_NEON
+	{"neon", MicroWSUnmaskNEON},
+#endif
+};
+
+static uint8_t Expected[70000];
+static uint8_t Data[70000];
+
+// every size and alignment up to a few vectors, so each kernel's tail handling is covered
+static bool Check(const UnmaskKernel& K, uint32_t Mask)
+{
+	for(uint32_t Offset = 0; Offset < 5; ++Offset)
+	{
+		for(uint32_t Size = 0; Size < 300; ++Size)
+		{
+			for(uint32_t i = 0; i < Size; ++i)
+				Expected[Offset + i] = Data[Offset + i] = (uint8_t)rand();
+			UnmaskBytewise(Expected + Offset, Size, Mask);
+			K.Func(Data + Offset, Size, Mask);
+			if(memcmp(Expected + Offset, Data + Offset, Size))
+			{
+				printf("%s: wrong result at offset %u, size %u\n", K.Name, Offset, Size);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int main()
+{
+	const uint8_t MaskBytes[4] = {0x12, 0x34, 0x56, 0x78};
+	uint32_t	  Mask;
+	memcpy(&Mask, MaskBytes, 4);
+	const uint32_t Sizes[] = {125, 8 << 10, 64 << 10};
+	for(const UnmaskKernel& K : Kernels)
+	{
+#if MICROWS_SIMD_X64
+		if(K.Func == MicroWSUnmaskAVX2 && !MicroWSCpuHasAVX2())
+		{
+			printf("%-9s  not supported by this cpu\n", K.Name);
+			continue;
+		}
+#endif
+		if(!Check(K, Mask))
+			return 1;
+		printf("%-9s", K.Name);
+		for(uint32_t Size : Sizes)
+		{
+			uint64_t Total = 0;
+			double	 Elapsed;
+			auto	 Start = std::chrono::steady_clock::now();
+			do
+			{
+				for(int r = 0; r < 1000; ++r)
+				{
+					K.Func(Data + 1, Size, Mask); // payloads follow a header of odd length as often as not
+					Total += Size;
+				}
+				Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+			} while(Elapsed < 0.2);
+			printf("  %6u B: %6.2f GB/s", Size, Total / Elapsed / 1e9);
+		}
+		printf("\n");
+	}
+	return 0;
+}
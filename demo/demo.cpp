@@ -3,19 +3,30 @@
 #ifdef _WIN32
 #include <windows.h>
 #else
-#include <unistd.h>
+#include <time.h>
 #endif
 
 #include <math.h>
 #include <stdio.h>
 
+static uint64_t DemoNowMs()
+{
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
 int main()
 {
 	MicroWSInit(13338);
-	int					   Delay   = 0;
 	uint32_t			   Version = (uint32_t)-1;
 	MicroWSConnectionState State;
-	uint32_t			   Time = 0;
+	uint64_t			   Start = DemoNowMs();
+	uint32_t			   Time	 = (uint32_t)-1;
 	while(true)
 	{
 		uint32_t MaxData;
@@ -28,11 +39,12 @@ int main()
 			printf("Active Connections %d\n", State.NumConnections);
 		}
 
-		const char* msg = "hello";
-		if(0 == (Delay++ % 30))
+		// sends are paced in 30 ms frames, however often MicroWSWait returns
+		uint32_t Frame = (uint32_t)((DemoNowMs() - Start) / 30);
+		if(Frame / 30 != Time / 30)
 		{
 			char	 buffer[128];
-			uint32_t Ind   = (Delay / 30);
+			uint32_t Ind   = Frame / 30;
 			uint32_t Index = Ind % (State.NumConnections + 1);
 			if(Index == 0)
 			{
@@ -46,13 +58,14 @@ int main()
 			}
 		}
 
+		if(Frame != Time)
 		{
 			char  buffer[2048];
-			float fTime = Time / 30.f;
+			float fTime = Frame / 30.f;
 			float t0	= (float)(sin(fTime) + sin(fTime * 10.0) * 0.1);
 			int	  len	= snprintf(buffer, sizeof(buffer) - 1, "{\"t0\":\"%f\"}", t0);
-			MicroWSSendMessage(MICROWS_ALL_CONNECTIONS, buffer, len);
-			Time++;
+			MicroWSSendLatest(MICROWS_ALL_CONNECTIONS, 0, buffer, len); // slow clients skip to the newest t0
+			Time = Frame;
 		}
 
 		uint8_t	 Buffer[1024 + 1];
@@ -63,11 +76,7 @@ int main()
 			Buffer[Read] = '\0';
 			printf("RECV: %s\n", Buffer);
 		}
-#ifdef _WIN32
-		Sleep(30);
-#else
-		usleep(30 * 1000);
-#endif
+		MicroWSWait(30 * 1000); // returns as soon as there is something to update
 	}
 	MicroWSShutdown();
 }
\ No newline at end of file
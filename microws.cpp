@@ -16,6 +16,8 @@ typedef void* (*MicroWSThreadFunc)(void*);
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <atomic>
+#include <new>
 
 #ifdef _WIN32
 #include <basetsd.h>
@@ -31,11 +33,24 @@ typedef HANDLE MicroWSThread;
 #include <unistd.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/mman.h>
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define MICROWS_HAS_IO_URING 1
+#endif
+#endif
 
 #define MWS_BREAK() __builtin_trap()
 #define MWS_INVALID_SOCKET(f) (f < 0)
@@ -60,6 +75,68 @@ typedef pthread_t MicroWSThread;
 #define MICROWS_LOG 1
 #endif
 
+#ifndef MICROWS_THREAD_POLL_MS
+#define MICROWS_THREAD_POLL_MS 1 // threaded mode sleep between passes of the portable backend, which has nothing to block on
+#endif
+
+#ifndef MICROWS_TIMER_TICK_MS
+#define MICROWS_TIMER_TICK_MS 100 // resolution of pings, idle timeouts and close timeouts
+#endif
+
+#ifndef MICROWS_TIMER_SLOTS
+#define MICROWS_TIMER_SLOTS 512 // buckets of the timer wheel, a power of two. Later deadlines are looked at early and put back
+#endif
+
+#ifndef MICROWS_CLOSE_TIMEOUT_MS
+#define MICROWS_CLOSE_TIMEOUT_MS 5000 // a connection we sent a close frame has this long to answer before its socket is closed anyway
+#endif
+
+#ifndef MICROWS_SIMD
+#define MICROWS_SIMD 1 // vectorized payload unmasking, picked at init from what the cpu supports
+#endif
+
+#ifndef MICROWS_DEFLATE
+#define MICROWS_DEFLATE 0 // permessage-deflate, see MicroWSInitParams::Deflate. Needs zlib
+#endif
+
+#ifndef MICROWS_DEFLATE_MEM_LEVEL
+#define MICROWS_DEFLATE_MEM_LEVEL 8 // zlib memLevel of the compressors, 1-9. Lower uses less memory per connection
+#endif
+
+#if MICROWS_DEFLATE
+#include <zlib.h>
+#endif
+
+#if MICROWS_SIMD && (defined(__x86_64__) || defined(_M_X64))
+#define MICROWS_SIMD_X64 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define MICROWS_TARGET_AVX2
+#else
+#define MICROWS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif MICROWS_SIMD && (defined(__aarch64__) || defined(_M_ARM64) || defined(__ARM_NEON))
+#define MICROWS_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifndef MICROWS_EPOLL
+#if defined(__linux__)
+#define MICROWS_EPOLL 1 // edge triggered epoll backend. The portable scan-everything loop is used when disabled or when epoll_create1 fails
+#else
+#define MICROWS_EPOLL 0
+#endif
+#endif
+
+#ifndef MICROWS_IO_URING
+#if defined(MICROWS_HAS_IO_URING)
+#define MICROWS_IO_URING 1 // io_uring backend, used when requested with MICROWS_BACKEND_IO_URING and supported by the kernel
+#else
+#define MICROWS_IO_URING 0
+#endif
+#endif
+
 void mws_log_impl(int error, uint32_t ConnectionId, const char* fmt, ...);
 
 #if MICROWS_LOG || MICROWS_DEBUG
@@ -84,13 +161,17 @@ typedef struct
 	unsigned char buffer[64];
 } MicroWS_SHA1_CTX;
 
-static void		MicroWShreadStart(MicroWSThread* pThread, MicroWSThreadFunc Func);
+static void		MicroWShreadStart(MicroWSThread* pThread, MicroWSThreadFunc Func, void* Arg);
 static void		MicroWSThreadJoin(MicroWSThread* pThread);
 static uint32_t MicroWSSendRaw(uint32_t ConnectionId, uint8_t* Data, uint32_t Size);
 static bool		MicroWSOpening(uint32_t i);
 static bool		MicroWSOpen(uint32_t i);
 static bool		MicroWSWebServerStart();
-static void*	MicroWSAllocRing();
+static void*	MicroWSAllocRing(uint32_t Size);
+static void		MicroWSFreeRing(void* Ring, uint32_t Size);
+static uint32_t MicroWSRingSize(uint32_t Requested);
+static uint8_t* MicroWSRingTake(struct MicroWSShard& H, uint32_t Size);
+static void		MicroWSRingPut(struct MicroWSShard& H, uint8_t* Ring, uint32_t Size);
 static void		MicroWS_SHA1_Transform(uint32_t[5], const unsigned char[64]);
 static void		MicroWS_SHA1_Init(MicroWS_SHA1_CTX* context);
 static void		MicroWS_SHA1_Update(MicroWS_SHA1_CTX* context, const unsigned char* data, unsigned int len);
@@ -98,6 +179,60 @@ static void		MicroWS_SHA1_Final(unsigned char digest[20], MicroWS_SHA1_CTX* cont
 static void		MicroWSBase64Encode(char* pOut, const uint8_t* pIn, uint32_t nLen);
 static void		MicroWSWebServerStop();
 static void MicroWSSetNonBlocking(MWSSocket Socket, int NonBlocking);
+static void		MicroWSMarkReady(uint32_t i);
+static uint32_t MicroWSConnectionIndex(uint32_t ConnectionId);
+static void		MicroWSReleaseSlot(uint32_t i);
+static void		MicroWSClose(uint32_t i);
+static uint32_t MicroWSMaxDataAvailable();
+static bool		MicroWSHasFreeSlot(struct MicroWSShard& H);
+static bool		MicroWSSendPending(uint32_t i);
+static uint32_t MicroWSSendChunks(uint32_t i, struct MicroWSSendChunk* Chunks, uint32_t MaxChunks, uint32_t* TotalBytes);
+static void		MicroWSSendAdvance(uint32_t i, uint32_t Bytes);
+static int		MicroWSSendQueued(uint32_t i, uint32_t* TotalBytes);
+static void		MicroWSSharedRelease(struct MicroWSSharedFrame* Frame);
+static void		MicroWSSharedReset(uint32_t i);
+static void		MicroWSSendReset(uint32_t i);
+static bool		MicroWSSendReserve(uint32_t i, uint32_t Bytes, bool Interleave, uint32_t* Pos, uint32_t* Ticket, bool Close = false);
+static void		MicroWSSendCommit(uint32_t i, uint32_t Ticket, uint32_t Pos, uint32_t Reserved, uint32_t Bytes);
+static void		MicroWSSendCollect(uint32_t i);
+static void		MicroWSSendAdapt(uint32_t i);
+static void		MicroWSSendStreamPump(uint32_t i);
+static bool		MicroWSSendFrame(uint32_t i, const void* Ptr, uint32_t Size, uint8_t Opcode);
+static uint32_t MicroWSHeaderSize(uint32_t Size);
+uint32_t		MicroWSWriteHeader(uint8_t* Dst, uint32_t Size, uint8_t Opcode);
+static void		MicroWSUnmaskInit();
+static void		MicroWSIoStep(struct MicroWSShard& H, bool Block);
+static void		MicroWSAppMarkReady(uint32_t i);
+static void		MicroWSSenderRelease(uint32_t i);
+static void		MicroWSDeflateFree(uint32_t i);
+static void		MicroWSLatestFree(uint32_t i);
+static void		MicroWSLatestFlush();
+static bool		MicroWSTopicRequest(uint32_t i, const uint8_t* Message, uint32_t Size);
+static uint32_t MicroWSTopicPrefix(const uint8_t* Message, uint32_t Size, bool* Subscribe);
+static void		MicroWSDispatch();
+static void		MicroWSTopicLeaveAll(uint32_t i);
+static bool		MicroWSBroadcastFrame(struct MicroWSSharedFrame* Frame, const void* Payload, uint32_t Size, uint8_t Opcode, const uint32_t* Slots, uint32_t NumSlots);
+static void		MicroWSTimerUnlink(uint32_t i);
+static void		MicroWSTimerSchedule(uint32_t i, uint32_t Delta);
+static uint32_t MicroWSNow();
+static uint64_t MicroWSNowUs();
+#if MICROWS_EPOLL
+static bool		MicroWSEpollStart(struct MicroWSShard& H);
+static void		MicroWSEpollStop(struct MicroWSShard& H);
+static void		MicroWSEpollAdd(uint32_t i);
+static void		MicroWSEpollRemove(uint32_t i);
+static void		MicroWSEpollWait(struct MicroWSShard& H, int Timeout);
+static void		MicroWSDrainEpoll(struct MicroWSShard& H);
+#endif
+#if MICROWS_IO_URING
+static bool		MicroWSUringStart(struct MicroWSShard& H);
+static void		MicroWSUringStop(struct MicroWSShard& H);
+static void		MicroWSUringAdd(uint32_t i);
+static void		MicroWSDrainUring(struct MicroWSShard& H);
+static void		MicroWSUringWait(struct MicroWSShard& H);
+static void		MicroWSUringRegisterSend(uint32_t i);
+static void		MicroWSUringUnregisterRings(uint32_t i);
+#endif
 template <typename T>
 static T MicroWSMin(T a, T b);
 template <typename T>
@@ -105,38 +240,451 @@ static T MicroWSMax(T a, T b);
 template <typename T>
 static T MicroWSClamp(T a, T min_, T max_);
 
+// A broadcast message framed once and referenced from the send queue of every connection it goes to. Freed when the
+// last connection has sent it.
+struct MicroWSSharedFrame
+{
+	std::atomic<uint32_t> RefCount;
+	uint32_t			  Size;
+	uint8_t				  Data[1];
+};
+
+struct MicroWSSharedRef
+{
+	MicroWSSharedFrame* Frame;
+	uint32_t			RingPos; // position of its empty span in the ring. Ring bytes before this go out first, bytes after it go out after
+};
+
+// Newest message of a key for a connection whose send ring was too full for it, see MicroWSSendLatest. Entries past
+// NumLatest are unused but keep their buffer for the next held message.
+struct MicroWSLatest
+{
+	uint32_t Key;
+	uint32_t Size;
+	uint32_t Capacity;
+	uint8_t	 Opcode;
+	uint8_t* Data;
+};
+
+// Subscribers hold a bit per connection slot
+struct MicroWSTopicEntry
+{
+	char	  Name[MICROWS_TOPIC_NAME_MAX];
+	uint32_t  NameLen;
+	uint32_t  NumSubscribers;
+	uint64_t* Subscribers;
+};
+
+struct MicroWSSendChunk
+{
+	uint8_t* Ptr;
+	uint32_t Size;
+};
+
+// A span of the send ring reserved by a producer. Committed is set to the reservation's ticket + 1 once its bytes are
+// written, which is what the io side waits for before sending past it.
+struct MicroWSSendSpan
+{
+	uint32_t			  End; // ring position after the span
+	std::atomic<uint32_t> Committed{0};
+};
+
+struct MicroWSPooledRing
+{
+	uint8_t* Ring;
+	uint32_t Size;
+};
+
+#define MICROWS_OPCODE_CONTINUATION 0
+#define MICROWS_OPCODE_TEXT 1
+#define MICROWS_OPCODE_BINARY 2
+#define MICROWS_OPCODE_CLOSE 8
+#define MICROWS_OPCODE_PING 9
+#define MICROWS_OPCODE_PONG 10
+
+#define MICROWS_CLOSE_NORMAL 1000
+#define MICROWS_CLOSE_PROTOCOL_ERROR 1002
+#define MICROWS_CLOSE_INVALID_DATA 1007
+#define MICROWS_CLOSE_TOO_BIG 1009
+#define MICROWS_CLOSE_INTERNAL_ERROR 1011
+
+#define MICROWS_RECV_IDLE 0	  // between messages
+#define MICROWS_RECV_ARENA 1  // reassembling a message in the arena
+#define MICROWS_RECV_STREAM 2 // handing a message to the stream callback as it arrives
+#define MICROWS_RECV_READY 3  // a whole message is in the arena until it's consumed
+#define MICROWS_RECV_FAILED 4 // a close frame was sent, everything after it is dropped
+
+#define MICROWS_FRAME_RSV1 0x40 // permessage-deflate: set on the first frame of a compressed message
+
+#define MICROWS_CLOSING_NONE 0
+#define MICROWS_CLOSING_SENT 1 // we sent a close frame and wait for the peer's
+#define MICROWS_CLOSING_DONE 2 // both close frames are out, the socket is closed once ours has been sent
+
+#define MICROWS_TIMER_NONE 0xffffffff // TimerSlot of a connection that isn't in the timer wheel
+
+#define MICROWS_STREAM_IDLE 0
+#define MICROWS_STREAM_SENDING 1
+#define MICROWS_STREAM_CANCEL 2 // a close frame was sent, the io side drops the rest of the stream
+
+#define MICROWS_SEND_STREAMING 0x80000000u // in the position half of SendReserve while a stream is sending
+#define MICROWS_SEND_CLOSED 0x40000000u	   // in the position half of SendReserve once a close frame is reserved, nothing goes after it
+#define MICROWS_SEND_RESIZING 0x20000000u   // in the position half of SendReserve while the io side moves the ring, producers wait
+#define MICROWS_SEND_FLAGS (MICROWS_SEND_STREAMING | MICROWS_SEND_CLOSED | MICROWS_SEND_RESIZING)
+#define MICROWS_SEND_FRAGMENT_MIN 4096	   // streamed sends wait for this much ring space rather than go out in tiny fragments
+#define MICROWS_CONTROL_FRAME_MAX 127	   // header and longest payload of a control frame
+
+#define MICROWS_SEND_CHUNKS 8
+
+#define MICROWS_RING_MIN_SIZE (2 * MICROWS_HANDSHAKE_MAX_SIZE) // a handshake has to fit the receive ring
+#define MICROWS_RING_MAX_SIZE 0x10000000u					   // ring positions stay below the flags of SendReserve
+#define MICROWS_POOL_KEEP_ALL 0xffffffff					   // PoolTrim of a shard with no trim asked for
+
+#define MICROWS_TOPIC_SUBSCRIBE "subscribe:" // see MicroWSInitParams::ClientTopics
+#define MICROWS_TOPIC_UNSUBSCRIBE "unsubscribe:"
+static_assert((MICROWS_SHARED_FRAMES & (MICROWS_SHARED_FRAMES - 1)) == 0, "shared frame queue indices wrap, so its size has to be a power of two");
+static_assert((MICROWS_SEND_RESERVATIONS & (MICROWS_SEND_RESERVATIONS - 1)) == 0, "send tickets wrap, so the span table size has to be a power of two");
+static_assert(MICROWS_BUFFER_SPACE <= MICROWS_RING_MAX_SIZE && MICROWS_RING_MAX_SIZE <= MICROWS_SEND_RESIZING, "ring positions share the low half of SendReserve with its flags");
+static_assert((MICROWS_TIMER_SLOTS & (MICROWS_TIMER_SLOTS - 1)) == 0, "timer wheel positions wrap, so its size has to be a power of two");
+
+// permessage-deflate parameters agreed in the handshake
+struct MicroWSDeflateParams
+{
+	uint8_t Enabled			= 0;
+	uint8_t ServerBits		= 15; // window of what we compress
+	uint8_t ClientBits		= 15; // window of what the client compresses
+	uint8_t ServerReset		= 0;  // server_no_context_takeover: every message we send is compressed on its own
+	uint8_t ClientReset		= 0;  // client_no_context_takeover
+	uint8_t ReplyServerBits = 0;  // server_max_window_bits goes in the response
+	uint8_t ReplyClientBits = 0;  // client_max_window_bits goes in the response
+};
+
+// Each connection has two sides. The io side (sockets, handshake, Opening/Open/Closed) is touched by whoever runs
+// MicroWSIoStep: MicroWSUpdate, or the io thread in threaded mode. The app side is touched by the thread calling the
+// MicroWS api. The receive ring is single producer, single consumer: the io side produces RecvPut and the app consumes
+// RecvGet. The send ring has any number of producers, see MicroWSSendReserve, and the io side consumes SendGet.
 struct MicroWSConnection
 {
-	uint32_t SendPut;
-	uint32_t SendGet;
-	uint8_t* SendBuffer;
+	// Producers reserve spans of the send ring by advancing SendReserve: the ticket of the next span in the high 32 bits,
+	// its ring position and MICROWS_SEND_FLAGS in the low 32. The io side moves SendPut past committed spans in
+	// ticket order.
+	std::atomic<uint64_t> SendReserve{0};
+	std::atomic<uint32_t> SendTicket{0}; // next span the io side publishes
+	std::atomic<uint32_t> SendPut{0};
+	std::atomic<uint32_t> SendGet{0};
+	uint8_t*			  SendBuffer = nullptr;
+	MicroWSSendSpan		  SendSpans[MICROWS_SEND_RESERVATIONS];
+	// Ring sizes. The io side resizes the send ring, see MicroWSSendResize. Producers read SendSize and SendBuffer
+	// after loading SendReserve, which is stored last.
+	std::atomic<uint32_t> SendSize{0};
+	uint32_t			  RecvSize		 = 0;
+	uint32_t			  SendBaseSize	 = 0; // what the send ring shrinks back to
+	std::atomic<uint32_t> SendWant{0};		  // size asked for with MicroWSSetRingSize, until the io side has resized
+	uint32_t			  SendBlockedSeen = 0; // SendBlocked, as the io side last saw it
+	uint32_t			  SendQuietSince  = 0; // MicroWSNow when a failed send or resize was last seen
+
+	// streamed send, see MicroWSSendStream. Set up by the app, then written into the ring by the io side until it
+	// sets SendStream back to idle
+	std::atomic<uint32_t>	  SendStream{0}; // MICROWS_STREAM_*
+	const uint8_t*			  SendStreamData	 = nullptr;
+	MicroWSSendStreamCallback SendStreamCallback = nullptr;
+	void*					  SendStreamUser	 = nullptr;
+	uint64_t				  SendStreamSize	 = 0;
+	uint64_t				  SendStreamSent	 = 0;
 
-	uint32_t RecvPut;
-	uint32_t RecvGet;
-	uint8_t* RecvBuffer;
+	std::atomic<uint32_t> RecvPut{0};
+	std::atomic<uint32_t> RecvGet{0};
+	uint8_t*			  RecvBuffer = nullptr;
 
 	uint32_t Opening;
 	uint32_t Open;
 	uint32_t Closed;
-	uint32_t SendBlocked = 0;
 
-	uint32_t FailRSV;
-	uint32_t Fail88;
+	uint32_t HandshakeScan = 0; // request bytes already searched for the end of the handshake
+	MicroWSDeflateParams Deflate; // set by the io side before the open event
+
+	// timers. A connection with something due is linked into a bucket of its shard's timer wheel
+	uint32_t LastRecv	= 0; // MicroWSNow when bytes last came in
+	uint32_t LastPing	= 0;
+	uint32_t CloseStart = 0; // when the io side saw the close handshake start
+	uint8_t	 CloseSeen	= 0; // Closing, as the io side last saw it
+	uint32_t TimerSlot	= MICROWS_TIMER_NONE;
+	uint32_t TimerNext	= MICROWS_INVALID_CONNECTION;
+	uint32_t TimerPrev	= MICROWS_INVALID_CONNECTION;
+
+	// broadcast frames, pushed by the app and popped by the io side
+	MicroWSSharedRef	  Shared[MICROWS_SHARED_FRAMES];
+	std::atomic<uint32_t> SharedPush{0};
+	std::atomic<uint32_t> SharedPop{0};
+	uint32_t			  SharedOffset = 0; // bytes of the first shared frame already sent
+	std::atomic<uint32_t> SharedBytes{0};	// unsent bytes in shared frames, counted against the send ring space
+
+	// app side
+	std::atomic<uint32_t> AppId{MICROWS_INVALID_CONNECTION}; // id the application sees, from the open event until the close event
+	std::atomic<uint32_t> Users{0};	 // the app while the connection is open, plus MT senders. The slot is released at 0
+	uint32_t			 AppIndex = 0;							// position in S.AppList
+	std::atomic<uint32_t> SendBlocked{0};
+	uint32_t			 FailRSV;
+	uint32_t			 Fail88;
+	uint32_t			 PeekBytes	 = 0; // ring bytes of the message returned by MicroWSPeekMessage, consumed by MicroWSConsumeMessage
+	int64_t				 RecvDeficit = 0; // payload bytes the connection may still take this turn, see MicroWSRecvTurn
+	// messages that aren't returned in place in the receive ring: fragmented, or too big for it
+	uint8_t*			 Arena		   = nullptr; // the message being reassembled
+	uint32_t			 ArenaCapacity = 0;
+	// messages of MicroWSSendLatest waiting for room in the send ring, one per key, oldest key first
+	MicroWSLatest*		 Latest		   = nullptr;
+	uint32_t			 NumLatest	   = 0;
+	uint32_t			 LatestCapacity = 0; // entries allocated
+	uint8_t				 LatestQueued  = 0;	 // in S.LatestList
+	uint8_t				 InBatch	   = 0;	 // in S.BatchList
+	uint64_t			 MessageSize   = 0; // payload of the message announced by the frames so far
+	uint64_t			 MessageRead   = 0; // payload of the message read out of the ring so far
+	uint64_t			 FrameLeft	   = 0; // payload of the current frame still to be read out of the ring
+	uint32_t			 FrameMask	   = 0; // of the current frame, rotated to apply from its next byte
+	uint8_t				 FrameFin	   = 0;
+	uint8_t				 RecvMode	   = 0; // MICROWS_RECV_*
+	uint8_t				 RecvInflate   = 0; // the message is compressed, MessageRead counts inflated bytes
+	uint8_t				 RecvOpcode	   = 0; // of the message being reassembled, or last returned in place
+	uint64_t			 MessageFlushed = 0; // of an inflated message, bytes already handed to the stream callback
+	int					 DeflateLevel	= 0; // see MicroWSSetCompression
+	uint32_t			 DeflateMinSize = 0;
+#if MICROWS_DEFLATE
+	z_stream*			 Deflater = nullptr; // created on first use, so connections that never compress don't pay for them
+	z_stream*			 Inflater = nullptr;
+#endif
+	std::atomic<uint8_t> AppReady{0};	// a ready command is queued for the io side
+	std::atomic<uint8_t> RecvBlocked{0}; // io side stopped reading because the receive ring is full
+	std::atomic<uint8_t> RecvNotify{0};	 // the slot is queued on the shard's Received queue
+	std::atomic<uint8_t> Closing{0};	 // MICROWS_CLOSING_*, set by the app side as close frames go out and come in
 
 	MWSSocket Socket = INVALID_SOCKET;
+
+	uint32_t Generation = 0;
+	uint32_t Shard		= 0;
+	uint32_t LiveIndex	= 0; // position in the shard's LiveList while opening or open
+	uint8_t	 FreePending = 0; // closed, but goes back on the free list once nothing is in flight
+
+	// epoll backend only
+	uint32_t EpollEvents = 0; // events currently armed on the socket. EPOLLOUT is only armed while there are bytes we couldn't send
+	uint8_t	 ReadReady	 = 0;
+	uint8_t	 WriteReady	 = 0;
+	uint8_t	 InReadyList = 0;
+
+	// io_uring backend only. A slot is not reused while the kernel still has an operation in flight on its rings.
+	uint8_t UringRecv		= 0;
+	uint8_t UringSend		= 0;
+	uint8_t UringRegistered = 0; // rings are registered as fixed buffers 2*i (send) and 2*i+1 (recv), i relative to the shard
+#if MICROWS_IO_URING
+	iovec  UringVecs[MICROWS_SEND_CHUNKS]; // in flight IORING_OP_SENDMSG, when ring bytes and shared frames go out together
+	msghdr UringMsg;
+#endif
+};
+
+#if MICROWS_IO_URING
+struct MicroWSUring
+{
+	int					 Fd = -1;
+	uint32_t*			 SqHead;
+	uint32_t*			 SqTail;
+	uint32_t			 SqMask;
+	uint32_t*			 SqArray;
+	io_uring_sqe*		 Sqes;
+	uint32_t*			 CqHead;
+	uint32_t*			 CqTail;
+	uint32_t			 CqMask;
+	io_uring_cqe*		 Cqes;
+	void*				 SqRing		= nullptr;
+	size_t				 SqRingSize = 0;
+	void*				 CqRing		= nullptr;
+	size_t				 CqRingSize = 0;
+	size_t				 SqesSize	= 0;
+	uint32_t			 Queued		= 0; // sqes written but not yet submitted
+	bool				 FixedBuffers = false;
+	bool				 ListenerArmed = false; // poll on the listener in flight
+	bool				 WakeArmed	   = false; // read on the shard WakeFd in flight
+	bool				 TimerArmed	   = false; // timeout for the next timer wheel bucket in flight
+	uint64_t			 WakeValue;
+	__kernel_timespec	 TimerSpec;
+};
+#endif
+
+// multi producer, single consumer queue of slot indices, tagged in the low bit. Producers claim an item by advancing
+// Tail, and the item reads MICROWS_QUEUE_EMPTY until they have written it.
+#define MICROWS_QUEUE_EMPTY 0xffffffff
+struct MicroWSQueue
+{
+	std::atomic<uint32_t>*			 Items	  = nullptr;
+	uint32_t						 Mask	  = 0;
+	alignas(64) std::atomic<uint32_t> Head{0};
+	alignas(64) std::atomic<uint32_t> Tail{0};
+};
+
+// A listener, a slice of the connection table and the loop servicing them. With more than one shard every listener is
+// bound to the same port with SO_REUSEPORT, so the kernel spreads new connections across the shards. Where that isn't
+// available the shards all accept from the listener of shard 0.
+struct MicroWSShard
+{
+	uint32_t		  Index				 = 0;
+	MWSSocket		  ListenerSocket	 = INVALID_SOCKET;
+	bool			  OwnsListener		 = false;
+	MicroWSBackend	  Backend			 = MICROWS_BACKEND_POLL;
+	int				  EpollFd			 = -1;
+#if MICROWS_IO_URING
+	MicroWSUring	  Uring;
+#endif
+	bool			  ListenerReady		 = true;
+	uint32_t		  NumReady			 = 0;
+	uint32_t*		  ReadyList			 = nullptr;
+	uint32_t*		  DrainList			 = nullptr; // ready list being drained, so connections can be queued while draining
+
+	// slots Base to Base + S.ShardSlots, allocated in slabs up to S.ShardMaxConnections
+	uint32_t			  Base = 0;
+	std::atomic<uint32_t> NumSlots{0}; // slots in allocated slabs. Read by the app side in threaded mode
+	uint32_t*			  FreeList = nullptr;
+	uint32_t			  NumFree  = 0;
+	uint32_t*			  LiveList = nullptr; // dense list of opening and open connections
+	uint32_t			  NumLive  = 0;
+	uint32_t			  NumOpen  = 0;
+
+	// threaded mode. Events tell the app about opened and closed connections, commands hand slots back to the io side
+	// for sending, and for reuse once the app is done with a closed connection.
+	MicroWSThread		  IoThread;
+	bool				  IoRunning = false; // IoThread was started and not yet joined
+	MicroWSQueue		  Events;
+	MicroWSQueue		  Commands;
+	MicroWSQueue		  Received; // slots with new receive data, for S.OnMessage
+	std::atomic<uint32_t> IoSleeping{0};
+	int					  WakeFd = -1; // eventfd the io thread blocks on along with the sockets
+	int					  Cpu	 = -1; // the io thread is pinned to this cpu when >= 0
+
+	// rings of closed connections, handed to new ones. Only rings of S.SendRingSize and S.RecvRingSize are kept
+	MicroWSPooledRing*	  RingPool	   = nullptr;
+	uint32_t			  NumPooled	   = 0;
+	uint32_t			  PoolCapacity = 0;
+	std::atomic<uint32_t> PoolTrim{MICROWS_POOL_KEEP_ALL}; // rings to trim the pool to, set by MicroWSTrimRingPool
+
+	// timer wheel, see MicroWSIoTimers. Bucket WheelPos covers WheelTime to WheelTime + MICROWS_TIMER_TICK_MS
+	uint32_t Now	   = 0; // MicroWSNow at the start of the current step
+	uint32_t WheelTime = 0;
+	uint32_t WheelPos  = 0;
+	uint32_t NumTimers = 0;
+	uint32_t Wheel[MICROWS_TIMER_SLOTS];
 };
+
 struct MicroWSState
 {
-	MWSSocket		  ListenerSocket;
+	MicroWSBackend	  RequestedBackend	 = MICROWS_BACKEND_DEFAULT;
+	uint32_t		  RequestedMaxConnections = MICROWS_MAX_CONNECTIONS;
+	uint32_t		  RequestedShards	 = 1;
+	int				  ShardCpus[MICROWS_MAX_SHARDS];
 	bool			  IsRunning			 = false;
 	uint16_t		  nWebServerPort	 = 1999;
-	uint32_t		  LastConnection	 = 0;
 	uint32_t		  ConnectionVersion	 = 0;
 	uint64_t		  nWebServerDataSent = 0;
-	MicroWSConnection Connections[MICROWS_MAX_CONNECTIONS];
+
+	// connection table. Slots live in slabs that are allocated as the table fills up, so slot addresses never change.
+	// Each shard owns a range of ShardSlots slots, a whole number of slabs. Connection ids are
+	// Generation * MaxConnections + slot, so ids are unique across shards and the slot is always Id % MaxConnections
+	uint32_t			MaxConnections		= 0;
+	uint32_t			ShardSlots			= 0;
+	uint32_t			ShardMaxConnections = 0;
+	MicroWSConnection** Slabs				= nullptr;
+	MicroWSShard*		Shards				= nullptr;
+	uint32_t			NumShards			= 0;
 	uint32_t		  RejectCount = 0;
+
+	// app side view of the table: connections whose open event has been processed
+	uint32_t* AppList = nullptr;
+	uint32_t  NumApp  = 0;
+	uint32_t* LatestList = nullptr; // slots holding MicroWSSendLatest messages, retried every MicroWSUpdate
+	uint32_t  NumLatest	 = 0;
+	uint32_t* ViewList	 = nullptr; // slots with messages handed out by MicroWSGetMessages, not yet consumed
+	uint32_t  NumView	 = 0;
+
+	// receive scheduling, see MicroWSInitParams::RecvBudgetBytes
+	uint32_t RecvBudgetBytes	= 0;
+	uint32_t RecvBudgetMessages = 0;
+	uint32_t UpdateBudgetUs		= 0;
+	uint64_t UpdateStart		= 0; // MicroWSNowUs when MicroWSUpdate started
+	uint32_t RecvNext			= 0; // position in S.AppList the next MicroWSGetMessage starts at
+	uint32_t DispatchShard		= 0; // shard MicroWSDispatch starts at
+
+	MicroWSTopicEntry Topics[MICROWS_MAX_TOPICS];
+	uint32_t		  NumTopics	  = 0;
+	uint32_t*		  TopicSlots  = nullptr; // subscribers of the topic being published
+	bool			  ClientTopics = false;
+
+	// threaded mode: slots with sends held for the batch, see MicroWSBatchHold
+	uint32_t* BatchList		= nullptr;
+	uint32_t  NumBatch		= 0;
+	uint32_t  BatchDepth	= 0; // MicroWSBeginBatch calls not yet ended
+	uint64_t  BatchStart	= 0; // MicroWSNowUs when the first send was held
+	uint32_t  CoalesceUs	= 0;
+	uint32_t  CoalesceBytes = 0;
+	bool	  NoDelay		= false;
+
+	uint32_t SendRingSize	  = MICROWS_BUFFER_SPACE;
+	uint32_t SendRingMaxSize  = MICROWS_BUFFER_SPACE;
+	uint32_t SendRingShrinkMs = 0;
+	uint32_t RecvRingSize	  = MICROWS_BUFFER_SPACE;
+	uint32_t RingPoolSize	  = 0;
+	uint32_t RingPoolMax	  = 0;
+
+	// ring memory, updated by every shard as rings are mapped, unmapped and pooled
+	std::atomic<uint64_t> RingBytes{0};
+	std::atomic<uint32_t> NumRings{0};
+	std::atomic<uint64_t> PooledRingBytes{0};
+	std::atomic<uint32_t> NumPooledRings{0};
+
+	bool				  Threaded = false; // each shard is serviced by its own io thread
+	std::atomic<uint32_t> IoStop{0};
+
+	// MicroWSWait. WaitFd is an epoll set holding AppWakeFd and, without io threads, the epoll or io_uring fd of each
+	// shard. AppWakeFd is written by the io side once per arming, see MicroWSWaitArm, and by MicroWSUpdate when it left work
+	int					  WaitFd	= -1;
+	int					  AppWakeFd = -1;
+	std::atomic<uint32_t> AppArmed{0}; // 1: the next io side wake writes AppWakeFd, taking it back to 0
+
+	// MicroWSBeginMessage reservation, written in place in the send ring of the connection or into ReserveFrame for broadcasts
+	MicroWSReservation	Reserve;
+	MicroWSSharedFrame* ReserveFrame = nullptr;
+
+	MicroWSStreamCallback StreamCallback = nullptr;
+	void*				  StreamUser	 = nullptr;
+
+	MicroWSOpenCallback	   OnOpen		= nullptr;
+	MicroWSMessageCallback OnMessage	= nullptr;
+	MicroWSCloseCallback   OnClose		= nullptr;
+	void*				   CallbackUser = nullptr;
+
+	uint32_t PingIntervalMs = 0;
+	uint32_t IdleTimeoutMs	= 0;
+
+	bool	 Deflate				 = false;
+	uint8_t	 DeflateWindowBits		 = 15;
+	uint8_t	 DeflateClientWindowBits = 15;
+	bool	 DeflateContextTakeover	 = true;
+	int		 DeflateLevel			 = 6;
+	uint32_t DeflateMinSize			 = 256;
+#if MICROWS_DEFLATE
+	z_stream* BroadcastDeflater = nullptr; // compresses each broadcast once, without history, for every connection
+#endif
 };
 static MicroWSState S;
+
+#define MICROWS_SLAB_SHIFT 6
+#define MICROWS_SLAB_SIZE (1u << MICROWS_SLAB_SHIFT)
+
+static MicroWSConnection& MicroWSGetConnection(uint32_t i)
+{
+	MWS_ASSERT(i < S.MaxConnections);
+	return S.Slabs[i >> MICROWS_SLAB_SHIFT][i & (MICROWS_SLAB_SIZE - 1)];
+}
+
+static MicroWSShard& MicroWSShardOf(uint32_t i)
+{
+	return S.Shards[MicroWSGetConnection(i).Shard];
+}
+
 static void			MicroWSAtExitHandler()
 {
 	if(S.IsRunning)
@@ -146,9 +694,52 @@ static void			MicroWSAtExitHandler()
 }
 
 bool MicroWSInit(uint16_t ListenPort)
+{
+	MicroWSInitParams Params;
+	Params.ListenPort = ListenPort;
+	return MicroWSInit(Params);
+}
+
+bool MicroWSInit(const MicroWSInitParams& Params)
 {
 	MWS_ASSERT(!S.IsRunning);
-	S.nWebServerPort = ListenPort;
+	MicroWSUnmaskInit();
+	S.nWebServerPort	= Params.ListenPort;
+	S.RequestedBackend = Params.Backend;
+	S.RequestedMaxConnections = MicroWSClamp(Params.MaxConnections, 1u, 0x40000000u); // slots are shifted up by one in the queues, and shards round up to whole slabs
+	S.RequestedShards		  = MicroWSClamp(Params.NumShards, 1u, (uint32_t)MICROWS_MAX_SHARDS);
+	S.Threaded				  = Params.Threaded;
+	S.StreamCallback		  = Params.StreamCallback;
+	S.StreamUser			  = Params.StreamUser;
+	S.OnOpen				  = Params.OnOpen;
+	S.OnMessage				  = Params.OnMessage;
+	S.OnClose				  = Params.OnClose;
+	S.CallbackUser			  = Params.CallbackUser;
+	S.RecvBudgetBytes		  = Params.RecvBudgetBytes;
+	S.RecvBudgetMessages	  = Params.RecvBudgetMessages;
+	S.UpdateBudgetUs		  = Params.UpdateBudgetUs;
+	S.PingIntervalMs		  = Params.PingIntervalMs;
+	S.IdleTimeoutMs			  = Params.IdleTimeoutMs;
+	S.ClientTopics			  = Params.ClientTopics;
+	S.CoalesceUs			  = Params.CoalesceUs;
+	S.CoalesceBytes			  = Params.CoalesceBytes ? Params.CoalesceBytes : 0xffffffff; // capped to half the send ring when used
+	S.NoDelay				  = Params.NoDelay;
+	S.SendRingSize			  = MicroWSRingSize(Params.SendRingSize ? Params.SendRingSize : MICROWS_BUFFER_SPACE);
+	S.SendRingMaxSize		  = Params.SendRingMaxSize ? MicroWSMax(S.SendRingSize, MicroWSRingSize(Params.SendRingMaxSize)) : S.SendRingSize;
+	S.SendRingShrinkMs		  = Params.SendRingShrinkMs;
+	S.RecvRingSize			  = MicroWSRingSize(Params.RecvRingSize ? Params.RecvRingSize : MICROWS_BUFFER_SPACE);
+	S.RingPoolSize			  = Params.RingPoolSize;
+	S.RingPoolMax			  = MicroWSMax(Params.RingPoolMax, Params.RingPoolSize);
+	S.Deflate				  = Params.Deflate && MICROWS_DEFLATE;
+	S.DeflateWindowBits		  = MicroWSClamp<uint8_t>(Params.DeflateWindowBits, 9, 15); // zlib can't compress with a 256 byte window
+	S.DeflateClientWindowBits = MicroWSClamp<uint8_t>(Params.DeflateClientWindowBits, 8, 15);
+	S.DeflateContextTakeover  = Params.DeflateContextTakeover;
+	S.DeflateLevel			  = MicroWSClamp(Params.DeflateLevel, 0, 9);
+	S.DeflateMinSize		  = Params.DeflateMinSize;
+	if(Params.Deflate && !MICROWS_DEFLATE)
+		mws_log(MICROWS_INVALID_CONNECTION, "permessage-deflate needs MICROWS_DEFLATE, sending uncompressed\n");
+	for(uint32_t h = 0; h < MICROWS_MAX_SHARDS; ++h)
+		S.ShardCpus[h] = Params.ShardCpus && h < S.RequestedShards ? Params.ShardCpus[h] : -1;
 	if(MicroWSWebServerStart())
 	{
 		S.IsRunning = true;
@@ -157,168 +748,680 @@ bool MicroWSInit(uint16_t ListenPort)
 	return S.IsRunning;
 }
 
-static uint32_t MicroWSPutSpace(uint32_t Put, uint32_t Get)
+MicroWSBackend MicroWSGetBackend()
+{
+	return S.NumShards ? S.Shards[0].Backend : MICROWS_BACKEND_POLL;
+}
+
+// Ring arithmetic. Size is the ring's, SendSize or RecvSize of its connection
+static uint32_t MicroWSPutSpace(uint32_t Put, uint32_t Get, uint32_t Size)
 {
 	if(Put < Get)
 	{
-		return Put - Get - 1;
+		return Get - Put - 1;
 	}
 	else
 	{
-		return MICROWS_BUFFER_SPACE + Get - Put - 1;
+		return Size + Get - Put - 1;
 	}
 }
-static uint32_t MicroWSPutAdvance(uint32_t Put, uint32_t Get, uint32_t Bytes)
+static uint32_t MicroWSPutAdvance(uint32_t Put, uint32_t Get, uint32_t Bytes, uint32_t Size)
 {
-	MWS_ASSERT(Bytes <= MicroWSPutSpace(Put, Get));
+	MWS_ASSERT(Bytes <= MicroWSPutSpace(Put, Get, Size));
 	Put += Bytes;
-	if(Put >= MICROWS_BUFFER_SPACE)
-		Put -= MICROWS_BUFFER_SPACE;
+	if(Put >= Size)
+		Put -= Size;
 	return Put;
 }
 
-static uint32_t MicroWSGetSpace(uint32_t Get, uint32_t Put)
+static uint32_t MicroWSRingPos(uint32_t Pos, uint32_t Bytes, uint32_t Size)
+{
+	Pos += Bytes;
+	if(Pos >= Size)
+		Pos -= Size;
+	return Pos;
+}
+
+static uint32_t MicroWSGetSpace(uint32_t Get, uint32_t Put, uint32_t Size)
 {
 	if(Get <= Put)
 		return Put - Get;
 	else
-		return Put + MICROWS_BUFFER_SPACE - Get;
+		return Put + Size - Get;
 }
 
-static uint32_t MicroWSGetAdvance(uint32_t Get, uint32_t Put, uint32_t Bytes)
+static uint32_t MicroWSGetAdvance(uint32_t Get, uint32_t Put, uint32_t Bytes, uint32_t Size)
 {
-	MWS_ASSERT(Bytes <= MicroWSGetSpace(Put, Get));
+	MWS_ASSERT(Bytes <= MicroWSGetSpace(Get, Put, Size));
 	Get += Bytes;
-	if(Get >= MICROWS_BUFFER_SPACE)
-		Get -= MICROWS_BUFFER_SPACE;
+	if(Get >= Size)
+		Get -= Size;
 	return Get;
 }
 
-static bool MicroWSTryAccept(uint32_t Index)
+#define MICROWS_EVENT_OPEN 0
+#define MICROWS_EVENT_CLOSE 1
+#define MICROWS_COMMAND_READY 0
+#define MICROWS_COMMAND_RELEASE 1
+
+static void MicroWSQueueReset(MicroWSQueue& Q)
 {
-	MicroWSConnection& C		 = S.Connections[Index];
-	bool			   IsOpen	 = MicroWSOpen(Index);
-	bool			   IsOpening = MicroWSOpening(Index);
-	MWS_ASSERT(!IsOpen);
-	MWS_ASSERT(IsOpening);
+	for(uint32_t i = 0; i <= Q.Mask; ++i)
+		Q.Items[i].store(MICROWS_QUEUE_EMPTY, std::memory_order_relaxed);
+	Q.Head.store(0, std::memory_order_relaxed);
+	Q.Tail.store(0, std::memory_order_relaxed);
+}
 
-	uint32_t Put   = C.RecvPut;
-	uint32_t Get   = C.RecvGet;
-	uint8_t* Data  = C.RecvBuffer + Get;
-	uint32_t Bytes = MicroWSGetSpace(Get, Put);
-	if(Bytes > 0)
-	{
-		mws_log(C.Opening, "->TRY_ACCEPT\n");
-		//  check its null terminated
-		int Terminated = -1;
-		{
-			// search for "\r\n\r\n" terminator
-			for(int i = 0; i < (int)Bytes - 3; ++i)
-			{
-				if(0 == memcmp(Data + i, "\r\n\r\n", 4))
-				{
-					Terminated = i + 3;
-					break;
-				}
-			}
-		}
-		if(Terminated == -1)
-		{
-			return false;
-		}
-		const uint8_t Term = Data[Terminated];
-		Data[Terminated]   = '\0';
-		char* Req		   = (char*)Data;
-#if MICROPROFILE_MINIZ
-		// Expires: Tue, 01 Jan 2199 16:00:00 GMT\r\n
-#define MICROPROFILE_HTML_HEADER "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\nContent-Encoding: deflate\r\n\r\n"
-#else
-#define MICROPROFILE_HTML_HEADER "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n"
+// queues are sized so they can't overflow: a slot has at most one open and one close event, at most one ready and one
+// release command, and at most one Received entry, outstanding.
+static bool MicroWSQueueInit(MicroWSQueue& Q, uint32_t Capacity)
+{
+	uint32_t Size = 1;
+	while(Size < Capacity)
+		Size <<= 1;
+	free(Q.Items);
+	Q.Items = (std::atomic<uint32_t>*)malloc(Size * sizeof(std::atomic<uint32_t>));
+	Q.Mask	= Size - 1;
+	if(!Q.Items)
+		return false;
+	MicroWSQueueReset(Q);
+	return true;
+}
+static void MicroWSQueuePush(MicroWSQueue& Q, uint32_t Value)
+{
+	uint32_t Tail = Q.Tail.fetch_add(1, std::memory_order_seq_cst);
+	MWS_ASSERT(Tail - Q.Head.load(std::memory_order_acquire) <= Q.Mask);
+	Q.Items[Tail & Q.Mask].store(Value, std::memory_order_release);
+}
+
+static bool MicroWSQueuePop(MicroWSQueue& Q, uint32_t* Value)
+{
+	uint32_t Head = Q.Head.load(std::memory_order_relaxed);
+	uint32_t Item = Q.Items[Head & Q.Mask].load(std::memory_order_acquire);
+	if(Item == MICROWS_QUEUE_EMPTY)
+		return false; // empty, or the producer that claimed it hasn't written it yet
+	Q.Items[Head & Q.Mask].store(MICROWS_QUEUE_EMPTY, std::memory_order_relaxed);
+	Q.Head.store(Head + 1, std::memory_order_release);
+	*Value = Item;
+	return true;
+}
+
+static void MicroWSWakeIo(MicroWSShard& H)
+{
+#if defined(__linux__)
+	uint64_t One = 1;
+	if(H.WakeFd >= 0 && write(H.WakeFd, &One, sizeof(One)) < 0)
+		mws_log(MICROWS_INVALID_CONNECTION, "wake failed: %d:%s\n", errno, strerror(errno));
 #endif
+}
 
-		char* pHttp			= strstr(Req, "HTTP/");
-		char* pGet			= strstr(Req, "GET /");
-		char* pHost			= strstr(Req, "Host: ");
-		char* pWebSocketKey = strstr(Req, "Sec-WebSocket-Key: ");
-		auto  Terminate		= [](char* pString)
-		{
-			char* pEnd = pString;
-			while(*pEnd != '\0')
-			{
-				if(*pEnd == '\r' || *pEnd == '\n' || *pEnd == ' ')
-				{
-					*pEnd = '\0';
-					return;
-				}
-				pEnd++;
-			}
-		};
+// any thread -> io side, run by the next MicroWSIoStep of the shard
+static void MicroWSQueueCommand(uint32_t i, uint32_t Command)
+{
+	MicroWSShard& H = MicroWSShardOf(i);
+	MicroWSQueuePush(H.Commands, (i << 1) | Command);
+	std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the io thread setting IoSleeping before checking the queue
+	if(H.IoSleeping.load(std::memory_order_relaxed))
+		MicroWSWakeIo(H);
+}
 
-		if(pWebSocketKey)
-		{
-			pWebSocketKey += sizeof("Sec-WebSocket-Key: ") - 1;
-			Terminate(pWebSocketKey);
+// app side -> io side. Without an io thread this just runs the command.
+static void MicroWSAppCommand(uint32_t i, uint32_t Command)
+{
+	if(!S.Threaded)
+	{
+		if(Command == MICROWS_COMMAND_READY)
+			MicroWSMarkReady(i);
+		else
+			MicroWSReleaseSlot(i);
+		return;
+	}
+	MicroWSQueueCommand(i, Command);
+}
 
-			const char* pGUID	   = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-			const char* pHandShake = "HTTP/1.1 101 Switching Protocols\r\n"
-									 "Upgrade: websocket\r\n"
-									 "Connection: Upgrade\r\n"
-									 "Sec-WebSocket-Accept: ";
+static void MicroWSAppReadyNow(uint32_t i)
+{
+	if(S.Threaded && MicroWSGetConnection(i).AppReady.exchange(1, std::memory_order_seq_cst))
+		return; // already queued, and the io side hasn't looked at the ring yet
+	MicroWSAppCommand(i, MICROWS_COMMAND_READY);
+}
 
-			char EncodeBuffer[512];
-			int	 nLen = stbsp_snprintf(EncodeBuffer, sizeof(EncodeBuffer) - 1, "%s%s", pWebSocketKey, pGUID);
+// hands every slot held for the batch to the io side
+static void MicroWSBatchFlush()
+{
+	for(uint32_t n = 0; n < S.NumBatch; ++n)
+	{
+		MicroWSConnection& C = MicroWSGetConnection(S.BatchList[n]);
+		C.InBatch			 = 0;
+		if(C.AppId.load(std::memory_order_relaxed) != MICROWS_INVALID_CONNECTION)
+			MicroWSAppReadyNow(S.BatchList[n]);
+	}
+	S.NumBatch = 0;
+}
 
-			uint8_t			 sha[20];
-			MicroWS_SHA1_CTX ctx;
-			MicroWS_SHA1_Init(&ctx);
-			MicroWS_SHA1_Update(&ctx, (unsigned char*)EncodeBuffer, nLen);
-			MicroWS_SHA1_Final((unsigned char*)&sha[0], &ctx);
-			char HashOut[(2 + sizeof(sha) / 3) * 4];
-			memset(&HashOut[0], 0, sizeof(HashOut));
-			MicroWSBase64Encode(&HashOut[0], &sha[0], sizeof(sha));
+// During a batch or while coalescing, the io side isn't told about new sends until the connection has enough unsent to
+// be worth a send of its own, or the batch ends. Returns false if slot i should be handed to the io side now.
+static bool MicroWSBatchHold(uint32_t i)
+{
+	if(!S.Threaded || (!S.BatchDepth && !S.CoalesceUs))
+		return false;
+	// the io side frees ring space and reservations only as it sends, so they must not run out while held
+	MicroWSConnection& C	   = MicroWSGetConnection(i);
+	uint64_t		   Reserve = C.SendReserve.load(std::memory_order_relaxed);
+	uint32_t		   Unsent  = MicroWSGetSpace(C.SendGet.load(std::memory_order_acquire), (uint32_t)Reserve & ~MICROWS_SEND_FLAGS, C.SendSize.load(std::memory_order_relaxed));
+	uint32_t		   Spans   = (uint32_t)(Reserve >> 32) - C.SendTicket.load(std::memory_order_acquire);
+	uint32_t		   Hold	   = MicroWSMin(S.CoalesceBytes, C.SendSize.load(std::memory_order_relaxed) / 2);
+	if(Unsent + C.SharedBytes.load(std::memory_order_relaxed) >= Hold || Spans >= MICROWS_SEND_RESERVATIONS / 2)
+		return false;
+	if(!C.InBatch)
+	{
+		if(!S.NumBatch)
+			S.BatchStart = MicroWSNowUs();
+		C.InBatch				  = 1;
+		S.BatchList[S.NumBatch++] = i;
+	}
+	if(!S.BatchDepth && MicroWSNowUs() - S.BatchStart >= S.CoalesceUs)
+		MicroWSBatchFlush();
+	return true;
+}
 
-			char Reply[1024];
-			nLen = stbsp_snprintf(Reply, sizeof(Reply) - 1, "%s%s\r\n\r\n", pHandShake, HashOut);
-			MWS_ASSERT(nLen < 1024 && nLen >= 0);
-			MicroWSSendRaw(Index, (uint8_t*)&Reply[0], nLen);
+// there is something new to send on slot i
+static void MicroWSAppMarkReady(uint32_t i)
+{
+	if(!MicroWSBatchHold(i))
+		MicroWSAppReadyNow(i);
+}
 
-			Data[Terminated] = Term;
+// MicroWSAppMarkReady for the MT sends, which can't touch the io side directly even without an io thread
+static void MicroWSSenderMarkReady(uint32_t i)
+{
+	if(MicroWSGetConnection(i).AppReady.exchange(1, std::memory_order_seq_cst))
+		return;
+	MicroWSQueueCommand(i, MICROWS_COMMAND_READY);
+}
 
-			C.RecvGet = MicroWSGetAdvance(Get, Put, Terminated + 1);
-			C.Open	  = C.Opening;
-			mws_log(C.Open, "->OPEN\n");
+// A send to slot i didn't fit its ring, from any thread. The io side grows the ring when it sees SendBlocked move, so
+// it's woken in case nothing else is queued that would make it look.
+static void MicroWSSendFailed(uint32_t i)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	C.SendBlocked.fetch_add(1, std::memory_order_relaxed);
+	if(C.SendSize.load(std::memory_order_relaxed) < S.SendRingMaxSize)
+		MicroWSSenderMarkReady(i);
+}
 
-			S.ConnectionVersion++;
-			return true;
+// Keeps the slot of a connection the app has seen open from being released, from any thread. Returns the slot, or
+// MICROWS_INVALID_CONNECTION if the connection is closed.
+static uint32_t MicroWSSenderAcquire(uint32_t ConnectionId)
+{
+	uint32_t Index = MicroWSConnectionIndex(ConnectionId);
+	if(Index == MICROWS_INVALID_CONNECTION)
+		return Index;
+	MicroWSConnection& C	 = MicroWSGetConnection(Index);
+	uint32_t		   Users = C.Users.load(std::memory_order_relaxed);
+	do
+	{
+		if(!Users)
+			return MICROWS_INVALID_CONNECTION; // the app is done with the slot
+	} while(!C.Users.compare_exchange_weak(Users, Users + 1, std::memory_order_acquire, std::memory_order_relaxed));
+	if(C.AppId.load(std::memory_order_acquire) != ConnectionId)
+	{
+		MicroWSSenderRelease(Index); // closed, or the slot belongs to another connection now
+		return MICROWS_INVALID_CONNECTION;
+	}
+	return Index;
+}
+
+static void MicroWSSenderRelease(uint32_t i)
+{
+	if(MicroWSGetConnection(i).Users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		MicroWSQueueCommand(i, MICROWS_COMMAND_RELEASE); // the app closed it while we were sending
+}
+
+// app side consumed Bytes from the receive ring of slot i
+static void MicroWSAppConsume(uint32_t i, uint32_t Bytes)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	C.RecvGet.store(MicroWSGetAdvance(C.RecvGet.load(std::memory_order_relaxed), C.RecvPut.load(std::memory_order_acquire), Bytes, C.RecvSize), std::memory_order_seq_cst);
+	if(C.RecvBlocked.load(std::memory_order_seq_cst) && C.RecvBlocked.exchange(0))
+		MicroWSAppMarkReady(i); // the io side stopped reading when the ring filled up
+}
+
+// The receive ring of slot i is full, so the io side stops reading until the app makes room. Returns false if it
+// already has.
+static bool MicroWSRecvFull(uint32_t i)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	C.RecvBlocked.store(1, std::memory_order_seq_cst);
+	if(MicroWSPutSpace(C.RecvPut.load(std::memory_order_relaxed), C.RecvGet.load(std::memory_order_seq_cst), C.RecvSize))
+	{
+		C.RecvBlocked.store(0, std::memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+// io side: runs what the app queued
+static void MicroWSIoCommands(MicroWSShard& H)
+{
+	uint32_t Command;
+	while(MicroWSQueuePop(H.Commands, &Command))
+	{
+		uint32_t i = Command >> 1;
+		if((Command & 1) == MICROWS_COMMAND_READY)
+		{
+			// cleared before the drain looks at the ring, so anything sent after this queues a new command
+			MicroWSGetConnection(i).AppReady.store(0, std::memory_order_seq_cst);
+			MicroWSMarkReady(i);
 		}
 		else
 		{
-			mws_log(C.Opening, "No web socket key\n");
+			MicroWSReleaseSlot(i);
 		}
 	}
-	return false;
 }
-#ifdef _WIN32
-static const char* WSAGetErrorString(int Error)
+
+// Queues slot i for the app to look for messages on, from either side. Only used with S.OnMessage.
+static void MicroWSRecvNotify(uint32_t i)
 {
-	switch(Error)
+	// seq_cst, pairs with the app side clearing it before it reads the ring
+	if(!MicroWSGetConnection(i).RecvNotify.exchange(1, std::memory_order_seq_cst))
+		MicroWSQueuePush(MicroWSShardOf(i).Received, i);
+}
+
+// io side -> app side: wakes MicroWSWait, at most once per arming. Without io threads only MicroWSWait arms it, for the
+// io step it runs itself
+static void MicroWSWakeApp()
+{
+#if defined(__linux__)
+	std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with MicroWSWaitArm arming it before it looks for work
+	if(S.AppArmed.load(std::memory_order_relaxed) == 1 && S.AppArmed.exchange(0, std::memory_order_relaxed) == 1)
 	{
-	case WSAEINTR:
-		return "WSAEINTR";
-	case WSAEBADF:
-		return "WSAEBADF";
-	case WSAEACCES:
-		return "WSAEACCES";
-	case WSAEFAULT:
-		return "WSAEFAULT";
-	case WSAEINVAL:
-		return "WSAEINVAL";
-	case WSAEMFILE:
-		return "WSAEMFILE";
-	case WSAEWOULDBLOCK:
-		return "WSAEWOULDBLOCK";
-	case WSAEINPROGRESS:
-		return "WSAEINPROGRESS";
+		// a write that lands after the app drained and re-armed only makes the fd readable once for nothing
+		uint64_t One = 1;
+		if(write(S.AppWakeFd, &One, sizeof(One)) < 0)
+			mws_log(MICROWS_INVALID_CONNECTION, "wake failed: %d:%s\n", errno, strerror(errno));
+	}
+#endif
+}
+
+// io side: new bytes went into the receive ring of slot i
+static void MicroWSRecvArrived(uint32_t i)
+{
+	if(S.OnMessage && MicroWSOpen(i))
+		MicroWSRecvNotify(i);
+	MicroWSWakeApp();
+}
+
+// app side: picks up connections the io side opened or closed
+static void MicroWSAppEvents()
+{
+	for(uint32_t h = 0; h < S.NumShards; ++h)
+	{
+		uint32_t Event;
+		while(MicroWSQueuePop(S.Shards[h].Events, &Event))
+		{
+			uint32_t		   i = Event >> 1;
+			MicroWSConnection& C = MicroWSGetConnection(i);
+			if((Event & 1) == MICROWS_EVENT_OPEN)
+			{
+				C.Users.store(1, std::memory_order_relaxed);
+				C.DeflateLevel	 = S.DeflateLevel;
+				C.DeflateMinSize = S.DeflateMinSize;
+				C.AppId.store(C.Open, std::memory_order_release);
+				C.AppIndex			  = S.NumApp;
+				S.AppList[S.NumApp++] = i;
+				if(S.OnOpen)
+					S.OnOpen(C.Open, S.CallbackUser);
+				if(S.OnMessage)
+					MicroWSRecvNotify(i); // whatever came in with the handshake
+			}
+			else
+			{
+				if(S.OnClose)
+					S.OnClose(C.AppId, S.CallbackUser);
+				uint32_t Last						= S.AppList[--S.NumApp];
+				S.AppList[C.AppIndex]				= Last;
+				MicroWSGetConnection(Last).AppIndex = C.AppIndex;
+				C.AppId.store(MICROWS_INVALID_CONNECTION, std::memory_order_release);
+				free(C.Arena);
+				C.Arena			= nullptr;
+				C.ArenaCapacity = 0;
+				MicroWSDeflateFree(i);
+				MicroWSLatestFree(i);
+				MicroWSTopicLeaveAll(i);
+				if(C.Users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					MicroWSAppCommand(i, MICROWS_COMMAND_RELEASE); // the slot can be reused now that the app is done with it
+			}
+			S.ConnectionVersion++;
+		}
+	}
+}
+
+// app side slot of a connection id the app knows about, or MICROWS_INVALID_CONNECTION
+static uint32_t MicroWSAppIndex(uint32_t ConnectionId)
+{
+	uint32_t Index = MicroWSConnectionIndex(ConnectionId);
+	if(Index == MICROWS_INVALID_CONNECTION || MicroWSGetConnection(Index).AppId != ConnectionId)
+		return MICROWS_INVALID_CONNECTION;
+	return Index;
+}
+
+// Offset just past the "\r\n\r\n" ending the request, or 0. Only looks at bytes from Start on, the caller remembers how
+// far it got so a request arriving in pieces is never rescanned. Finds '\n' and checks the 3 bytes before it.
+static uint32_t MicroWSFindTerminator(const uint8_t* Data, uint32_t Start, uint32_t Size)
+{
+	uint32_t i = Start;
+#if MICROWS_SIMD_X64
+	const __m128i NewLine = _mm_set1_epi8('\n');
+	for(; i + 16 <= Size; i += 16)
+	{
+		uint32_t Bits = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(Data + i)), NewLine));
+		while(Bits)
+		{
+#if defined(_MSC_VER) && !defined(__clang__)
+			unsigned long Bit;
+			_BitScanForward(&Bit, Bits);
+#else
+			uint32_t Bit = (uint32_t)__builtin_ctz(Bits);
+#endif
+			uint32_t j = i + Bit;
+			if(j >= 3 && 0 == memcmp(Data + j - 3, "\r\n\r\n", 4))
+				return j + 1;
+			Bits &= Bits - 1;
+		}
+	}
+#endif
+	while(i < Size)
+	{
+		const uint8_t* NewLine = (const uint8_t*)memchr(Data + i, '\n', Size - i);
+		if(!NewLine)
+			break;
+		uint32_t j = (uint32_t)(NewLine - Data);
+		if(j >= 3 && 0 == memcmp(Data + j - 3, "\r\n\r\n", 4))
+			return j + 1;
+		i = j + 1;
+	}
+	return 0;
+}
+
+// header names are case insensitive. Lower is the lower case name, which only has letters, digits and '-'
+static bool MicroWSHeaderIs(const char* Name, uint32_t Len, const char* Lower, uint32_t LowerLen)
+{
+	if(Len != LowerLen)
+		return false;
+	for(uint32_t i = 0; i < Len; ++i)
+	{
+		char c = Name[i];
+		if(c >= 'A' && c <= 'Z')
+			c |= 0x20; // only letters fold, '@' isn't '`'
+		if(c != Lower[i])
+			return false;
+	}
+	return true;
+}
+
+struct MicroWSHttpRequest
+{
+	const char* Key = nullptr; // Sec-WebSocket-Key
+	uint32_t	KeyLen = 0;
+	MicroWSDeflateParams Deflate; // the permessage-deflate offer we accept, if any
+};
+
+#if MICROWS_DEFLATE
+static bool MicroWSTokenIs(const char* Token, const char* TokenEnd, const char* Name)
+{
+	size_t Len = strlen(Name);
+	return (size_t)(TokenEnd - Token) == Len && 0 == memcmp(Token, Name, Len);
+}
+
+// Window bits parameter value, 8-15 and optionally quoted. Returns 0 if it isn't valid.
+static uint32_t MicroWSParseWindowBits(const char* Value, const char* ValueEnd)
+{
+	if(ValueEnd - Value == 3 && Value[0] == '"' && ValueEnd[-1] == '"')
+		Value++, ValueEnd--;
+	uint32_t Bits = 0;
+	for(; Value < ValueEnd && Bits < 16; ++Value)
+	{
+		if(*Value < '0' || *Value > '9')
+			return 0;
+		Bits = Bits * 10 + (*Value - '0');
+	}
+	return Bits >= 8 && Bits <= 15 ? Bits : 0;
+}
+
+// Accepts the first permessage-deflate offer in a Sec-WebSocket-Extensions value that we can honor, RFC 7692 section 7.
+// Offers with unknown, repeated or invalid parameters are declined.
+static void MicroWSParseDeflate(const char* Value, const char* End, MicroWSDeflateParams& Out)
+{
+	while(Value < End && !Out.Enabled)
+	{
+		const char* OfferEnd = (const char*)memchr(Value, ',', End - Value);
+		if(!OfferEnd)
+			OfferEnd = End;
+		MicroWSDeflateParams P;
+		bool				 Accept		= true;
+		uint32_t			 NumParams	= 0;
+		uint32_t			 ServerBits = 0, ClientBits = 0;
+		bool				 ClientBitsOffered = false;
+		for(const char* Param = Value; Param < OfferEnd && Accept; ++NumParams)
+		{
+			const char* ParamEnd = (const char*)memchr(Param, ';', OfferEnd - Param);
+			if(!ParamEnd)
+				ParamEnd = OfferEnd;
+			const char* NameEnd = ParamEnd;
+			while(Param < NameEnd && (*Param == ' ' || *Param == '\t'))
+				Param++;
+			while(NameEnd > Param && (NameEnd[-1] == ' ' || NameEnd[-1] == '\t'))
+				NameEnd--;
+			const char* Equals = (const char*)memchr(Param, '=', NameEnd - Param);
+			const char* Arg	   = Equals ? Equals + 1 : nullptr;
+			if(Equals)
+			{
+				const char* ArgEnd = NameEnd;
+				NameEnd			   = Equals;
+				while(NameEnd > Param && NameEnd[-1] == ' ')
+					NameEnd--;
+				while(Arg < ArgEnd && *Arg == ' ')
+					Arg++;
+				if(MicroWSTokenIs(Param, NameEnd, "server_max_window_bits") && !ServerBits)
+				{
+					ServerBits = MicroWSParseWindowBits(Arg, ArgEnd);
+					Accept	   = ServerBits != 0;
+				}
+				else if(MicroWSTokenIs(Param, NameEnd, "client_max_window_bits") && !ClientBitsOffered)
+				{
+					ClientBits		  = MicroWSParseWindowBits(Arg, ArgEnd);
+					ClientBitsOffered = true;
+					Accept			  = ClientBits != 0;
+				}
+				else
+				{
+					Accept = false;
+				}
+			}
+			else if(NumParams == 0)
+				Accept = MicroWSTokenIs(Param, NameEnd, "permessage-deflate");
+			else if(MicroWSTokenIs(Param, NameEnd, "server_no_context_takeover") && !P.ServerReset)
+				P.ServerReset = 1;
+			else if(MicroWSTokenIs(Param, NameEnd, "client_no_context_takeover") && !P.ClientReset)
+				P.ClientReset = 1;
+			else if(MicroWSTokenIs(Param, NameEnd, "client_max_window_bits") && !ClientBitsOffered)
+			{
+				ClientBits		  = 15;
+				ClientBitsOffered = true;
+			}
+			else
+				Accept = false;
+			Param = ParamEnd + 1;
+		}
+		Value = OfferEnd + 1;
+		if(!Accept || !NumParams)
+			continue;
+		// a client asking for a window of 8 bits gets declined: zlib only compresses with 9 or more
+		P.ServerBits = (uint8_t)MicroWSMin<uint32_t>(S.DeflateWindowBits, ServerBits ? ServerBits : 15);
+		if(P.ServerBits < 9)
+			continue;
+		P.ReplyServerBits = ServerBits || P.ServerBits < 15;
+		// we may only limit the client's window if it says it can do that
+		P.ClientBits	  = ClientBitsOffered ? (uint8_t)MicroWSMin<uint32_t>(S.DeflateClientWindowBits, ClientBits) : 15;
+		P.ReplyClientBits = ClientBitsOffered && P.ClientBits < 15;
+		P.ServerReset	  = P.ServerReset || !S.DeflateContextTakeover;
+		P.ClientReset	  = !S.DeflateContextTakeover;
+		P.Enabled		  = 1;
+		Out				  = P;
+	}
+}
+#endif
+
+// Tokenizes a complete request in one pass over its lines. Returns false if it isn't a GET request.
+static bool MicroWSParseRequest(const char* Req, uint32_t Size, MicroWSHttpRequest& Out)
+{
+	const char* End = Req + Size;
+	if(Size < 4 || 0 != memcmp(Req, "GET ", 4))
+		return false;
+	const char* Line = (const char*)memchr(Req, '\n', Size);
+	while(Line && ++Line < End)
+	{
+		const char* LineEnd = (const char*)memchr(Line, '\n', End - Line);
+		if(!LineEnd)
+			break;
+		const char* ValueEnd = LineEnd;
+		if(ValueEnd > Line && ValueEnd[-1] == '\r')
+			ValueEnd--;
+		const char* Colon = (const char*)memchr(Line, ':', ValueEnd - Line);
+		if(Colon)
+		{
+			const char* Value = Colon + 1;
+			while(Value < ValueEnd && (*Value == ' ' || *Value == '\t'))
+				Value++;
+			while(ValueEnd > Value && (ValueEnd[-1] == ' ' || ValueEnd[-1] == '\t'))
+				ValueEnd--;
+			uint32_t NameLen = (uint32_t)(Colon - Line);
+#define MICROWS_HEADER(Name) MicroWSHeaderIs(Line, NameLen, Name, sizeof(Name) - 1)
+			if(MICROWS_HEADER("sec-websocket-key"))
+			{
+				Out.Key	   = Value;
+				Out.KeyLen = (uint32_t)(ValueEnd - Value);
+			}
+#if MICROWS_DEFLATE
+			else if(MICROWS_HEADER("sec-websocket-extensions") && S.Deflate)
+			{
+				MicroWSParseDeflate(Value, ValueEnd, Out.Deflate);
+			}
+#endif
+#undef MICROWS_HEADER
+		}
+		Line = LineEnd;
+	}
+	return true;
+}
+
+static bool MicroWSTryAccept(uint32_t Index)
+{
+	MicroWSConnection& C		 = MicroWSGetConnection(Index);
+	bool			   IsOpen	 = MicroWSOpen(Index);
+	bool			   IsOpening = MicroWSOpening(Index);
+	MWS_ASSERT(!IsOpen);
+	MWS_ASSERT(IsOpening);
+
+	uint32_t Put   = C.RecvPut.load(std::memory_order_relaxed);
+	uint32_t Get   = C.RecvGet.load(std::memory_order_relaxed); // the app doesn't know about the connection yet
+	uint8_t* Data  = C.RecvBuffer + Get;
+	uint32_t Bytes = MicroWSGetSpace(Get, Put, C.RecvSize);
+	if(Bytes > C.HandshakeScan)
+	{
+		mws_log(C.Opening, "->TRY_ACCEPT\n");
+		uint32_t RequestSize = MicroWSFindTerminator(Data, C.HandshakeScan, Bytes);
+		C.HandshakeScan		 = Bytes;
+		if(!RequestSize)
+		{
+			if(Bytes >= MICROWS_HANDSHAKE_MAX_SIZE)
+			{
+				mws_log(C.Opening, "->CLOSE (handshake larger than %d bytes)\n", (int)MICROWS_HANDSHAKE_MAX_SIZE);
+				MicroWSClose(Index);
+			}
+			return false;
+		}
+
+		MicroWSHttpRequest Req;
+		if(MicroWSParseRequest((const char*)Data, RequestSize, Req) && Req.Key)
+		{
+			const char* pGUID	   = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+			const char* pHandShake = "HTTP/1.1 101 Switching Protocols\r\n"
+									 "Upgrade: websocket\r\n"
+									 "Connection: Upgrade\r\n"
+									 "Sec-WebSocket-Accept: ";
+
+			char EncodeBuffer[512];
+			int	 nLen = stbsp_snprintf(EncodeBuffer, sizeof(EncodeBuffer) - 1, "%.*s%s", (int)MicroWSMin(Req.KeyLen, 256u), Req.Key, pGUID);
+
+			uint8_t			 sha[20];
+			MicroWS_SHA1_CTX ctx;
+			MicroWS_SHA1_Init(&ctx);
+			MicroWS_SHA1_Update(&ctx, (unsigned char*)EncodeBuffer, nLen);
+			MicroWS_SHA1_Final((unsigned char*)&sha[0], &ctx);
+			char HashOut[(2 + sizeof(sha) / 3) * 4];
+			memset(&HashOut[0], 0, sizeof(HashOut));
+			MicroWSBase64Encode(&HashOut[0], &sha[0], sizeof(sha));
+
+			char Reply[1024];
+			nLen = stbsp_snprintf(Reply, sizeof(Reply) - 1, "%s%s\r\n", pHandShake, HashOut);
+			const MicroWSDeflateParams& D = Req.Deflate;
+			if(D.Enabled)
+			{
+				nLen += stbsp_snprintf(Reply + nLen, sizeof(Reply) - 1 - nLen, "Sec-WebSocket-Extensions: permessage-deflate%s%s",
+									   D.ServerReset ? "; server_no_context_takeover" : "", D.ClientReset ? "; client_no_context_takeover" : "");
+				if(D.ReplyServerBits)
+					nLen += stbsp_snprintf(Reply + nLen, sizeof(Reply) - 1 - nLen, "; server_max_window_bits=%d", D.ServerBits);
+				if(D.ReplyClientBits)
+					nLen += stbsp_snprintf(Reply + nLen, sizeof(Reply) - 1 - nLen, "; client_max_window_bits=%d", D.ClientBits);
+				nLen += stbsp_snprintf(Reply + nLen, sizeof(Reply) - 1 - nLen, "\r\n");
+			}
+			nLen += stbsp_snprintf(Reply + nLen, sizeof(Reply) - 1 - nLen, "\r\n");
+			MWS_ASSERT(nLen < 1024 && nLen >= 0);
+			MicroWSSendRaw(C.Opening, (uint8_t*)&Reply[0], nLen);
+			C.Deflate = D;
+
+			C.RecvGet.store(MicroWSGetAdvance(Get, Put, RequestSize, C.RecvSize), std::memory_order_relaxed);
+			MicroWSShard& H = MicroWSShardOf(Index);
+			C.Open			= C.Opening;
+			H.NumOpen++;
+			mws_log(C.Open, "->OPEN\n");
+			MicroWSQueuePush(H.Events, (Index << 1) | MICROWS_EVENT_OPEN);
+			MicroWSWakeApp();
+			return true;
+		}
+		else
+		{
+			// a complete request that isn't a websocket upgrade will never become one
+			mws_log(C.Opening, "->CLOSE (No web socket key)\n");
+			MicroWSClose(Index);
+		}
+	}
+	return false;
+}
+#ifdef _WIN32
+static const char* WSAGetErrorString(int Error)
+{
+	switch(Error)
+	{
+	case WSAEINTR:
+		return "WSAEINTR";
+	case WSAEBADF:
+		return "WSAEBADF";
+	case WSAEACCES:
+		return "WSAEACCES";
+	case WSAEFAULT:
+		return "WSAEFAULT";
+	case WSAEINVAL:
+		return "WSAEINVAL";
+	case WSAEMFILE:
+		return "WSAEMFILE";
+	case WSAEWOULDBLOCK:
+		return "WSAEWOULDBLOCK";
+	case WSAEINPROGRESS:
+		return "WSAEINPROGRESS";
 	case WSAEALREADY:
 		return "WSAEALREADY";
 	case WSAENOTSOCK:
@@ -477,7 +1580,12 @@ static const char* WSAGetErrorString(int Error)
 
 static void MicroWSClose(uint32_t i)
 {
-	MicroWSConnection& C = S.Connections[i];
+	MicroWSShard& H = MicroWSShardOf(i);
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	MicroWSTimerUnlink(i);
+#if MICROWS_EPOLL
+	MicroWSEpollRemove(i);
+#endif
 	shutdown(C.Socket, 2);
 #ifdef _WIN32
 	closesocket(C.Socket);
@@ -485,9 +1593,23 @@ static void MicroWSClose(uint32_t i)
 	close(C.Socket);
 #endif
 
-	C.Socket = INVALID_SOCKET;
+	C.Socket	 = INVALID_SOCKET;
+	bool WasOpen = MicroWSOpen(i);
+	if(WasOpen)
+		H.NumOpen--;
 	C.Open = C.Closed = C.Opening;
-	S.ConnectionVersion++;
+
+	uint32_t Last						 = H.LiveList[--H.NumLive];
+	H.LiveList[C.LiveIndex]				 = Last;
+	MicroWSGetConnection(Last).LiveIndex = C.LiveIndex;
+	// once the app has seen a connection, the slot is only reused after it has also seen it close
+	if(WasOpen)
+	{
+		MicroWSQueuePush(H.Events, (i << 1) | MICROWS_EVENT_CLOSE);
+		MicroWSWakeApp();
+	}
+	else
+		MicroWSReleaseSlot(i);
 }
 
 static void MicroWSCheckError(uint32_t i, int Error)
@@ -497,7 +1619,7 @@ static void MicroWSCheckError(uint32_t i, int Error)
 #ifdef _WIN32
 	if(Error == SOCKET_ERROR)
 	{
-		MicroWSConnection& C	= S.Connections[i];
+		MicroWSConnection& C	= MicroWSGetConnection(i);
 		int				   err1 = WSAGetLastError();
 		switch(err1)
 		{
@@ -516,11 +1638,11 @@ static void MicroWSCheckError(uint32_t i, int Error)
 #else
 	if(Error < 0)
 	{
-		MicroWSConnection& C	= S.Connections[i];
+		MicroWSConnection& C	= MicroWSGetConnection(i);
 		if(errno == EAGAIN)
 			return;
 
-		if(errno == EPIPE)
+		if(errno == EPIPE || errno == ECONNRESET)
 		{
 			mws_log(C.Opening, "->CLOSE (errno %d:%s)\n", errno, strerror(errno));
 			MicroWSClose(i);
@@ -545,13 +1667,21 @@ static void MicroWSCheckError(uint32_t i, int Error)
 #endif
 
 }
-static uint32_t MicroWSDrain()
+static void MicroWSDrain(MicroWSShard& H)
 {
-	uint32_t FailCount		  = 0;
-	uint32_t MaxDataAvailable = 0;
-	for(uint32_t i = 0; i < MICROWS_MAX_CONNECTIONS; ++i)
+#if MICROWS_IO_URING
+	if(H.Backend == MICROWS_BACKEND_IO_URING)
+		return MicroWSDrainUring(H);
+#endif
+#if MICROWS_EPOLL
+	if(H.Backend == MICROWS_BACKEND_EPOLL)
+		return MicroWSDrainEpoll(H);
+#endif
+	// backwards, closing a connection moves the last live one into its place
+	for(uint32_t l = H.NumLive; l > 0; --l)
 	{
-		MicroWSConnection& C		 = S.Connections[i];
+		uint32_t		   i		 = H.LiveList[l - 1];
+		MicroWSConnection& C		 = MicroWSGetConnection(i);
 		bool			   IsOpen	 = MicroWSOpen(i);
 		bool			   IsOpening = MicroWSOpening(i);
 #ifdef _WIN32
@@ -561,23 +1691,37 @@ static uint32_t MicroWSDrain()
 #endif
 		if(IsOpen || IsOpening)
 		{
-			// read everything possible
+			// read everything possible, up to the receive budget
+			uint32_t Budget = S.RecvBudgetBytes ? S.RecvBudgetBytes : 0xffffffff;
+			uint32_t Put	= C.RecvPut.load(std::memory_order_relaxed);
+			uint32_t Get	= C.RecvGet.load(std::memory_order_acquire);
+			while(true)
 			{
-				uint32_t Put	  = C.RecvPut;
-				uint32_t Get	  = C.RecvGet;
-				uint32_t PutSpace = MicroWSPutSpace(Put, Get);
+				uint32_t PutSpace = MicroWSMin(MicroWSPutSpace(Put, Get, C.RecvSize), Budget);
 				int		 Bytes	  = recv(C.Socket, (char*)C.RecvBuffer + Put, PutSpace, SOCK_FLAG);
 				if(Bytes > 0)
 				{
-					Put		  = MicroWSPutAdvance(Put, Get, (uint32_t)Bytes);
-					C.RecvPut = Put;
+					Put = MicroWSPutAdvance(Put, Get, (uint32_t)Bytes, C.RecvSize);
+					C.RecvPut.store(Put, std::memory_order_release);
+					C.LastRecv = H.Now;
+					MicroWSRecvArrived(i);
+					Budget -= (uint32_t)Bytes;
+					if((uint32_t)Bytes < PutSpace || !Budget || !MicroWSPutSpace(Put, Get, C.RecvSize))
+						break; // short read means the socket is empty
 				}
-				else if(Bytes < 0)
+				else
 				{
-					MicroWSCheckError(i, Bytes);
+					if(Bytes == 0 && PutSpace)
+					{
+						mws_log(C.Opening, "->CLOSE (peer)\n");
+						MicroWSClose(i);
+					}
+					else if(Bytes < 0)
+					{
+						MicroWSCheckError(i, Bytes);
+					}
+					break;
 				}
-				uint32_t DataAvailable = MicroWSGetSpace(Get, Put);
-				MaxDataAvailable	   = MaxDataAvailable > DataAvailable ? MaxDataAvailable : DataAvailable;
 			}
 		}
 		IsOpen	  = MicroWSOpen(i);
@@ -591,16 +1735,13 @@ static uint32_t MicroWSDrain()
 		if(IsOpen || IsOpening)
 		{
 			// write everything possible.
+			if(MicroWSSendPending(i))
 			{
-				uint32_t Put	  = C.SendPut;
-				uint32_t Get	  = C.SendGet;
-				uint32_t GetSpace = MicroWSGetSpace(Get, Put);
-				
-				int		 Bytes	  = send(C.Socket, (char*)C.SendBuffer + Get, GetSpace, SOCK_FLAG);
+				uint32_t Queued;
+				int		 Bytes = MicroWSSendQueued(i, &Queued);
 				if(Bytes > 0)
 				{
-					Get		  = MicroWSGetAdvance(Get, Put, (uint32_t)Bytes);
-					C.SendGet = Get;
+					MicroWSSendAdvance(i, (uint32_t)Bytes);
 				}
 				else if(Bytes < 0)
 				{
@@ -609,517 +1750,3533 @@ static uint32_t MicroWSDrain()
 			}
 		}
 	}
-	return MaxDataAvailable;
 }
 static uint32_t MicroWSSendRaw(uint32_t ConnectionId, uint8_t* Data, uint32_t Size)
 {
-	uint32_t FailCount = 0;
-	for(uint32_t i = 0; i < MICROWS_MAX_CONNECTIONS; ++i)
+	uint32_t Index = MicroWSConnectionIndex(ConnectionId);
+	if(Index == MICROWS_INVALID_CONNECTION)
+		return 1;
+	MicroWSConnection& C = MicroWSGetConnection(Index);
+	if((C.Open != ConnectionId && C.Opening != ConnectionId) || C.Closed == ConnectionId)
+		return 1;
+	uint32_t Pos, Ticket;
+	if(!MicroWSSendReserve(Index, Size, false, &Pos, &Ticket))
+		return 1;
+	memcpy(C.SendBuffer + Pos, Data, Size);
+	MicroWSSendCommit(Index, Ticket, Pos, Size, Size);
+	MicroWSMarkReady(Index);
+	return 0;
+}
+
+// Space for new messages after what has been reserved. Bytes in shared frames count against the ring, so a slow
+// connection pushes back the same way whether it's behind on broadcasts or on its own messages.
+static uint32_t MicroWSSendSpace(uint32_t i, uint32_t Put)
+{
+	MicroWSConnection& C		   = MicroWSGetConnection(i);
+	uint32_t		   Space	   = MicroWSPutSpace(Put, C.SendGet.load(std::memory_order_acquire), C.SendSize.load(std::memory_order_relaxed));
+	uint32_t		   SharedBytes = C.SharedBytes.load(std::memory_order_relaxed);
+	return Space > SharedBytes ? Space - SharedBytes : 0;
+}
+
+static void MicroWSSendReset(uint32_t i)
+{
+	// tickets keep counting, so spans committed before the slot was reused never look committed again
+	MicroWSConnection& C	  = MicroWSGetConnection(i);
+	uint32_t		   Ticket = (uint32_t)(C.SendReserve.load(std::memory_order_relaxed) >> 32);
+	C.SendReserve.store((uint64_t)Ticket << 32, std::memory_order_relaxed);
+	C.SendTicket.store(Ticket, std::memory_order_relaxed);
+	C.SendPut.store(0, std::memory_order_relaxed);
+	C.SendGet.store(0, std::memory_order_relaxed);
+}
+
+// Reserves Bytes of the send ring of slot i, from any thread. Producers only contend on the compare exchange, and
+// write their bytes in parallel once they have their span. Fails if there isn't room, if MICROWS_SEND_RESERVATIONS
+// spans are already waiting for the io side, if a stream is sending and the span isn't one that can Interleave with
+// its fragments: the fragments themselves and control frames, or if a close frame has been reserved. Close reserves one.
+// Waits while the io side resizes the ring, which only takes a copy of what's unsent.
+static bool MicroWSSendReserve(uint32_t i, uint32_t Bytes, bool Interleave, uint32_t* Pos, uint32_t* Ticket, bool Close)
+{
+	MicroWSConnection& C	   = MicroWSGetConnection(i);
+	uint64_t		   Reserve = C.SendReserve.load(std::memory_order_acquire);
+	uint64_t		   Next;
+	do
 	{
-		MicroWSConnection& C = S.Connections[i];
-		if(((C.Open == ConnectionId || C.Opening == ConnectionId) && C.Closed != ConnectionId) || (ConnectionId == MICROWS_INVALID_CONNECTION && MicroWSOpen(i)))
-		{
-			uint32_t Put   = C.SendPut;
-			uint32_t Get   = C.SendGet;
-			uint32_t Bytes = MicroWSPutSpace(Put, Get);
-			if(Bytes < Size)
-			{
-				FailCount++;
-				continue;
-			}
-			memcpy(C.SendBuffer + Put, Data, Size);
-			C.SendPut = MicroWSPutAdvance(Put, Get, Size);
-		}
-	}
-	return FailCount;
+		while((uint32_t)Reserve & MICROWS_SEND_RESIZING)
+			Reserve = C.SendReserve.load(std::memory_order_acquire);
+		uint32_t Flags = (uint32_t)Reserve & MICROWS_SEND_FLAGS;
+		*Pos		   = (uint32_t)Reserve & ~MICROWS_SEND_FLAGS;
+		*Ticket		   = (uint32_t)(Reserve >> 32);
+		if(((Flags & MICROWS_SEND_STREAMING) && !Interleave) || (Flags & MICROWS_SEND_CLOSED))
+			return false;
+		if(*Ticket - C.SendTicket.load(std::memory_order_acquire) >= MICROWS_SEND_RESERVATIONS)
+			return false;
+		if(MicroWSSendSpace(i, *Pos) < Bytes)
+			return false;
+		// Reserve may be stale and Pos already sent, but then the exchange fails
+		Next = ((uint64_t)(*Ticket + 1) << 32) | MicroWSRingPos(*Pos, Bytes, C.SendSize.load(std::memory_order_relaxed)) | Flags | (Close ? MICROWS_SEND_CLOSED : 0);
+	} while(!C.SendReserve.compare_exchange_weak(Reserve, Next, std::memory_order_acquire, std::memory_order_acquire));
+	C.SendSpans[*Ticket % MICROWS_SEND_RESERVATIONS].End = (uint32_t)Next & ~MICROWS_SEND_FLAGS;
+	return true;
 }
 
-#ifdef _WIN32
-static void* MicroWSAllocRing()
+// Fills Bytes of the send ring with unsolicited pong frames, which clients ignore. Has to be at least 2, the smallest frame.
+static void MicroWSWritePadding(uint8_t* Dst, uint32_t Bytes)
 {
-	// Stolen from https://learn.microsoft.com/en-us/windows/win32/api/memoryapi/nf-memoryapi-virtualalloc2#examples
-	HANDLE		 Section = nullptr;
-	SYSTEM_INFO	 SysInfo;
-	void*		 RingBuffer	  = nullptr;
-	void*		 Placeholder1 = nullptr;
-	void*		 Placeholder2 = nullptr;
-	void*		 View1		  = nullptr;
-	void*		 View2		  = nullptr;
-	const size_t BufferSize	  = MICROWS_BUFFER_SPACE;
+	MWS_ASSERT(Bytes >= 2);
+	while(Bytes)
+	{
+		uint32_t Frame = Bytes <= 127 ? Bytes : Bytes - 127 >= 2 ? 127 : 125;
+		Dst[0]		   = 0x80 | MICROWS_OPCODE_PONG; // FIN
+		Dst[1]		   = (uint8_t)(Frame - 2);
+		memset(Dst + 2, 0, Frame - 2);
+		Dst += Frame;
+		Bytes -= Frame;
+	}
+}
 
-	GetSystemInfo(&SysInfo);
-	if((BufferSize % SysInfo.dwAllocationGranularity) != 0)
+// Hands a span to the io side once its bytes are written. Bytes is what was used of the Reserved bytes at Pos: the
+// span shrinks if nothing has been reserved after it, and the rest is padded otherwise.
+static void MicroWSSendCommit(uint32_t i, uint32_t Ticket, uint32_t Pos, uint32_t Reserved, uint32_t Bytes)
+{
+	MicroWSConnection& C	= MicroWSGetConnection(i);
+	MicroWSSendSpan&   Span = C.SendSpans[Ticket % MICROWS_SEND_RESERVATIONS];
+	if(Bytes < Reserved)
 	{
-		return nullptr;
+		uint32_t End	   = MicroWSRingPos(Pos, Bytes, C.SendSize.load(std::memory_order_relaxed));
+		uint32_t Flags	  = (uint32_t)C.SendReserve.load(std::memory_order_relaxed) & MICROWS_SEND_FLAGS;
+		uint64_t Expected = ((uint64_t)(Ticket + 1) << 32) | Span.End | Flags;
+		if(C.SendReserve.compare_exchange_strong(Expected, ((uint64_t)(Ticket + 1) << 32) | End | Flags, std::memory_order_release, std::memory_order_relaxed))
+			Span.End = End;
+		else
+			MicroWSWritePadding(C.SendBuffer + End, Reserved - Bytes);
 	}
+	// seq_cst, pairs with the io side clearing AppReady before it collects
+	Span.Committed.store(Ticket + 1, std::memory_order_seq_cst);
+}
 
-	Placeholder1 = (PCHAR)VirtualAlloc2(nullptr, nullptr, 2 * BufferSize, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0);
+// io side: moves SendPut past the spans committed since the last call, in the order they were reserved
+static void MicroWSSendCollect(uint32_t i)
+{
+	MicroWSConnection& C	  = MicroWSGetConnection(i);
+	uint32_t		   Ticket = C.SendTicket.load(std::memory_order_relaxed);
+	uint32_t		   Put	  = C.SendPut.load(std::memory_order_relaxed);
+	while(C.SendSpans[Ticket % MICROWS_SEND_RESERVATIONS].Committed.load(std::memory_order_seq_cst) == Ticket + 1)
+		Put = C.SendSpans[Ticket++ % MICROWS_SEND_RESERVATIONS].End;
+	C.SendPut.store(Put, std::memory_order_relaxed);
+	C.SendTicket.store(Ticket, std::memory_order_release); // the spans can be reserved again
+}
 
-	if(!Placeholder1)
+// io side: moves what's unsent on slot i into a new send ring of Size bytes. Producers wait on MICROWS_SEND_RESIZING
+// while it's copied. Returns false, to be tried again later, while a span is reserved but not committed, a stream or a
+// close frame has the ring, io_uring is sending from it, or what's unsent doesn't fit.
+static bool MicroWSSendResize(uint32_t i, uint32_t Size)
+{
+	MicroWSConnection& C	   = MicroWSGetConnection(i);
+	uint32_t		   OldSize = C.SendSize.load(std::memory_order_relaxed);
+	uint32_t		   Get	   = C.SendGet.load(std::memory_order_relaxed);
+	uint64_t		   Reserve = C.SendReserve.load(std::memory_order_relaxed);
+	if(C.UringSend || ((uint32_t)Reserve & MICROWS_SEND_FLAGS) || (uint32_t)(Reserve >> 32) != C.SendTicket.load(std::memory_order_relaxed))
+		return false;
+	if(MicroWSGetSpace(Get, C.SendPut.load(std::memory_order_relaxed), OldSize) >= Size)
+		return false;
+	uint8_t* Ring = MicroWSRingTake(MicroWSShardOf(i), Size);
+	if(!Ring)
+		return false;
+
+	// nothing can be reserved from here on, so once what was reserved before is collected the ring is the io side's
+	Reserve = C.SendReserve.fetch_or(MICROWS_SEND_RESIZING, std::memory_order_acquire);
+	MicroWSSendCollect(i);
+	uint32_t Ticket = C.SendTicket.load(std::memory_order_relaxed);
+	uint32_t Unsent = MicroWSGetSpace(Get, C.SendPut.load(std::memory_order_relaxed), OldSize);
+	if(((uint32_t)Reserve & MICROWS_SEND_FLAGS) || (uint32_t)(Reserve >> 32) != Ticket || Unsent >= Size)
 	{
-		mws_log(MICROWS_INVALID_CONNECTION, "VirtualAlloc2 failed, error %#x\n", GetLastError());
-		goto Exit;
+		C.SendReserve.fetch_and(~(uint64_t)MICROWS_SEND_RESIZING, std::memory_order_release);
+		MicroWSRingPut(MicroWSShardOf(i), Ring, Size);
+		return false;
 	}
-	if(FALSE == VirtualFree(Placeholder1, BufferSize, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER))
+	memcpy(Ring, C.SendBuffer + Get, Unsent); // contiguous in the second mapping
+	uint32_t Push = C.SharedPush.load(std::memory_order_acquire);
+	for(uint32_t f = C.SharedPop.load(std::memory_order_relaxed); f != Push; ++f)
 	{
-		mws_log(MICROWS_INVALID_CONNECTION, "VirtualFreeEx failed, error %#x\n", GetLastError());
-		goto Exit;
+		MicroWSSharedRef& Ref = C.Shared[f % MICROWS_SHARED_FRAMES];
+		Ref.RingPos			  = MicroWSGetSpace(Get, Ref.RingPos, OldSize);
 	}
-	Placeholder2 = (void*)((ULONG_PTR)Placeholder1 + BufferSize);
-	Section		 = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, BufferSize, nullptr);
-	if(!Section)
+	MicroWSRingPut(MicroWSShardOf(i), C.SendBuffer, OldSize);
+	C.SendBuffer = Ring;
+	C.SendSize.store(Size, std::memory_order_relaxed);
+	C.SendGet.store(0, std::memory_order_relaxed);
+	C.SendPut.store(Unsent, std::memory_order_relaxed);
+	// a new ticket, so a producer that loaded SendReserve before the resize can't mistake it for what it saw
+	C.SendTicket.store(Ticket + 1, std::memory_order_relaxed);
+	uint64_t Current = C.SendReserve.load(std::memory_order_relaxed);
+	uint64_t Next;
+	do
 	{
-		mws_log(MICROWS_INVALID_CONNECTION, "CreateFileMapping failed, error %#x\n", GetLastError());
-		goto Exit;
-	}
+		// the app may have set the other flags since
+		Next = ((uint64_t)(Ticket + 1) << 32) | Unsent | ((uint32_t)Current & (MICROWS_SEND_STREAMING | MICROWS_SEND_CLOSED));
+	} while(!C.SendReserve.compare_exchange_weak(Current, Next, std::memory_order_release, std::memory_order_relaxed));
+#if MICROWS_IO_URING
+	MicroWSUringRegisterSend(i);
+#endif
+	mws_log(C.Opening, "send ring %uKB -> %uKB\n", OldSize >> 10, Size >> 10);
+	return true;
+}
 
-	View1 = MapViewOfFile3(Section, nullptr, Placeholder1, 0, BufferSize, MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, nullptr, 0);
-	if(!View1)
+// io side: resizes the send ring of slot i to what the app asked for, doubles it when sends failed because it was full
+// since the last look, and halves it back towards its base size once none has failed for S.SendRingShrinkMs
+static void MicroWSSendAdapt(uint32_t i)
+{
+	MicroWSConnection& C	= MicroWSGetConnection(i);
+	uint32_t		   Now	= MicroWSShardOf(i).Now;
+	uint32_t		   Size = C.SendSize.load(std::memory_order_relaxed);
+	uint32_t		   Want = C.SendWant.load(std::memory_order_acquire);
+	if(Want)
 	{
-		mws_log(MICROWS_INVALID_CONNECTION, "MapViewOfFile3 failed, error %#x\n", GetLastError());
-		goto Exit;
+		if(Want == Size || MicroWSSendResize(i, Want))
+		{
+			C.SendBaseSize	 = Want;
+			C.SendQuietSince = Now;
+			C.SendWant.compare_exchange_strong(Want, 0, std::memory_order_relaxed); // unless it asked again meanwhile
+		}
+		return;
 	}
-	Placeholder1 = nullptr;
-	View2		 = MapViewOfFile3(Section, nullptr, Placeholder2, 0, BufferSize, MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, nullptr, 0);
-	if(!View2)
+	uint32_t Blocked = C.SendBlocked.load(std::memory_order_relaxed);
+	if(Blocked != C.SendBlockedSeen)
 	{
-		mws_log(MICROWS_INVALID_CONNECTION, "MapViewOfFile3 failed, error %#x\n", GetLastError());
-		goto Exit;
+		uint32_t Max	 = MicroWSMax(S.SendRingMaxSize, C.SendBaseSize);
+		C.SendQuietSince = Now;
+		if(Size < Max && !MicroWSSendResize(i, MicroWSRingSize(MicroWSMin(2 * Size, Max))))
+			return; // look again on the next send
+		C.SendBlockedSeen = Blocked;
+		if(Size < Max && S.SendRingShrinkMs && C.TimerSlot == MICROWS_TIMER_NONE)
+			MicroWSTimerSchedule(i, S.SendRingShrinkMs); // so it shrinks even if nothing is sent
+		return;
 	}
-	Placeholder2 = nullptr;
-	RingBuffer	 = View1;
-	View1		 = nullptr;
-	View2		 = nullptr;
-
-Exit:
-
-	if(Section)
+	if(Size > C.SendBaseSize && S.SendRingShrinkMs && Now - C.SendQuietSince >= S.SendRingShrinkMs)
 	{
-		CloseHandle(Section);
+		if(MicroWSSendResize(i, MicroWSMax(MicroWSRingSize(Size / 2), C.SendBaseSize)))
+			C.SendQuietSince = Now;
+	}
+}
+
+// io side: writes the next fragment of the message streaming on slot i into the send ring, as big as the ring allows.
+// Room for a control frame is left free, so a close frame can always go out before the stream is done.
+static void MicroWSSendStreamPump(uint32_t i)
+{
+	MicroWSConnection& C	 = MicroWSGetConnection(i);
+	uint32_t		   State = C.SendStream.load(std::memory_order_acquire);
+	if(State == MICROWS_STREAM_IDLE)
+		return;
+	uint64_t Left = C.SendStreamSize - C.SendStreamSent;
+	if(State == MICROWS_STREAM_SENDING)
+	{
+		uint32_t Space = MicroWSSendSpace(i, (uint32_t)C.SendReserve.load(std::memory_order_relaxed) & ~MICROWS_SEND_FLAGS);
+		uint32_t Need  = Left < MICROWS_SEND_FRAGMENT_MIN ? MicroWSHeaderSize((uint32_t)Left) + (uint32_t)Left : MICROWS_SEND_FRAGMENT_MIN;
+		if(Space < Need + MICROWS_CONTROL_FRAME_MAX)
+			return;
+		Space -= MICROWS_CONTROL_FRAME_MAX;
+		uint32_t Size  = (uint32_t)MicroWSMin<uint64_t>(Left, Space - MicroWSHeaderSize(Space));
+		uint32_t Bytes = MicroWSHeaderSize(Size) + Size;
+		uint32_t Pos, Ticket;
+		if(!MicroWSSendReserve(i, Bytes, true, &Pos, &Ticket))
+			return;
+		uint8_t* Dst		= C.SendBuffer + Pos;
+		uint32_t HeaderSize = MicroWSWriteHeader(Dst, Size, C.SendStreamSent ? MICROWS_OPCODE_CONTINUATION : MICROWS_OPCODE_TEXT);
+		if(Size < Left)
+			Dst[0] &= 0x7f; // FIN, more fragments follow
+		if(C.SendStreamCallback)
+			C.SendStreamCallback(C.Open, Dst + HeaderSize, Size, C.SendStreamSent, C.SendStreamUser);
+		else
+			memcpy(Dst + HeaderSize, C.SendStreamData + C.SendStreamSent, Size);
+		MicroWSSendCommit(i, Ticket, Pos, Bytes, Bytes);
+		C.SendStreamSent += Size;
+		Left -= Size;
+	}
+	if(!Left || State == MICROWS_STREAM_CANCEL)
+	{
+		C.SendReserve.fetch_and(~(uint64_t)MICROWS_SEND_STREAMING, std::memory_order_relaxed);
+		C.SendStream.store(MICROWS_STREAM_IDLE, std::memory_order_release); // the app can reuse its buffer
+	}
+}
+
+static bool MicroWSSendPending(uint32_t i)
+{
+	MicroWSSendStreamPump(i);
+	MicroWSSendCollect(i);
+	MicroWSSendAdapt(i);
+	MicroWSConnection& C   = MicroWSGetConnection(i);
+	uint32_t		   Get = C.SendGet.load(std::memory_order_relaxed);
+	if(Get != C.SendPut.load(std::memory_order_relaxed))
+		return true;
+	uint32_t Pop = C.SharedPop.load(std::memory_order_relaxed);
+	if(Pop == C.SharedPush.load(std::memory_order_acquire))
+		return false;
+	return C.Shared[Pop % MICROWS_SHARED_FRAMES].RingPos == Get; // otherwise it goes after ring bytes not committed yet
+}
+
+// Fills Chunks with what is queued for sending, in order: ring bytes up to the first shared frame, the frame, ring bytes
+// up to the next one and so on. Returns the number of chunks.
+static uint32_t MicroWSSendChunks(uint32_t i, MicroWSSendChunk* Chunks, uint32_t MaxChunks, uint32_t* TotalBytes)
+{
+	// SendPut first: the app pushes a frame before committing its span, so this never sees ring bytes without the
+	// frames queued in front of them
+	MicroWSSendCollect(i);
+	MicroWSConnection& C		 = MicroWSGetConnection(i);
+	uint32_t		   Put		 = C.SendPut.load(std::memory_order_relaxed);
+	uint32_t		   Pop		 = C.SharedPop.load(std::memory_order_relaxed);
+	uint32_t		   NumShared = C.SharedPush.load(std::memory_order_acquire) - Pop;
+	uint32_t		   NumChunks = 0;
+	uint32_t		   Total	 = 0;
+	uint32_t		   Get		 = C.SendGet.load(std::memory_order_relaxed);
+	uint32_t		   Size		 = C.SendSize.load(std::memory_order_relaxed);
+	for(uint32_t f = 0; f <= NumShared && NumChunks < MaxChunks; ++f)
+	{
+		const MicroWSSharedRef* Ref = f < NumShared ? &C.Shared[(Pop + f) % MICROWS_SHARED_FRAMES] : nullptr;
+		if(Ref && MicroWSGetSpace(Get, Ref->RingPos, Size) > MicroWSGetSpace(Get, Put, Size))
+			Ref = nullptr; // queued after ring bytes that aren't committed yet
+		uint32_t				End = Ref ? Ref->RingPos : Put;
+		uint32_t				Bytes = MicroWSGetSpace(Get, End, Size);
+		if(Bytes)
+		{
+			Chunks[NumChunks].Ptr	 = C.SendBuffer + Get;
+			Chunks[NumChunks++].Size = Bytes;
+			Total += Bytes;
+			Get = End;
+		}
+		if(Ref && NumChunks < MaxChunks)
+		{
+			uint32_t Offset			 = f == 0 ? C.SharedOffset : 0;
+			Chunks[NumChunks].Ptr	 = Ref->Frame->Data + Offset;
+			Chunks[NumChunks++].Size = Ref->Frame->Size - Offset;
+			Total += Ref->Frame->Size - Offset;
+		}
+		if(!Ref)
+			break;
+	}
+	if(TotalBytes)
+		*TotalBytes = Total;
+	return NumChunks;
+}
+
+// Consumes sent bytes in the same order MicroWSSendChunks returns them
+static void MicroWSSendAdvance(uint32_t i, uint32_t Bytes)
+{
+	MicroWSConnection& C	= MicroWSGetConnection(i);
+	uint32_t		   Put	= C.SendPut.load(std::memory_order_acquire);
+	uint32_t		   Get	= C.SendGet.load(std::memory_order_relaxed);
+	uint32_t		   Size = C.SendSize.load(std::memory_order_relaxed);
+	while(Bytes)
+	{
+		uint32_t		  Pop		= C.SharedPop.load(std::memory_order_relaxed);
+		MicroWSSharedRef* Ref		= Pop != C.SharedPush.load(std::memory_order_acquire) ? &C.Shared[Pop % MICROWS_SHARED_FRAMES] : nullptr;
+		uint32_t		  RingBytes = MicroWSMin(Bytes, MicroWSGetSpace(Get, Ref ? Ref->RingPos : Put, Size));
+		Get							= MicroWSGetAdvance(Get, Put, RingBytes, Size);
+		C.SendGet.store(Get, std::memory_order_release);
+		Bytes -= RingBytes;
+		if(!Bytes)
+			break;
+		MWS_ASSERT(Ref);
+		uint32_t FrameBytes = MicroWSMin(Bytes, Ref->Frame->Size - C.SharedOffset);
+		C.SharedOffset += FrameBytes;
+		C.SharedBytes.fetch_sub(FrameBytes, std::memory_order_relaxed);
+		Bytes -= FrameBytes;
+		if(C.SharedOffset == Ref->Frame->Size)
+		{
+			MicroWSSharedRelease(Ref->Frame);
+			C.SharedPop.store(Pop + 1, std::memory_order_release);
+			C.SharedOffset = 0;
+		}
+	}
+}
+
+// One send call for everything queued, gathered when there are shared frames. Returns what send returns.
+static int MicroWSSendQueued(uint32_t i, uint32_t* TotalBytes)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	MicroWSSendChunk   Chunks[MICROWS_SEND_CHUNKS];
+#ifdef _WIN32
+	if(!MicroWSSendChunks(i, Chunks, 1, TotalBytes))
+		return 0;
+	return send(C.Socket, (char*)Chunks[0].Ptr, (int)Chunks[0].Size, 0);
+#else
+	uint32_t NumChunks = MicroWSSendChunks(i, Chunks, MICROWS_SEND_CHUNKS, TotalBytes);
+	if(NumChunks == 1)
+		return send(C.Socket, (char*)Chunks[0].Ptr, Chunks[0].Size, MSG_NOSIGNAL);
+	iovec Vecs[MICROWS_SEND_CHUNKS];
+	for(uint32_t j = 0; j < NumChunks; ++j)
+	{
+		Vecs[j].iov_base = Chunks[j].Ptr;
+		Vecs[j].iov_len	 = Chunks[j].Size;
+	}
+	msghdr Msg;
+	memset(&Msg, 0, sizeof(Msg));
+	Msg.msg_iov	   = Vecs;
+	Msg.msg_iovlen = NumChunks;
+	return (int)sendmsg(C.Socket, &Msg, MSG_NOSIGNAL);
+#endif
+}
+
+static void MicroWSSharedRelease(MicroWSSharedFrame* Frame)
+{
+	uint32_t RefCount = Frame->RefCount.fetch_sub(1, std::memory_order_acq_rel);
+	MWS_ASSERT(RefCount);
+	if(RefCount == 1)
+		free(Frame);
+}
+
+static void MicroWSSharedReset(uint32_t i)
+{
+	MicroWSConnection& C	= MicroWSGetConnection(i);
+	uint32_t		   Push = C.SharedPush.load(std::memory_order_acquire);
+	for(uint32_t f = C.SharedPop.load(std::memory_order_relaxed); f != Push; ++f)
+		MicroWSSharedRelease(C.Shared[f % MICROWS_SHARED_FRAMES].Frame);
+	C.SharedPush.store(0, std::memory_order_relaxed);
+	C.SharedPop.store(0, std::memory_order_relaxed);
+	C.SharedOffset = 0;
+	C.SharedBytes.store(0, std::memory_order_relaxed);
+}
+
+// Queue a connection for servicing by the next drain. Only the epoll backend keeps a ready list, the portable backend visits every slot anyway.
+static void MicroWSMarkReady(uint32_t i)
+{
+	MicroWSConnection& C	   = MicroWSGetConnection(i);
+	MicroWSShard&	   H	   = S.Shards[C.Shard];
+	uint8_t			   Closing = C.Closing.load(std::memory_order_acquire);
+	if(Closing != C.CloseSeen && MicroWSOpen(i))
+	{
+		// the app sent a close frame, or the peer answered ours. The timer closes the socket
+		if(!C.CloseSeen)
+			C.CloseStart = H.Now;
+		C.CloseSeen = Closing;
+		MicroWSTimerSchedule(i, 0);
+	}
+	if(H.Backend == MICROWS_BACKEND_POLL || C.InReadyList)
+		return;
+	C.InReadyList			 = 1;
+	H.ReadyList[H.NumReady++] = i;
+}
+
+#if MICROWS_EPOLL
+// Connections are registered edge triggered with data.u32 set to the slot index. The listener stays level triggered, so
+// it keeps being reported while there are pending connections we didn't accept because of MAX_CONNECTIONS_PER_UPDATE.
+#define MICROWS_EPOLL_LISTENER ((uint32_t)-1)
+#define MICROWS_EPOLL_WAKE ((uint32_t)-2)
+#define MICROWS_EPOLL_MAX_EVENTS 64
+
+static bool MicroWSEpollStart(MicroWSShard& H)
+{
+	H.EpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if(H.EpollFd < 0)
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "epoll_create1 failed (errno %d:%s), using portable backend\n", errno, strerror(errno));
+		H.EpollFd = -1;
+		return false;
+	}
+	struct epoll_event Event;
+	memset(&Event, 0, sizeof(Event));
+	Event.events   = EPOLLIN;
+	Event.data.u32 = MICROWS_EPOLL_LISTENER;
+	if(0 != epoll_ctl(H.EpollFd, EPOLL_CTL_ADD, H.ListenerSocket, &Event))
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "epoll_ctl listener failed (errno %d:%s), using portable backend\n", errno, strerror(errno));
+		MicroWSEpollStop(H);
+		return false;
+	}
+	if(H.WakeFd >= 0)
+	{
+		Event.data.u32 = MICROWS_EPOLL_WAKE;
+		if(0 != epoll_ctl(H.EpollFd, EPOLL_CTL_ADD, H.WakeFd, &Event))
+		{
+			mws_log(MICROWS_INVALID_CONNECTION, "epoll_ctl wake failed (errno %d:%s), using portable backend\n", errno, strerror(errno));
+			MicroWSEpollStop(H);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void MicroWSEpollStop(MicroWSShard& H)
+{
+	if(H.EpollFd >= 0)
+		close(H.EpollFd);
+	H.EpollFd = -1;
+}
+
+static void MicroWSEpollAdd(uint32_t i)
+{
+	MicroWSShard& H = MicroWSShardOf(i);
+	if(H.Backend != MICROWS_BACKEND_EPOLL)
+		return;
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	struct epoll_event Event;
+	memset(&Event, 0, sizeof(Event));
+	Event.events   = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	Event.data.u32 = i;
+	if(0 != epoll_ctl(H.EpollFd, EPOLL_CTL_ADD, C.Socket, &Event))
+	{
+		mws_error(C.Opening, "epoll_ctl add failed: %d:%s\n", errno, strerror(errno));
+	}
+	C.EpollEvents = Event.events;
+	// edge triggered epoll only reports transitions, so start out assuming both directions are ready
+	C.ReadReady	 = 1;
+	C.WriteReady = 1;
+	MicroWSMarkReady(i);
+}
+
+static void MicroWSEpollRemove(uint32_t i)
+{
+	MicroWSShard& H = MicroWSShardOf(i);
+	if(H.Backend != MICROWS_BACKEND_EPOLL)
+		return;
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	epoll_ctl(H.EpollFd, EPOLL_CTL_DEL, C.Socket, nullptr);
+	C.EpollEvents = 0;
+	C.ReadReady	  = 0;
+	C.WriteReady  = 0;
+}
+
+static void MicroWSEpollArmWrite(uint32_t i, bool Arm)
+{
+	MicroWSShard& H = MicroWSShardOf(i);
+	MicroWSConnection& C	  = MicroWSGetConnection(i);
+	uint32_t		   Events = EPOLLIN | EPOLLRDHUP | EPOLLET | (Arm ? (uint32_t)EPOLLOUT : 0);
+	if(Events == C.EpollEvents)
+		return;
+	struct epoll_event Event;
+	memset(&Event, 0, sizeof(Event));
+	Event.events   = Events;
+	Event.data.u32 = i;
+	if(0 != epoll_ctl(H.EpollFd, EPOLL_CTL_MOD, C.Socket, &Event))
+	{
+		mws_error(C.Opening, "epoll_ctl mod failed: %d:%s\n", errno, strerror(errno));
+	}
+	C.EpollEvents = Events;
+}
+
+// Timeout is only used for the first wait, the rest just picks up events that didn't fit
+static void MicroWSEpollWait(MicroWSShard& H, int Timeout)
+{
+	struct epoll_event Events[MICROWS_EPOLL_MAX_EVENTS];
+	int				   NumEvents;
+	do
+	{
+		NumEvents = epoll_wait(H.EpollFd, Events, MICROWS_EPOLL_MAX_EVENTS, Timeout);
+		Timeout	  = 0;
+		for(int j = 0; j < NumEvents; ++j)
+		{
+			uint32_t i = Events[j].data.u32;
+			if(i == MICROWS_EPOLL_LISTENER)
+			{
+				H.ListenerReady = true;
+				continue;
+			}
+			if(i == MICROWS_EPOLL_WAKE)
+			{
+				uint64_t Value;
+				if(read(H.WakeFd, &Value, sizeof(Value)) < 0 && errno != EAGAIN)
+					mws_log(MICROWS_INVALID_CONNECTION, "wake read failed: %d:%s\n", errno, strerror(errno));
+				continue;
+			}
+			MicroWSConnection& C = MicroWSGetConnection(i);
+			if(Events[j].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				C.ReadReady = 1;
+			if(Events[j].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+				C.WriteReady = 1;
+			MicroWSMarkReady(i);
+		}
+	} while(NumEvents == MICROWS_EPOLL_MAX_EVENTS);
+}
+
+// Same job as the portable drain, but only visits connections on the ready list: the ones epoll reported, the ones we
+// queued data on, and the ones that still have unread data because their receive ring was full.
+static void MicroWSDrainEpoll(MicroWSShard& H)
+{
+	uint32_t NumReady = H.NumReady;
+	H.NumReady		  = 0;
+	memcpy(H.DrainList, H.ReadyList, NumReady * sizeof(H.ReadyList[0]));
+	for(uint32_t r = 0; r < NumReady; ++r)
+	{
+		uint32_t		   i = H.DrainList[r];
+		MicroWSConnection& C = MicroWSGetConnection(i);
+		C.InReadyList		 = 0;
+		if(!MicroWSOpen(i) && !MicroWSOpening(i))
+			continue;
+
+		if(C.ReadReady)
+		{
+			uint32_t Budget	  = S.RecvBudgetBytes ? S.RecvBudgetBytes : 0xffffffff;
+			uint32_t Put	  = C.RecvPut.load(std::memory_order_relaxed);
+			uint32_t Get	  = C.RecvGet.load(std::memory_order_acquire);
+			uint32_t PutSpace = MicroWSMin(MicroWSPutSpace(Put, Get, C.RecvSize), Budget);
+			while(PutSpace)
+			{
+				int Bytes = recv(C.Socket, (char*)C.RecvBuffer + Put, PutSpace, MSG_NOSIGNAL);
+				if(Bytes > 0)
+				{
+					Put = MicroWSPutAdvance(Put, Get, (uint32_t)Bytes, C.RecvSize);
+					C.RecvPut.store(Put, std::memory_order_release);
+					C.LastRecv = H.Now;
+					MicroWSRecvArrived(i);
+					Budget -= (uint32_t)Bytes;
+					if((uint32_t)Bytes < PutSpace)
+					{
+						// short read means the socket is empty. Anything arriving later generates a new edge.
+						C.ReadReady = 0;
+						break;
+					}
+					PutSpace = MicroWSMin(MicroWSPutSpace(Put, Get, C.RecvSize), Budget);
+				}
+				else if(Bytes == 0)
+				{
+					mws_log(C.Opening, "->CLOSE (peer)\n");
+					MicroWSClose(i);
+					break;
+				}
+				else
+				{
+					if(errno == EAGAIN || errno == EWOULDBLOCK)
+						C.ReadReady = 0;
+					else if(errno != EINTR)
+						MicroWSCheckError(i, Bytes);
+					break;
+				}
+			}
+		}
+		if(MicroWSOpening(i) && !MicroWSOpen(i))
+		{
+			MicroWSTryAccept(i);
+		}
+		if(!MicroWSOpen(i) && !MicroWSOpening(i))
+			continue;
+
+		while(C.WriteReady && MicroWSSendPending(i))
+		{
+			uint32_t Queued;
+			int		 Bytes = MicroWSSendQueued(i, &Queued);
+			if(Bytes > 0)
+			{
+				MicroWSSendAdvance(i, (uint32_t)Bytes);
+				if((uint32_t)Bytes < Queued)
+					C.WriteReady = 0; // short write means the socket buffer is full
+			}
+			else if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				C.WriteReady = 0;
+			}
+			else
+			{
+				if(errno != EINTR)
+					MicroWSCheckError(i, Bytes);
+				break;
+			}
+		}
+		if(!MicroWSOpen(i) && !MicroWSOpening(i))
+			continue;
+		MicroWSEpollArmWrite(i, MicroWSSendPending(i));
+		// still readable means the receive budget ran out, or the receive ring is full. Once the app has made room it asks
+		// for another drain
+		if(C.ReadReady && !MicroWSRecvFull(i))
+			MicroWSMarkReady(i);
+	}
+}
+#endif
+
+#if MICROWS_IO_URING
+// The io_uring backend keeps at most one recv and one send in flight per connection, directly against the connection
+// rings. Receives use IORING_OP_READ_FIXED on the rings registered as fixed buffers when the kernel allows it (plain
+// IORING_OP_RECV otherwise), sends use IORING_OP_SEND so MSG_NOSIGNAL applies, or IORING_OP_SENDMSG when shared
+// broadcast frames are queued. Update reaps completions straight from the shared completion ring and only enters the
+// kernel when there are new submissions.
+// user_data is the connection id in the high 32 bits, then the slot index and the operation in the low bit. The poll on
+// the listener, the read on the wake eventfd and the timeout for the timer wheel use MICROWS_INVALID_CONNECTION as the id.
+#define MICROWS_URING_OP_RECV 0
+#define MICROWS_URING_OP_SEND 1
+#define MICROWS_URING_LISTENER (((uint64_t)MICROWS_INVALID_CONNECTION << 32) | 0)
+#define MICROWS_URING_WAKE (((uint64_t)MICROWS_INVALID_CONNECTION << 32) | 1)
+#define MICROWS_URING_TIMER (((uint64_t)MICROWS_INVALID_CONNECTION << 32) | 2)
+#define MICROWS_URING_MAX_ENTRIES 32768
+
+static int MicroWSUringSetup(uint32_t Entries, io_uring_params* Params)
+{
+	return (int)syscall(__NR_io_uring_setup, Entries, Params);
+}
+
+static int MicroWSUringEnter(int Fd, uint32_t ToSubmit, uint32_t MinComplete, uint32_t Flags)
+{
+	return (int)syscall(__NR_io_uring_enter, Fd, ToSubmit, MinComplete, Flags, nullptr, 0);
+}
+
+static int MicroWSUringRegister(int Fd, uint32_t Opcode, void* Arg, uint32_t NumArgs)
+{
+	return (int)syscall(__NR_io_uring_register, Fd, Opcode, Arg, NumArgs);
+}
+
+static bool MicroWSUringStart(MicroWSShard& H)
+{
+	MicroWSUring&	U = H.Uring;
+	io_uring_params Params;
+	memset(&Params, 0, sizeof(Params));
+	int Fd = MicroWSUringSetup(MicroWSMin(2 * S.ShardMaxConnections + 2, (uint32_t)MICROWS_URING_MAX_ENTRIES), &Params);
+	if(Fd < 0)
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "io_uring_setup failed (errno %d:%s)\n", errno, strerror(errno));
+		return false;
+	}
+	U.Fd		 = Fd;
+	U.SqRingSize = Params.sq_off.array + Params.sq_entries * sizeof(uint32_t);
+	U.CqRingSize = Params.cq_off.cqes + Params.cq_entries * sizeof(io_uring_cqe);
+	if(Params.features & IORING_FEAT_SINGLE_MMAP)
+		U.SqRingSize = U.CqRingSize = MicroWSMax(U.SqRingSize, U.CqRingSize);
+	U.SqRing = mmap(nullptr, U.SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQ_RING);
+	if(U.SqRing == MAP_FAILED)
+	{
+		U.SqRing = nullptr;
+		MicroWSUringStop(H);
+		return false;
+	}
+	if(Params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		U.CqRing = U.SqRing;
+	}
+	else
+	{
+		U.CqRing = mmap(nullptr, U.CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_CQ_RING);
+		if(U.CqRing == MAP_FAILED)
+		{
+			U.CqRing = nullptr;
+			MicroWSUringStop(H);
+			return false;
+		}
+	}
+	U.SqesSize = Params.sq_entries * sizeof(io_uring_sqe);
+	U.Sqes	   = (io_uring_sqe*)mmap(nullptr, U.SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQES);
+	if(U.Sqes == MAP_FAILED)
+	{
+		U.Sqes = nullptr;
+		MicroWSUringStop(H);
+		return false;
+	}
+	uint8_t* Sq = (uint8_t*)U.SqRing;
+	uint8_t* Cq = (uint8_t*)U.CqRing;
+	U.SqHead	= (uint32_t*)(Sq + Params.sq_off.head);
+	U.SqTail	= (uint32_t*)(Sq + Params.sq_off.tail);
+	U.SqMask	= *(uint32_t*)(Sq + Params.sq_off.ring_mask);
+	U.SqArray	= (uint32_t*)(Sq + Params.sq_off.array);
+	U.CqHead	= (uint32_t*)(Cq + Params.cq_off.head);
+	U.CqTail	= (uint32_t*)(Cq + Params.cq_off.tail);
+	U.CqMask	= *(uint32_t*)(Cq + Params.cq_off.ring_mask);
+	U.Cqes		= (io_uring_cqe*)(Cq + Params.cq_off.cqes);
+	U.Queued	= 0;
+
+	// sparse fixed buffer table, filled in as connection rings are allocated
+	io_uring_rsrc_register Reg;
+	memset(&Reg, 0, sizeof(Reg));
+	Reg.nr			 = 2 * S.ShardSlots;
+	Reg.flags		 = IORING_RSRC_REGISTER_SPARSE;
+	U.FixedBuffers	 = 0 == MicroWSUringRegister(Fd, IORING_REGISTER_BUFFERS2, &Reg, sizeof(Reg));
+	for(uint32_t i = 0; i < H.NumSlots; ++i)
+		MicroWSGetConnection(H.Base + i).UringRegistered = 0;
+	return true;
+}
+
+static void MicroWSUringStop(MicroWSShard& H)
+{
+	MicroWSUring& U = H.Uring;
+	if(U.Sqes)
+		munmap(U.Sqes, U.SqesSize);
+	if(U.CqRing && U.CqRing != U.SqRing)
+		munmap(U.CqRing, U.CqRingSize);
+	if(U.SqRing)
+		munmap(U.SqRing, U.SqRingSize);
+	if(U.Fd >= 0)
+		close(U.Fd);
+	U.Sqes			= nullptr;
+	U.CqRing		= nullptr;
+	U.SqRing		= nullptr;
+	U.Fd			= -1;
+	U.ListenerArmed = false;
+	U.WakeArmed		= false;
+	U.TimerArmed	= false;
+}
+
+static void MicroWSUringRegisterRings(uint32_t i)
+{
+	MicroWSShard& H = MicroWSShardOf(i);
+	MicroWSUring&	   U = H.Uring;
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(!U.FixedBuffers || C.UringRegistered)
+		return;
+	// register both mappings of the ring, so a read that wraps is still inside the buffer
+	iovec Vecs[2];
+	Vecs[0].iov_base = C.SendBuffer;
+	Vecs[0].iov_len	 = 2 * C.SendSize.load(std::memory_order_relaxed);
+	Vecs[1].iov_base = C.RecvBuffer;
+	Vecs[1].iov_len	 = 2 * C.RecvSize;
+	io_uring_rsrc_update2 Update;
+	memset(&Update, 0, sizeof(Update));
+	Update.offset = 2 * (i - H.Base);
+	Update.data	  = (uint64_t)(uintptr_t)&Vecs[0];
+	Update.nr	  = 2;
+	if(2 == MicroWSUringRegister(U.Fd, IORING_REGISTER_BUFFERS_UPDATE, &Update, sizeof(Update)))
+	{
+		C.UringRegistered = 1;
+	}
+	else
+	{
+		mws_log(C.Opening, "io_uring fixed buffers unavailable (errno %d:%s), using plain recv\n", errno, strerror(errno));
+		U.FixedBuffers = false;
+	}
+}
+
+// The send ring of slot i was resized. Replacing its fixed buffer unpins the old one
+static void MicroWSUringRegisterSend(uint32_t i)
+{
+	MicroWSShard&	   H = MicroWSShardOf(i);
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(!C.UringRegistered)
+		return;
+	iovec Vec;
+	Vec.iov_base = C.SendBuffer;
+	Vec.iov_len	 = 2 * C.SendSize.load(std::memory_order_relaxed);
+	io_uring_rsrc_update2 Update;
+	memset(&Update, 0, sizeof(Update));
+	Update.offset = 2 * (i - H.Base);
+	Update.data	  = (uint64_t)(uintptr_t)&Vec;
+	Update.nr	  = 1;
+	if(1 != MicroWSUringRegister(H.Uring.Fd, IORING_REGISTER_BUFFERS_UPDATE, &Update, sizeof(Update)))
+		mws_log(C.Opening, "io_uring fixed buffer update failed (errno %d:%s)\n", errno, strerror(errno));
+}
+
+// The rings of slot i go back to the pool. Clearing their fixed buffers unpins them, so they can be unmapped
+static void MicroWSUringUnregisterRings(uint32_t i)
+{
+	MicroWSShard&	   H = MicroWSShardOf(i);
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(!C.UringRegistered)
+		return;
+	C.UringRegistered = 0;
+	iovec Vecs[2];
+	memset(Vecs, 0, sizeof(Vecs));
+	io_uring_rsrc_update2 Update;
+	memset(&Update, 0, sizeof(Update));
+	Update.offset = 2 * (i - H.Base);
+	Update.data	  = (uint64_t)(uintptr_t)&Vecs[0];
+	Update.nr	  = 2;
+	if(2 != MicroWSUringRegister(H.Uring.Fd, IORING_REGISTER_BUFFERS_UPDATE, &Update, sizeof(Update)))
+		mws_log(C.Closed, "io_uring fixed buffer update failed (errno %d:%s)\n", errno, strerror(errno));
+}
+
+static void MicroWSUringAdd(uint32_t i)
+{
+	MicroWSShard& H = MicroWSShardOf(i);
+	if(H.Backend != MICROWS_BACKEND_IO_URING)
+		return;
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	// the kernel waits for readiness on our behalf, so the socket must block for the operations to stay in flight
+	MicroWSSetNonBlocking(C.Socket, 0);
+	MicroWSUringRegisterRings(i);
+	MicroWSMarkReady(i);
+}
+
+static void MicroWSUringSubmit(MicroWSShard& H)
+{
+	MicroWSUring& U = H.Uring;
+	if(U.Queued)
+	{
+		__atomic_store_n(U.SqTail, *U.SqTail + U.Queued, __ATOMIC_RELEASE);
+		int Submitted = MicroWSUringEnter(U.Fd, U.Queued, 0, 0);
+		if(Submitted < 0)
+		{
+			mws_error(MICROWS_INVALID_CONNECTION, "io_uring_enter failed: %d:%s\n", errno, strerror(errno));
+		}
+		U.Queued = 0;
+	}
+}
+
+// next free submission entry, cleared. It's submitted by the next MicroWSUringSubmit
+static io_uring_sqe* MicroWSUringGetSqe(MicroWSShard& H)
+{
+	MicroWSUring& U	   = H.Uring;
+	uint32_t	  Tail = *U.SqTail + U.Queued;
+	uint32_t	  Head = __atomic_load_n(U.SqHead, __ATOMIC_ACQUIRE);
+	if(Tail - Head > U.SqMask)
+	{
+		// more connections than submission entries, hand what we have to the kernel first
+		MicroWSUringSubmit(H);
+		Tail = *U.SqTail;
+		Head = __atomic_load_n(U.SqHead, __ATOMIC_ACQUIRE);
+	}
+	uint32_t	  Index = Tail & U.SqMask;
+	io_uring_sqe* Sqe	= &U.Sqes[Index];
+	memset(Sqe, 0, sizeof(*Sqe));
+	U.SqArray[Index] = Index;
+	U.Queued++;
+	return Sqe;
+}
+
+static void MicroWSUringQueue(uint32_t i, uint32_t Op, void* Ptr, uint32_t Size)
+{
+	MicroWSConnection& C   = MicroWSGetConnection(i);
+	io_uring_sqe*	   Sqe = MicroWSUringGetSqe(MicroWSShardOf(i));
+	Sqe->fd				   = C.Socket;
+	Sqe->addr	   = (uint64_t)(uintptr_t)Ptr;
+	Sqe->len	   = Size;
+	Sqe->user_data = ((uint64_t)C.Opening << 32) | (i << 1) | Op;
+	if(Op == MICROWS_URING_OP_SEND)
+	{
+		Sqe->opcode	   = Ptr == &C.UringMsg ? IORING_OP_SENDMSG : IORING_OP_SEND;
+		Sqe->msg_flags = MSG_NOSIGNAL;
+		C.UringSend	   = 1;
+	}
+	else
+	{
+		if(C.UringRegistered)
+		{
+			Sqe->opcode	   = IORING_OP_READ_FIXED;
+			Sqe->buf_index = 2 * (i - MicroWSShardOf(i).Base) + 1;
+		}
+		else
+		{
+			Sqe->opcode = IORING_OP_RECV;
+		}
+		C.UringRecv = 1;
+	}
+}
+
+// In threaded mode the io thread sleeps in io_uring_enter, so accepting, being woken by the app and timers have to be
+// completions too: a one shot poll on the listener, a read on the wake eventfd and a timeout while timers are set.
+static void MicroWSUringArm(MicroWSShard& H)
+{
+	MicroWSUring& U = H.Uring;
+	if(!H.ListenerReady && !U.ListenerArmed)
+	{
+		io_uring_sqe* Sqe = MicroWSUringGetSqe(H);
+		Sqe->opcode		  = IORING_OP_POLL_ADD;
+		Sqe->fd			  = H.ListenerSocket;
+		Sqe->poll_events  = POLLIN;
+		Sqe->user_data	  = MICROWS_URING_LISTENER;
+		U.ListenerArmed	  = true;
+	}
+	if(H.WakeFd >= 0 && !U.WakeArmed)
+	{
+		io_uring_sqe* Sqe = MicroWSUringGetSqe(H);
+		Sqe->opcode		  = IORING_OP_READ;
+		Sqe->fd			  = H.WakeFd;
+		Sqe->addr		  = (uint64_t)(uintptr_t)&U.WakeValue;
+		Sqe->len		  = sizeof(U.WakeValue);
+		Sqe->user_data	  = MICROWS_URING_WAKE;
+		U.WakeArmed		  = true;
+	}
+	if(S.Threaded && H.NumTimers && !U.TimerArmed)
+	{
+		io_uring_sqe* Sqe	= MicroWSUringGetSqe(H);
+		U.TimerSpec.tv_sec	= MICROWS_TIMER_TICK_MS / 1000;
+		U.TimerSpec.tv_nsec = (MICROWS_TIMER_TICK_MS % 1000) * 1000000ll;
+		Sqe->opcode			= IORING_OP_TIMEOUT;
+		Sqe->addr			= (uint64_t)(uintptr_t)&U.TimerSpec;
+		Sqe->len			= 1;
+		Sqe->user_data		= MICROWS_URING_TIMER;
+		U.TimerArmed		= true;
+	}
+}
+
+static void MicroWSUringWait(MicroWSShard& H)
+{
+	MicroWSUring& U = H.Uring;
+	if(*U.CqHead != __atomic_load_n(U.CqTail, __ATOMIC_ACQUIRE))
+		return;
+	if(MicroWSUringEnter(U.Fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+		mws_error(MICROWS_INVALID_CONNECTION, "io_uring_enter failed: %d:%s\n", errno, strerror(errno));
+}
+
+static void MicroWSUringComplete(MicroWSShard& H, uint64_t UserData, int32_t Res)
+{
+	if(UserData == MICROWS_URING_LISTENER)
+	{
+		H.Uring.ListenerArmed = false;
+		H.ListenerReady		  = true;
+		return;
+	}
+	if(UserData == MICROWS_URING_WAKE)
+	{
+		H.Uring.WakeArmed = false;
+		return;
+	}
+	if(UserData == MICROWS_URING_TIMER)
+	{
+		H.Uring.TimerArmed = false;
+		return;
+	}
+	uint32_t		   Id = (uint32_t)(UserData >> 32);
+	uint32_t		   i  = ((uint32_t)UserData & 0xffffffff) >> 1;
+	uint32_t		   Op = (uint32_t)UserData & 1;
+	MicroWSConnection& C  = MicroWSGetConnection(i);
+	if(Op == MICROWS_URING_OP_SEND)
+		C.UringSend = 0;
+	else
+		C.UringRecv = 0;
+	if(C.FreePending)
+	{
+		MicroWSReleaseSlot(i);
+		return;
+	}
+	if(C.Opening != Id || (!MicroWSOpen(i) && !MicroWSOpening(i)))
+		return; // closed while the operation was in flight
+	MicroWSMarkReady(i);
+	if(Res > 0)
+	{
+		if(Op == MICROWS_URING_OP_SEND)
+		{
+			MicroWSSendAdvance(i, (uint32_t)Res);
+		}
+		else
+		{
+			C.RecvPut.store(MicroWSPutAdvance(C.RecvPut.load(std::memory_order_relaxed), C.RecvGet.load(std::memory_order_acquire), (uint32_t)Res, C.RecvSize), std::memory_order_release);
+			C.LastRecv = H.Now;
+			MicroWSRecvArrived(i);
+		}
+	}
+	else if(Res == 0 && Op == MICROWS_URING_OP_RECV)
+	{
+		mws_log(C.Opening, "->CLOSE (peer)\n");
+		MicroWSClose(i);
+	}
+	else if(Res < 0 && Res != -EAGAIN && Res != -EINTR)
+	{
+		mws_log(C.Opening, "->CLOSE (io_uring %d:%s)\n", -Res, strerror(-Res));
+		MicroWSClose(i);
+	}
+}
+
+static void MicroWSDrainUring(MicroWSShard& H)
+{
+	MicroWSUring& U	   = H.Uring;
+	uint32_t	  Head = *U.CqHead;
+	uint32_t	  Tail = __atomic_load_n(U.CqTail, __ATOMIC_ACQUIRE);
+	while(Head != Tail)
+	{
+		io_uring_cqe* Cqe = &U.Cqes[Head & U.CqMask];
+		MicroWSUringComplete(H, Cqe->user_data, Cqe->res);
+		Head++;
+	}
+	__atomic_store_n(U.CqHead, Head, __ATOMIC_RELEASE);
+
+	uint32_t NumReady = H.NumReady;
+	H.NumReady		  = 0;
+	memcpy(H.DrainList, H.ReadyList, NumReady * sizeof(H.ReadyList[0]));
+	for(uint32_t r = 0; r < NumReady; ++r)
+	{
+		uint32_t		   i = H.DrainList[r];
+		MicroWSConnection& C = MicroWSGetConnection(i);
+		C.InReadyList		 = 0;
+		if(MicroWSOpening(i) && !MicroWSOpen(i))
+		{
+			MicroWSTryAccept(i);
+		}
+		if(!MicroWSOpen(i) && !MicroWSOpening(i))
+			continue;
+		if(!C.UringRecv)
+		{
+			uint32_t Put	  = C.RecvPut.load(std::memory_order_relaxed);
+			uint32_t PutSpace = MicroWSPutSpace(Put, C.RecvGet.load(std::memory_order_acquire), C.RecvSize);
+			if(PutSpace)
+				MicroWSUringQueue(i, MICROWS_URING_OP_RECV, C.RecvBuffer + Put, PutSpace);
+			else if(!MicroWSRecvFull(i))
+				MicroWSMarkReady(i); // the app made room in the meantime. Otherwise it asks for a drain when it does
+		}
+		if(!C.UringSend && MicroWSSendPending(i))
+		{
+			MicroWSSendChunk Chunks[MICROWS_SEND_CHUNKS];
+			uint32_t		 NumChunks = MicroWSSendChunks(i, Chunks, MICROWS_SEND_CHUNKS, nullptr);
+			if(NumChunks == 1)
+			{
+				MicroWSUringQueue(i, MICROWS_URING_OP_SEND, Chunks[0].Ptr, Chunks[0].Size);
+			}
+			else
+			{
+				for(uint32_t j = 0; j < NumChunks; ++j)
+				{
+					C.UringVecs[j].iov_base = Chunks[j].Ptr;
+					C.UringVecs[j].iov_len	= Chunks[j].Size;
+				}
+				memset(&C.UringMsg, 0, sizeof(C.UringMsg));
+				C.UringMsg.msg_iov	  = C.UringVecs;
+				C.UringMsg.msg_iovlen = NumChunks;
+				MicroWSUringQueue(i, MICROWS_URING_OP_SEND, &C.UringMsg, 1);
+			}
+		}
+	}
+	MicroWSUringArm(H);
+	MicroWSUringSubmit(H);
+}
+#endif
+
+#ifdef _WIN32
+static uint32_t MicroWSRingGranularity()
+{
+	SYSTEM_INFO SysInfo;
+	GetSystemInfo(&SysInfo);
+	return SysInfo.dwAllocationGranularity;
+}
+
+static void* MicroWSAllocRing(uint32_t Size)
+{
+	// Stolen from https://learn.microsoft.com/en-us/windows/win32/api/memoryapi/nf-memoryapi-virtualalloc2#examples
+	HANDLE		 Section = nullptr;
+	SYSTEM_INFO	 SysInfo;
+	void*		 RingBuffer	  = nullptr;
+	void*		 Placeholder1 = nullptr;
+	void*		 Placeholder2 = nullptr;
+	void*		 View1		  = nullptr;
+	void*		 View2		  = nullptr;
+	const size_t BufferSize	  = Size;
+
+	GetSystemInfo(&SysInfo);
+	if((BufferSize % SysInfo.dwAllocationGranularity) != 0)
+	{
+		return nullptr;
+	}
+
+	Placeholder1 = (PCHAR)VirtualAlloc2(nullptr, nullptr, 2 * BufferSize, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0);
+
+	if(!Placeholder1)
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "VirtualAlloc2 failed, error %#x\n", GetLastError());
+		goto Exit;
+	}
+	if(FALSE == VirtualFree(Placeholder1, BufferSize, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER))
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "VirtualFreeEx failed, error %#x\n", GetLastError());
+		goto Exit;
+	}
+	Placeholder2 = (void*)((ULONG_PTR)Placeholder1 + BufferSize);
+	Section		 = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, BufferSize, nullptr);
+	if(!Section)
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "CreateFileMapping failed, error %#x\n", GetLastError());
+		goto Exit;
+	}
+
+	View1 = MapViewOfFile3(Section, nullptr, Placeholder1, 0, BufferSize, MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, nullptr, 0);
+	if(!View1)
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "MapViewOfFile3 failed, error %#x\n", GetLastError());
+		goto Exit;
+	}
+	Placeholder1 = nullptr;
+	View2		 = MapViewOfFile3(Section, nullptr, Placeholder2, 0, BufferSize, MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, nullptr, 0);
+	if(!View2)
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "MapViewOfFile3 failed, error %#x\n", GetLastError());
+		goto Exit;
+	}
+	Placeholder2 = nullptr;
+	RingBuffer	 = View1;
+	View1		 = nullptr;
+	View2		 = nullptr;
+
+Exit:
+
+	if(Section)
+	{
+		CloseHandle(Section);
 	}
 
 	if(Placeholder1)
 	{
-		VirtualFree(Placeholder1, 0, MEM_RELEASE);
+		VirtualFree(Placeholder1, 0, MEM_RELEASE);
+	}
+
+	if(Placeholder2)
+	{
+		VirtualFree(Placeholder2, 0, MEM_RELEASE);
+	}
+
+	if(View1)
+	{
+		UnmapViewOfFileEx(View1, 0);
+	}
+
+	if(View2)
+	{
+		UnmapViewOfFileEx(View2, 0);
+	}
+
+	return RingBuffer;
+}
+
+static void MicroWSFreeRing(void* Ring, uint32_t Size)
+{
+	UnmapViewOfFileEx((uint8_t*)Ring + Size, 0);
+	UnmapViewOfFileEx(Ring, 0);
+}
+#else
+static uint32_t MicroWSRingGranularity()
+{
+	return (uint32_t)sysconf(_SC_PAGESIZE);
+}
+
+static int MicroWSGetAnonFile()
+{
+#ifdef __APPLE__
+	// tweaked verison of https://github.com/lassik/shm_open_anon/blob/master/shm_open_anon.c
+	int64_t PID = (int64_t)getpid();
+	static int Count = 1;
+	char Buffer[128];
+
+	for(int i = 0; i < 3; ++i)
+	{
+		snprintf(Buffer, sizeof(Buffer)-1, "/shm-micro-ws-%" PRId64 "-%d", PID, Count);
+		Count++;
+		int fd = shm_open(Buffer, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if(fd != -1)
+		{
+			int save;
+			if(shm_unlink(Buffer) == -1)
+			{
+				save = errno;
+				close(fd);
+				errno = save;
+				return -1;
+			}
+			return fd;
+		}
+		if(errno != EEXIST)
+			break;
+	}
+	return -1;
+
+
+#else
+	return memfd_create("microws_ring", 0);
+#endif
+}
+static void* MicroWSAllocRing(uint32_t Size)
+{
+	int fd = MicroWSGetAnonFile();
+	if (fd == -1)
+		return nullptr;
+	void* Buffer = MAP_FAILED;
+	if(0 == ftruncate(fd, Size))
+		Buffer = mmap(NULL, (size_t)Size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(Buffer != MAP_FAILED &&
+	   (MAP_FAILED == mmap(Buffer, Size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ||
+		MAP_FAILED == mmap((char*)Buffer + Size, Size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)))
+	{
+		munmap(Buffer, (size_t)Size * 2);
+		Buffer = MAP_FAILED;
+	}
+	int Error = errno;
+	close(fd); // the mappings keep the memory
+	if(Buffer == MAP_FAILED)
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "failed to map a %u byte ring (errno %d:%s)\n", Size, Error, strerror(Error));
+		return nullptr;
+	}
+	return Buffer;
+}
+
+static void MicroWSFreeRing(void* Ring, uint32_t Size)
+{
+	munmap(Ring, (size_t)Size * 2);
+}
+#endif
+
+// Rounds a ring size up to what can be mapped twice
+static uint32_t MicroWSRingSize(uint32_t Requested)
+{
+	uint32_t Granularity = MicroWSRingGranularity();
+	uint32_t Size		 = MicroWSClamp<uint32_t>(Requested, MICROWS_RING_MIN_SIZE, MICROWS_RING_MAX_SIZE);
+	return (Size + Granularity - 1) / Granularity * Granularity;
+}
+
+// Maps a ring and counts it in S.RingBytes
+static uint8_t* MicroWSRingMap(uint32_t Size)
+{
+	uint8_t* Ring = (uint8_t*)MicroWSAllocRing(Size);
+	if(Ring)
+	{
+		S.RingBytes.fetch_add(Size, std::memory_order_relaxed);
+		S.NumRings.fetch_add(1, std::memory_order_relaxed);
+	}
+	return Ring;
+}
+
+static void MicroWSRingUnmap(uint8_t* Ring, uint32_t Size)
+{
+	MicroWSFreeRing(Ring, Size);
+	S.RingBytes.fetch_sub(Size, std::memory_order_relaxed);
+	S.NumRings.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// io side: removes entry r from the pool of shard H and returns its ring
+static uint8_t* MicroWSRingPoolRemove(MicroWSShard& H, uint32_t r)
+{
+	MicroWSPooledRing P = H.RingPool[r];
+	H.RingPool[r]		= H.RingPool[--H.NumPooled];
+	S.PooledRingBytes.fetch_sub(P.Size, std::memory_order_relaxed);
+	S.NumPooledRings.fetch_sub(1, std::memory_order_relaxed);
+	return P.Ring;
+}
+
+// io side: a ring of Size bytes from the pool of shard H, or newly mapped
+static uint8_t* MicroWSRingTake(MicroWSShard& H, uint32_t Size)
+{
+	for(uint32_t r = H.NumPooled; r > 0; --r)
+	{
+		if(H.RingPool[r - 1].Size == Size)
+			return MicroWSRingPoolRemove(H, r - 1);
+	}
+	return MicroWSRingMap(Size);
+}
+
+// io side: a ring no connection uses anymore goes back to the pool of shard H. It's unmapped if the pool is full, or
+// if new connections don't get rings of its size.
+static void MicroWSRingPut(MicroWSShard& H, uint8_t* Ring, uint32_t Size)
+{
+	if(!Ring)
+		return;
+	if(H.NumPooled == H.PoolCapacity || (Size != S.SendRingSize && Size != S.RecvRingSize))
+	{
+		MicroWSRingUnmap(Ring, Size);
+		return;
+	}
+	H.RingPool[H.NumPooled].Ring   = Ring;
+	H.RingPool[H.NumPooled++].Size = Size;
+	S.PooledRingBytes.fetch_add(Size, std::memory_order_relaxed);
+	S.NumPooledRings.fetch_add(1, std::memory_order_relaxed);
+}
+
+// io side: unmaps pooled rings of shard H until Keep are left
+static void MicroWSRingPoolTrim(MicroWSShard& H, uint32_t Keep)
+{
+	while(H.NumPooled > Keep)
+	{
+		uint32_t Size = H.RingPool[H.NumPooled - 1].Size;
+		MicroWSRingUnmap(MicroWSRingPoolRemove(H, H.NumPooled - 1), Size);
+	}
+}
+
+// Maps rings into the pool of shard H until it has enough for Count connections, and faults them in so the first
+// connections don't have to. Pooled rings of sizes new connections don't get, left from before a restart with other
+// sizes, are unmapped.
+static bool MicroWSRingPoolFill(MicroWSShard& H, uint32_t Count)
+{
+	uint32_t Send = 0;
+	uint32_t Recv = 0;
+	for(uint32_t r = 0; r < H.NumPooled;)
+	{
+		uint32_t Size = H.RingPool[r].Size;
+		if(Size != S.SendRingSize && Size != S.RecvRingSize)
+		{
+			MicroWSRingUnmap(MicroWSRingPoolRemove(H, r), Size);
+			continue;
+		}
+		if(Size == S.SendRingSize && (Send < Count || Size != S.RecvRingSize))
+			Send++;
+		else
+			Recv++;
+		r++;
+	}
+	while((Send < Count || Recv < Count) && H.NumPooled < H.PoolCapacity)
+	{
+		uint32_t Size = Send < Count ? S.SendRingSize : S.RecvRingSize;
+		uint8_t* Ring = MicroWSRingMap(Size);
+		if(!Ring)
+			return false;
+		memset(Ring, 0, Size);
+		MicroWSRingPut(H, Ring, Size);
+		if(Send < Count)
+			Send++;
+		else
+			Recv++;
+	}
+	return true;
+}
+
+
+static bool MicroWSAllocSlab(MicroWSShard& H)
+{
+	uint32_t First = H.NumSlots.load(std::memory_order_relaxed);
+	if(First >= S.ShardMaxConnections)
+		return false;
+	MicroWSConnection* Slots = new MicroWSConnection[MICROWS_SLAB_SIZE];
+	S.Slabs[(H.Base + First) >> MICROWS_SLAB_SHIFT] = Slots;
+	uint32_t Count									= MicroWSMin(MICROWS_SLAB_SIZE, S.ShardMaxConnections - First);
+	// push in reverse so slots are handed out in ascending order
+	for(uint32_t i = Count; i > 0; --i)
+	{
+		MicroWSConnection& C = Slots[i - 1];
+		C.Opening			 = MICROWS_INVALID_CONNECTION;
+		C.Open				 = MICROWS_INVALID_CONNECTION;
+		C.Closed			 = MICROWS_INVALID_CONNECTION;
+		C.Shard				 = H.Index;
+		H.FreeList[H.NumFree++] = H.Base + First + i - 1;
+	}
+	H.NumSlots.store(First + Count, std::memory_order_release);
+	return true;
+}
+
+static bool MicroWSHasFreeSlot(MicroWSShard& H)
+{
+	return H.NumFree > 0 || H.NumSlots.load(std::memory_order_relaxed) < S.ShardMaxConnections;
+}
+
+// pops a free slot and returns the id the connection in it will have
+static uint32_t MicroWSFindConnection(MicroWSShard& H)
+{
+	if(!H.NumFree && !MicroWSAllocSlab(H))
+		return MICROWS_INVALID_CONNECTION;
+	uint32_t		   Index = H.FreeList[--H.NumFree];
+	MicroWSConnection& C	 = MicroWSGetConnection(Index);
+	MWS_ASSERT(C.Opening == C.Closed && !C.UringRecv && !C.UringSend);
+	uint64_t Id = (uint64_t)C.Generation * S.MaxConnections + Index;
+	if(Id >= MICROWS_ALL_CONNECTIONS)
+	{
+		// wrapping is fine, ids are compared with signed differences
+		C.Generation = 0;
+		Id			 = Index;
+	}
+	C.Generation++;
+	return (uint32_t)Id;
+}
+
+// slot of a connection id, or MICROWS_INVALID_CONNECTION if the id can't be live
+static uint32_t MicroWSConnectionIndex(uint32_t ConnectionId)
+{
+	if(ConnectionId >= MICROWS_ALL_CONNECTIONS || !S.MaxConnections)
+		return MICROWS_INVALID_CONNECTION;
+	uint32_t	  Index = ConnectionId % S.MaxConnections;
+	MicroWSShard& H		= S.Shards[Index / S.ShardSlots];
+	return Index - H.Base < H.NumSlots.load(std::memory_order_acquire) ? Index : MICROWS_INVALID_CONNECTION;
+}
+
+static void MicroWSReleaseSlot(uint32_t i)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(C.UringRecv || C.UringSend)
+	{
+		C.FreePending = 1;
+		return;
+	}
+	MicroWSShard& H = S.Shards[C.Shard];
+	MicroWSSharedReset(i);
+#if MICROWS_IO_URING
+	MicroWSUringUnregisterRings(i);
+#endif
+	MicroWSRingPut(H, C.SendBuffer, C.SendSize.load(std::memory_order_relaxed));
+	MicroWSRingPut(H, C.RecvBuffer, C.RecvSize);
+	C.SendBuffer			= nullptr;
+	C.RecvBuffer			= nullptr;
+	C.FreePending			= 0;
+	H.FreeList[H.NumFree++] = i;
+}
+
+static void MicroWSAssignConnection(uint32_t Id, MWSSocket Socket)
+{
+	uint32_t		   Index = Id % S.MaxConnections;
+	MicroWSConnection& C	 = MicroWSGetConnection(Index);
+	MicroWSShard&	   H	 = S.Shards[C.Shard];
+	MWS_ASSERT(C.Opening == C.Closed && !C.SendBuffer && !C.RecvBuffer);
+	C.SendBuffer = MicroWSRingTake(H, S.SendRingSize);
+	C.RecvBuffer = MicroWSRingTake(H, S.RecvRingSize);
+	if(!C.SendBuffer || !C.RecvBuffer)
+	{
+		mws_log(Id, "->REJECT (no memory for rings)\n");
+		MicroWSRingPut(H, C.SendBuffer, S.SendRingSize);
+		MicroWSRingPut(H, C.RecvBuffer, S.RecvRingSize);
+		C.SendBuffer			= nullptr;
+		C.RecvBuffer			= nullptr;
+		H.FreeList[H.NumFree++] = Index;
+#ifdef _WIN32
+		closesocket(Socket);
+#else
+		close(Socket);
+#endif
+		return;
+	}
+	C.SendSize.store(S.SendRingSize, std::memory_order_relaxed);
+	C.RecvSize		  = S.RecvRingSize;
+	C.SendBaseSize	  = S.SendRingSize;
+	C.SendWant.store(0, std::memory_order_relaxed);
+	C.SendBlockedSeen = 0;
+	C.SendQuietSince  = H.Now;
+
+	C.Opening = Id;
+	C.Socket  = Socket;
+
+	C.LiveIndex				= H.NumLive;
+	H.LiveList[H.NumLive++] = Index;
+
+	// the app side is done with the slot, so its half can be reset here too. It's published by the open event
+	C.SendBlocked = 0;
+	MicroWSSendReset(Index);
+	C.RecvPut.store(0, std::memory_order_relaxed);
+	C.RecvGet.store(0, std::memory_order_relaxed);
+	C.Fail88	  = 0;
+	C.FailRSV	  = 0;
+	C.PeekBytes	  = 0;
+	C.RecvDeficit = 0;
+	C.FrameLeft	  = 0;
+	C.RecvMode	  = MICROWS_RECV_IDLE;
+	C.RecvInflate = 0;
+	C.Deflate	  = MicroWSDeflateParams();
+	C.SendStream.store(MICROWS_STREAM_IDLE, std::memory_order_relaxed);
+	C.HandshakeScan = 0;
+	C.AppReady.store(0, std::memory_order_relaxed);
+	C.RecvBlocked.store(0, std::memory_order_relaxed);
+	C.Closing.store(MICROWS_CLOSING_NONE, std::memory_order_relaxed);
+	C.CloseSeen	 = MICROWS_CLOSING_NONE;
+	C.LastRecv	 = H.Now;
+	C.LastPing	 = H.Now;
+	uint32_t Due = S.IdleTimeoutMs;
+	if(S.PingIntervalMs && (!Due || S.PingIntervalMs < Due))
+		Due = S.PingIntervalMs;
+	if(Due)
+		MicroWSTimerSchedule(Index, Due);
+#if MICROWS_EPOLL
+	MicroWSEpollAdd(Index);
+#endif
+#if MICROWS_IO_URING
+	MicroWSUringAdd(Index);
+#endif
+	mws_log(Id, "->ASSIGN\n");
+}
+
+void MicroWSGetState(MicroWSConnectionState& State, uint32_t FirstConnection)
+{
+	uint32_t NumConnections = 0;
+	uint32_t Live			= FirstConnection;
+	for(; Live < S.NumApp && NumConnections < MICROWS_STATE_PAGE_SIZE; ++Live)
+	{
+		MicroWSConnection& C   = MicroWSGetConnection(S.AppList[Live]);
+		uint32_t		   Put = C.RecvPut.load(std::memory_order_acquire);
+		uint32_t		   Get = C.RecvGet.load(std::memory_order_relaxed);
+
+		State.Connections[NumConnections] = C.AppId;
+		State.Data[NumConnections]		  = MicroWSGetSpace(Get, Put, C.RecvSize);
+		NumConnections++;
+	}
+	State.NumConnections	= NumConnections;
+	State.TotalConnections	= S.NumApp;
+	State.NextPage			= Live < S.NumApp ? Live : 0;
+	State.ConnectionVersion = S.ConnectionVersion;
+}
+
+static uint32_t MicroWSMaxDataAvailable()
+{
+	uint32_t MaxDataAvailable = 0;
+	for(uint32_t l = 0; l < S.NumApp; ++l)
+	{
+		MicroWSConnection& C			 = MicroWSGetConnection(S.AppList[l]);
+		uint32_t		   DataAvailable = MicroWSGetSpace(C.RecvGet.load(std::memory_order_relaxed), C.RecvPut.load(std::memory_order_acquire), C.RecvSize);
+		if(C.RecvMode == MICROWS_RECV_READY)
+			DataAvailable = (uint32_t)C.MessageRead;
+		MaxDataAvailable				 = MaxDataAvailable > DataAvailable ? MaxDataAvailable : DataAvailable;
+	}
+	return MaxDataAvailable;
+}
+
+// Milliseconds on a monotonic clock. They wrap, so only differences are used
+static uint32_t MicroWSNow()
+{
+#ifdef _WIN32
+	return (uint32_t)GetTickCount64();
+#else
+	timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (uint32_t)((uint64_t)Time.tv_sec * 1000 + Time.tv_nsec / 1000000);
+#endif
+}
+
+static uint64_t MicroWSNowUs()
+{
+#ifdef _WIN32
+	LARGE_INTEGER Counter, Frequency;
+	QueryPerformanceCounter(&Counter);
+	QueryPerformanceFrequency(&Frequency);
+	return (uint64_t)(Counter.QuadPart / Frequency.QuadPart * 1000000 + Counter.QuadPart % Frequency.QuadPart * 1000000 / Frequency.QuadPart);
+#else
+	timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (uint64_t)Time.tv_sec * 1000000 + Time.tv_nsec / 1000;
+#endif
+}
+
+static void MicroWSTimerUnlink(uint32_t i)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(C.TimerSlot == MICROWS_TIMER_NONE)
+		return;
+	MicroWSShard& H = MicroWSShardOf(i);
+	if(C.TimerPrev != MICROWS_INVALID_CONNECTION)
+		MicroWSGetConnection(C.TimerPrev).TimerNext = C.TimerNext;
+	else
+		H.Wheel[C.TimerSlot] = C.TimerNext;
+	if(C.TimerNext != MICROWS_INVALID_CONNECTION)
+		MicroWSGetConnection(C.TimerNext).TimerPrev = C.TimerPrev;
+	C.TimerSlot = MICROWS_TIMER_NONE;
+	H.NumTimers--;
+}
+
+// Moves slot i to the wheel bucket that comes up once at least Delta ms have passed, or to the last bucket if that's
+// further away than the wheel reaches
+static void MicroWSTimerSchedule(uint32_t i, uint32_t Delta)
+{
+	MicroWSTimerUnlink(i);
+	MicroWSConnection& C	 = MicroWSGetConnection(i);
+	MicroWSShard&	   H	 = MicroWSShardOf(i);
+	uint32_t		   Ticks = MicroWSMin<uint32_t>(Delta / MICROWS_TIMER_TICK_MS + 1, MICROWS_TIMER_SLOTS - 1);
+	uint32_t		   Slot	 = (H.WheelPos + Ticks) & (MICROWS_TIMER_SLOTS - 1);
+	C.TimerSlot				 = Slot;
+	C.TimerPrev				 = MICROWS_INVALID_CONNECTION;
+	C.TimerNext				 = H.Wheel[Slot];
+	if(C.TimerNext != MICROWS_INVALID_CONNECTION)
+		MicroWSGetConnection(C.TimerNext).TimerPrev = i;
+	H.Wheel[Slot] = i;
+	H.NumTimers++;
+}
+
+// The timer of slot i is due: closes it if the close handshake is over or it has been quiet too long, pings it if it
+// has been quiet for a while, shrinks a grown send ring, and puts it back in the wheel for whatever comes next. Nothing
+// is done when bytes come in, the timer just finds LastRecv has moved on.
+static void MicroWSTimerExpire(MicroWSShard& H, uint32_t i)
+{
+	MicroWSConnection& C   = MicroWSGetConnection(i);
+	uint32_t		   Now = H.Now;
+	if(C.CloseSeen)
+	{
+		bool Done = C.CloseSeen == MICROWS_CLOSING_DONE && !MicroWSSendPending(i);
+		if(Done || Now - C.CloseStart >= MICROWS_CLOSE_TIMEOUT_MS)
+		{
+			mws_log(C.Opening, Done ? "->CLOSE (close handshake)\n" : "->CLOSE (close timeout)\n");
+			MicroWSClose(i);
+			return;
+		}
+		// once both close frames are out it's only waiting for ours to be sent
+		MicroWSTimerSchedule(i, C.CloseSeen == MICROWS_CLOSING_DONE ? 0 : MICROWS_CLOSE_TIMEOUT_MS - (Now - C.CloseStart));
+		return;
+	}
+	uint32_t Quiet = Now - C.LastRecv;
+	if(S.IdleTimeoutMs && Quiet >= S.IdleTimeoutMs)
+	{
+		mws_log(C.Opening, "->CLOSE (idle %ums)\n", Quiet);
+		MicroWSClose(i);
+		return;
+	}
+	uint32_t Due = S.IdleTimeoutMs ? S.IdleTimeoutMs - Quiet : 0xffffffff;
+	if(S.PingIntervalMs)
+	{
+		uint32_t Unpinged = MicroWSMin(Quiet, Now - C.LastPing);
+		if(Unpinged >= S.PingIntervalMs && MicroWSOpen(i))
+		{
+			if(MicroWSSendFrame(i, "", 0, MICROWS_OPCODE_PING))
+				MicroWSMarkReady(i);
+			C.LastPing = Now;
+			Unpinged   = 0;
+		}
+		Due = MicroWSMin(Due, S.PingIntervalMs - MicroWSMin(Unpinged, S.PingIntervalMs)); // still opening: look again next tick
+	}
+	if(S.SendRingShrinkMs && C.SendSize.load(std::memory_order_relaxed) > C.SendBaseSize)
+	{
+		MicroWSSendAdapt(i);
+		if(C.SendSize.load(std::memory_order_relaxed) > C.SendBaseSize)
+			Due = MicroWSMin(Due, S.SendRingShrinkMs - MicroWSMin(Now - C.SendQuietSince, S.SendRingShrinkMs));
+	}
+	if(Due != 0xffffffff)
+		MicroWSTimerSchedule(i, Due);
+}
+
+// Runs the timers in every wheel bucket that has gone by since the last step. A step that comes a whole turn of the
+// wheel late or more expires every bucket once, everything in it is put back relative to now anyway.
+static void MicroWSIoTimers(MicroWSShard& H)
+{
+	if(H.NumTimers && H.Now - H.WheelTime >= MICROWS_TIMER_SLOTS * MICROWS_TIMER_TICK_MS)
+	{
+		// take every timer off the wheel first, so none that is put back comes round again in this step
+		uint32_t Due = MICROWS_INVALID_CONNECTION;
+		for(uint32_t Slot = 0; Slot < MICROWS_TIMER_SLOTS; ++Slot)
+		{
+			uint32_t i	  = H.Wheel[Slot];
+			H.Wheel[Slot] = MICROWS_INVALID_CONNECTION;
+			while(i != MICROWS_INVALID_CONNECTION)
+			{
+				MicroWSConnection& C	= MicroWSGetConnection(i);
+				uint32_t		   Next = C.TimerNext;
+				C.TimerSlot				= MICROWS_TIMER_NONE;
+				C.TimerNext				= Due;
+				Due						= i;
+				H.NumTimers--;
+				i = Next;
+			}
+		}
+		while(Due != MICROWS_INVALID_CONNECTION)
+		{
+			uint32_t Next = MicroWSGetConnection(Due).TimerNext;
+			MicroWSTimerExpire(H, Due);
+			Due = Next;
+		}
+		H.WheelTime = H.Now;
+		return;
+	}
+	while(H.Now - H.WheelTime >= MICROWS_TIMER_TICK_MS)
+	{
+		if(!H.NumTimers)
+		{
+			H.WheelTime = H.Now;
+			break;
+		}
+		H.WheelTime += MICROWS_TIMER_TICK_MS;
+		H.WheelPos			= (H.WheelPos + 1) & (MICROWS_TIMER_SLOTS - 1);
+		uint32_t i			= H.Wheel[H.WheelPos];
+		H.Wheel[H.WheelPos] = MICROWS_INVALID_CONNECTION;
+		while(i != MICROWS_INVALID_CONNECTION)
+		{
+			MicroWSConnection& C	= MicroWSGetConnection(i);
+			uint32_t		   Next = C.TimerNext;
+			C.TimerSlot				= MICROWS_TIMER_NONE;
+			H.NumTimers--;
+			MicroWSTimerExpire(H, i);
+			i = Next;
+		}
+	}
+}
+
+// How long the io thread can block before the next wheel bucket is due, -1 if no timers are set
+static int MicroWSTimerWait(MicroWSShard& H)
+{
+	if(!H.NumTimers)
+		return -1;
+	uint32_t Elapsed = MicroWSNow() - H.WheelTime;
+	return Elapsed >= MICROWS_TIMER_TICK_MS ? 0 : (int)(MICROWS_TIMER_TICK_MS - Elapsed);
+}
+
+// Nothing for the io side to do until a socket, the listener or the app wakes it up
+static bool MicroWSIoIdle(MicroWSShard& H)
+{
+	if(S.IoStop.load(std::memory_order_relaxed) || H.NumReady || H.PoolTrim.load(std::memory_order_seq_cst) != MICROWS_POOL_KEEP_ALL)
+		return false;
+	if(H.Backend != MICROWS_BACKEND_POLL && H.ListenerReady && MicroWSHasFreeSlot(H))
+		return false;
+	return H.Commands.Head.load(std::memory_order_relaxed) == H.Commands.Tail.load(std::memory_order_seq_cst);
+}
+
+// One pass of the io side: wait for sockets, run app commands and timers, accept and drain. Block is only set by the io
+// thread.
+static void MicroWSIoStep(MicroWSShard& H, bool Block)
+{
+	bool Wait = false;
+	if(Block)
+	{
+		H.IoSleeping.store(1, std::memory_order_seq_cst); // pairs with the fence in MicroWSAppCommand
+		Wait = MicroWSIoIdle(H);
+	}
+#if MICROWS_EPOLL
+	if(H.Backend == MICROWS_BACKEND_EPOLL)
+		MicroWSEpollWait(H, Wait ? MicroWSTimerWait(H) : 0);
+#endif
+#if MICROWS_IO_URING
+	if(H.Backend == MICROWS_BACKEND_IO_URING && Wait)
+		MicroWSUringWait(H);
+#endif
+	if(H.Backend == MICROWS_BACKEND_POLL && Block)
+	{
+		// nothing to block on, so sleep between passes
+#ifdef _WIN32
+		Sleep(MICROWS_THREAD_POLL_MS);
+#else
+		usleep(MICROWS_THREAD_POLL_MS * 1000);
+#endif
+	}
+	if(Block)
+		H.IoSleeping.store(0, std::memory_order_relaxed);
+	H.Now = MicroWSNow();
+	MicroWSIoCommands(H);
+	if(H.PoolTrim.load(std::memory_order_relaxed) != MICROWS_POOL_KEEP_ALL)
+		MicroWSRingPoolTrim(H, H.PoolTrim.exchange(MICROWS_POOL_KEEP_ALL, std::memory_order_relaxed));
+	MicroWSIoTimers(H);
+
+	for(int i = 0; i < MAX_CONNECTIONS_PER_UPDATE && H.ListenerReady; ++i)
+	{
+		if(!MicroWSHasFreeSlot(H))
+			break; // don't accept if we dont have a slot to accept the connection
+		MWSSocket Socket = accept(H.ListenerSocket, 0, 0);
+		if(MWS_INVALID_SOCKET(Socket))
+		{
+#ifdef _WIN32
+			int err1 = WSAGetLastError();
+			if(err1 != WSAEWOULDBLOCK)
+			{
+				mws_log(MICROWS_INVALID_CONNECTION, "No Connection WSA Error: %d:%s\n", err1, WSAGetErrorString(err1));
+			}
+#endif
+			if(H.Backend != MICROWS_BACKEND_POLL)
+				H.ListenerReady = false; // until epoll or io_uring reports it again
+			break;
+		}
+		MicroWSSetNonBlocking(Socket, 1);
+		if(S.NoDelay)
+		{
+			int On = 1;
+			if(setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&On, sizeof(On)))
+				mws_log(MICROWS_INVALID_CONNECTION, "TCP_NODELAY failed\n");
+		}
+		MicroWSAssignConnection(MicroWSFindConnection(H), Socket);
+	}
+	MicroWSDrain(H);
+}
+
+static void MicroWSPinThread(int Cpu)
+{
+	if(Cpu < 0)
+		return;
+#if defined(_WIN32)
+	if(Cpu >= (int)(sizeof(DWORD_PTR) * 8))
+		mws_log(MICROWS_INVALID_CONNECTION, "can't pin io thread to cpu %d, outside the affinity mask\n", Cpu);
+	else if(!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << Cpu))
+		mws_log(MICROWS_INVALID_CONNECTION, "failed to pin io thread to cpu %d: %d\n", Cpu, (int)GetLastError());
+#elif defined(__linux__)
+	if(Cpu >= CPU_SETSIZE)
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "can't pin io thread to cpu %d, outside cpu_set_t\n", Cpu);
+		return;
+	}
+	cpu_set_t Set;
+	CPU_ZERO(&Set);
+	CPU_SET(Cpu, &Set);
+	int r = pthread_setaffinity_np(pthread_self(), sizeof(Set), &Set);
+	if(r != 0)
+		mws_log(MICROWS_INVALID_CONNECTION, "failed to pin io thread to cpu %d: %d:%s\n", Cpu, r, strerror(r));
+#else
+	mws_log(MICROWS_INVALID_CONNECTION, "pinning io threads isn't supported on this platform\n");
+#endif
+}
+
+static void* MicroWSIoThread(void* Arg)
+{
+	MicroWSShard& H = *(MicroWSShard*)Arg;
+	MicroWSPinThread(H.Cpu);
+	while(!S.IoStop.load(std::memory_order_relaxed))
+		MicroWSIoStep(H, true);
+	return nullptr;
+}
+
+#if defined(_WIN32)
+struct MicroWSThreadStartArgs
+{
+	MicroWSThreadFunc Func;
+	void*			  Arg;
+};
+
+// CreateThread wants a DWORD WINAPI (LPVOID) entry point, so the pthread style function is called from this one
+static DWORD WINAPI MicroWSThreadTrampoline(LPVOID Param)
+{
+	MicroWSThreadStartArgs Args = *(MicroWSThreadStartArgs*)Param;
+	free(Param);
+	Args.Func(Args.Arg);
+	return 0;
+}
+
+static void MicroWShreadStart(MicroWSThread* pThread, MicroWSThreadFunc Func, void* Arg)
+{
+	MicroWSThreadStartArgs* Args = (MicroWSThreadStartArgs*)malloc(sizeof(MicroWSThreadStartArgs));
+	MWS_ASSERT(Args);
+	Args->Func = Func;
+	Args->Arg  = Arg;
+	*pThread   = CreateThread(0, 0, MicroWSThreadTrampoline, Args, 0, 0);
+	MWS_ASSERT(*pThread);
+}
+static void MicroWSThreadJoin(MicroWSThread* pThread)
+{
+	WaitForSingleObject(*pThread, INFINITE);
+	CloseHandle(*pThread);
+}
+#else
+static void MicroWShreadStart(MicroWSThread* pThread, MicroWSThreadFunc Func, void* Arg)
+{
+	int r = pthread_create(pThread, nullptr, Func, Arg);
+	MWS_ASSERT(r == 0);
+}
+static void MicroWSThreadJoin(MicroWSThread* pThread)
+{
+	int r = pthread_join(*pThread, nullptr);
+	MWS_ASSERT(r == 0);
+}
+#endif
+
+// Work the last MicroWSUpdate left for the next one, so MicroWSWait doesn't block: the dispatch budget ran out
+static bool MicroWSAppPending()
+{
+	for(uint32_t h = 0; h < S.NumShards; ++h)
+	{
+		MicroWSShard& H = S.Shards[h];
+		if(H.Received.Head.load(std::memory_order_relaxed) != H.Received.Tail.load(std::memory_order_relaxed))
+			return true;
+	}
+	return false;
+}
+
+// Drains AppWakeFd. With Arm the io side writes it again once it has something new for the app. The io threads keep
+// it armed from one MicroWSUpdate to the next, without them MicroWSUpdate disarms it, as it runs the io step itself
+static void MicroWSWaitArm(bool Arm)
+{
+#if defined(__linux__)
+	if(S.AppWakeFd < 0)
+		return;
+	uint64_t Count;
+	if(read(S.AppWakeFd, &Count, sizeof(Count)) < 0 && errno != EAGAIN)
+		mws_log(MICROWS_INVALID_CONNECTION, "wake read failed: %d:%s\n", errno, strerror(errno));
+	// drained before arming, so a wake from here on stays readable. Only the thread that is also the io side disarms
+	S.AppArmed.store(Arm ? 1 : 0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with MicroWSWakeApp
+#endif
+}
+
+// End of MicroWSUpdate: keeps AppWakeFd readable while there is work left
+static void MicroWSWaitLeft()
+{
+#if defined(__linux__)
+	if(S.AppWakeFd >= 0 && MicroWSAppPending())
+	{
+		uint64_t One = 1;
+		if(write(S.AppWakeFd, &One, sizeof(One)) < 0)
+			mws_log(MICROWS_INVALID_CONNECTION, "wake failed: %d:%s\n", errno, strerror(errno));
+	}
+#endif
+}
+
+void MicroWSUpdate(uint32_t* ConnectionsVersion, uint32_t* MaxMessageData)
+{
+	if(S.UpdateBudgetUs)
+		S.UpdateStart = MicroWSNowUs();
+	MicroWSWaitArm(S.Threaded);
+	if(!S.Threaded)
+	{
+		for(uint32_t h = 0; h < S.NumShards; ++h)
+			MicroWSIoStep(S.Shards[h], false);
+	}
+	MicroWSConsumeMessages();
+	MicroWSAppEvents();
+	if(S.OnMessage)
+		MicroWSDispatch();
+	MicroWSLatestFlush();
+	if(S.NumBatch && !S.BatchDepth && MicroWSNowUs() - S.BatchStart >= S.CoalesceUs)
+		MicroWSBatchFlush();
+	MicroWSWaitLeft();
+	if(MaxMessageData)
+		*MaxMessageData = MicroWSMaxDataAvailable();
+	if(ConnectionsVersion)
+		*ConnectionsVersion = S.ConnectionVersion;
+}
+
+void MicroWSWait(uint32_t TimeoutUs)
+{
+	uint64_t Timeout = TimeoutUs;
+	if(S.NumLatest)
+		Timeout = MicroWSMin(Timeout, (uint64_t)MICROWS_THREAD_POLL_MS * 1000); // retried by MicroWSUpdate as rings drain
+	if(S.NumBatch && !S.BatchDepth)
+	{
+		uint64_t Age = MicroWSNowUs() - S.BatchStart;
+		Timeout		 = Age >= S.CoalesceUs ? 0 : MicroWSMin(Timeout, S.CoalesceUs - Age);
+	}
+	bool Pending = MicroWSAppPending();
+	if(!S.Threaded && !Pending)
+	{
+		// sends the app made since MicroWSUpdate go out now. Anything this step receives wakes the fd
+		MicroWSWaitArm(true);
+		for(uint32_t h = 0; h < S.NumShards; ++h)
+		{
+			MicroWSShard& H = S.Shards[h];
+			MicroWSIoStep(H, false);
+			// still ready after the step means a receive budget or the accept limit ran out
+			if(H.NumReady || (H.Backend != MICROWS_BACKEND_POLL && H.ListenerReady && MicroWSHasFreeSlot(H)))
+				Pending = true;
+			int Ms = MicroWSTimerWait(H);
+			if(Ms >= 0)
+				Timeout = MicroWSMin(Timeout, (uint64_t)Ms * 1000);
+		}
+	}
+	if(!Timeout || Pending)
+		return;
+#if defined(__linux__)
+	if(S.WaitFd >= 0)
+	{
+		struct pollfd	Fd = {S.WaitFd, POLLIN, 0};
+		struct timespec Ts = {(time_t)(Timeout / 1000000), (long)(Timeout % 1000000) * 1000};
+		if(ppoll(&Fd, 1, &Ts, nullptr) < 0 && errno != EINTR)
+			mws_log(MICROWS_INVALID_CONNECTION, "ppoll failed: %d:%s\n", errno, strerror(errno));
+		return;
+	}
+#endif
+	// nothing to block on, so sleep like the io threads of the portable backend do
+	Timeout = MicroWSMin(Timeout, (uint64_t)MICROWS_THREAD_POLL_MS * 1000);
+#ifdef _WIN32
+	Sleep((DWORD)((Timeout + 999) / 1000));
+#else
+	usleep((useconds_t)Timeout);
+#endif
+}
+
+int MicroWSGetWaitFd()
+{
+	return S.WaitFd;
+}
+
+#define WEBSOCKET_HEADER_MAX 18
+struct MicroWSWebSocketHeader0
+{
+	union
+	{
+		struct
+		{
+			uint8_t opcode : 4;
+			uint8_t RSV3 : 1;
+			uint8_t RSV2 : 1;
+			uint8_t RSV1 : 1;
+			uint8_t FIN : 1;
+		};
+		uint8_t v;
+	};
+};
+
+struct MicroWSWebSocketHeader1
+{
+	union
+	{
+		struct
+		{
+			uint8_t payload : 7;
+			uint8_t MASK : 1;
+		};
+		uint8_t v;
+	};
+};
+
+// Payload unmasking. Mask holds the 4 mask bytes in memory order, so xoring it as a little endian word over the payload
+// from its first byte applies mask byte i & 3 to byte i. Every kernel finishes its tail with the scalar one.
+typedef void (*MicroWSUnmaskFunc)(uint8_t* Data, uint32_t Size, uint32_t Mask);
+
+static void MicroWSUnmaskScalar(uint8_t* Data, uint32_t Size, uint32_t Mask)
+{
+	uint64_t Mask64 = Mask | ((uint64_t)Mask << 32);
+	uint32_t i		= 0;
+	for(; i + 8 <= Size; i += 8)
+	{
+		uint64_t v;
+		memcpy(&v, Data + i, 8);
+		v ^= Mask64;
+		memcpy(Data + i, &v, 8);
+	}
+	const uint8_t* MaskBytes = (const uint8_t*)&Mask;
+	for(; i < Size; ++i)
+		Data[i] ^= MaskBytes[i & 3];
+}
+
+#if MICROWS_SIMD_X64
+static void MicroWSUnmaskSSE2(uint8_t* Data, uint32_t Size, uint32_t Mask)
+{
+	__m128i	 Mask128 = _mm_set1_epi32((int)Mask);
+	uint32_t i		 = 0;
+	for(; i + 64 <= Size; i += 64)
+	{
+		__m128i v0 = _mm_loadu_si128((__m128i*)(Data + i));
+		__m128i v1 = _mm_loadu_si128((__m128i*)(Data + i + 16));
+		__m128i v2 = _mm_loadu_si128((__m128i*)(Data + i + 32));
+		__m128i v3 = _mm_loadu_si128((__m128i*)(Data + i + 48));
+		_mm_storeu_si128((__m128i*)(Data + i), _mm_xor_si128(v0, Mask128));
+		_mm_storeu_si128((__m128i*)(Data + i + 16), _mm_xor_si128(v1, Mask128));
+		_mm_storeu_si128((__m128i*)(Data + i + 32), _mm_xor_si128(v2, Mask128));
+		_mm_storeu_si128((__m128i*)(Data + i + 48), _mm_xor_si128(v3, Mask128));
+	}
+	for(; i + 16 <= Size; i += 16)
+		_mm_storeu_si128((__m128i*)(Data + i), _mm_xor_si128(_mm_loadu_si128((__m128i*)(Data + i)), Mask128));
+	MicroWSUnmaskScalar(Data + i, Size - i, Mask); // i is a multiple of 4, so the mask phase is unchanged
+}
+
+MICROWS_TARGET_AVX2 static void MicroWSUnmaskAVX2(uint8_t* Data, uint32_t Size, uint32_t Mask)
+{
+	__m256i	 Mask256 = _mm256_set1_epi32((int)Mask);
+	uint32_t i		 = 0;
+	for(; i + 128 <= Size; i += 128)
+	{
+		__m256i v0 = _mm256_loadu_si256((__m256i*)(Data + i));
+		__m256i v1 = _mm256_loadu_si256((__m256i*)(Data + i + 32));
+		__m256i v2 = _mm256_loadu_si256((__m256i*)(Data + i + 64));
+		__m256i v3 = _mm256_loadu_si256((__m256i*)(Data + i + 96));
+		_mm256_storeu_si256((__m256i*)(Data + i), _mm256_xor_si256(v0, Mask256));
+		_mm256_storeu_si256((__m256i*)(Data + i + 32), _mm256_xor_si256(v1, Mask256));
+		_mm256_storeu_si256((__m256i*)(Data + i + 64), _mm256_xor_si256(v2, Mask256));
+		_mm256_storeu_si256((__m256i*)(Data + i + 96), _mm256_xor_si256(v3, Mask256));
+	}
+	for(; i + 32 <= Size; i += 32)
+		_mm256_storeu_si256((__m256i*)(Data + i), _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(Data + i)), Mask256));
+	// not MicroWSUnmaskSSE2, so the tail stays VEX encoded
+	__m128i Mask128 = _mm256_castsi256_si128(Mask256);
+	for(; i + 16 <= Size; i += 16)
+		_mm_storeu_si128((__m128i*)(Data + i), _mm_xor_si128(_mm_loadu_si128((__m128i*)(Data + i)), Mask128));
+	MicroWSUnmaskScalar(Data + i, Size - i, Mask);
+}
+
+static bool MicroWSCpuHasAVX2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	int Info[4];
+	__cpuid(Info, 0);
+	if(Info[0] < 7)
+		return false;
+	__cpuid(Info, 1);
+	const int OSXSAVE = 1 << 27;
+	const int AVX	  = 1 << 28;
+	if((Info[2] & (OSXSAVE | AVX)) != (OSXSAVE | AVX) || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(Info, 7, 0);
+	return (Info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#if MICROWS_SIMD_NEON
+static void MicroWSUnmaskNEON(uint8_t* Data, uint32_t Size, uint32_t Mask)
+{
+	uint8x16_t Mask128 = vreinterpretq_u8_u32(vdupq_n_u32(Mask));
+	uint32_t   i	   = 0;
+	for(; i + 64 <= Size; i += 64)
+	{
+		uint8x16_t v0 = vld1q_u8(Data + i);
+		uint8x16_t v1 = vld1q_u8(Data + i + 16);
+		uint8x16_t v2 = vld1q_u8(Data + i + 32);
+		uint8x16_t v3 = vld1q_u8(Data + i + 48);
+		vst1q_u8(Data + i, veorq_u8(v0, Mask128));
+		vst1q_u8(Data + i + 16, veorq_u8(v1, Mask128));
+		vst1q_u8(Data + i + 32, veorq_u8(v2, Mask128));
+		vst1q_u8(Data + i + 48, veorq_u8(v3, Mask128));
+	}
+	for(; i + 16 <= Size; i += 16)
+		vst1q_u8(Data + i, veorq_u8(vld1q_u8(Data + i), Mask128));
+	MicroWSUnmaskScalar(Data + i, Size - i, Mask);
+}
+#endif
+
+static MicroWSUnmaskFunc MicroWSUnmask = MicroWSUnmaskScalar;
+
+static void MicroWSUnmaskInit()
+{
+#if MICROWS_SIMD_X64
+	MicroWSUnmask = MicroWSCpuHasAVX2() ? MicroWSUnmaskAVX2 : MicroWSUnmaskSSE2;
+#elif MICROWS_SIMD_NEON
+	MicroWSUnmask = MicroWSUnmaskNEON;
+#endif
+}
+
+struct MicroWSFrame
+{
+	uint64_t Length;
+	uint32_t Mask; // 0 if unmasked
+	uint8_t	 Opcode;
+	uint8_t	 Fin;
+	uint8_t	 Rsv;
+};
+
+// Parses the frame header at the start of Data. Returns its size, or 0 if it hasn't all arrived yet.
+static uint32_t MicroWSParseHeader(const uint8_t* Data, uint32_t Size, MicroWSFrame* Frame)
+{
+	//  0                   1                   2                   3
+	//  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	// +-+-+-+-+-------+-+-------------+-------------------------------+
+	// |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
+	// |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
+	// |N|V|V|V|       |S|             |   (if payload len==126/127)   |
+	// | |1|2|3|       |K|             |                               |
+	// +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
+	if(Size < 2)
+		return 0;
+	MicroWSWebSocketHeader0 h0;
+	MicroWSWebSocketHeader1 h1;
+	h0.v		  = Data[0];
+	h1.v		  = Data[1];
+	Frame->Opcode = h0.opcode;
+	Frame->Fin	  = h0.FIN;
+	Frame->Rsv	  = (h0.RSV1 << 2) | (h0.RSV2 << 1) | h0.RSV3;
+	Frame->Length = h1.payload;
+	uint32_t HeaderSize = 2;
+	uint32_t NumBytes	= h1.payload == 126 ? 2 : h1.payload == 127 ? 8 : 0;
+	if(NumBytes)
+	{
+		if(Size < HeaderSize + NumBytes)
+			return 0; // incomplete header
+		Frame->Length = 0;
+		for(uint32_t i = 0; i < NumBytes; i++)
+			Frame->Length = (Frame->Length << 8) | Data[HeaderSize + i];
+		HeaderSize += NumBytes;
+	}
+	Frame->Mask = 0;
+	if(h1.MASK)
+	{
+		if(Size < HeaderSize + 4)
+			return 0;
+		memcpy(&Frame->Mask, Data + HeaderSize, 4);
+		HeaderSize += 4;
+	}
+	return HeaderSize;
+}
+
+// Mask for the byte Bytes after the one Mask applies to
+static uint32_t MicroWSRotateMask(uint32_t Mask, uint64_t Bytes)
+{
+	uint32_t Shift = (uint32_t)(Bytes & 3) * 8;
+	return Shift ? (Mask >> Shift) | (Mask << (32 - Shift)) : Mask;
+}
+
+// bytes MicroWSWriteHeader writes for a payload of Size. The length has to use the shortest encoding.
+static uint32_t MicroWSHeaderSize(uint32_t Size)
+{
+	return Size > 0xffff ? 10 : Size > 125 ? 4 : 2;
+}
+
+uint32_t MicroWSWriteHeader(uint8_t* Dst, uint32_t Size, uint8_t Opcode)
+{
+	MicroWSWebSocketHeader0 h0;
+	MicroWSWebSocketHeader1 h1;
+	h0.v					 = 0;
+	h1.v					 = 0;
+	h0.opcode				 = Opcode;
+	h0.FIN					 = 1;
+	uint32_t nExtraSizeBytes = 0;
+	uint8_t	 nExtraSize[8];
+	if(Size > 125)
+	{
+		if(Size > 0xffff)
+		{
+			nExtraSizeBytes = 8;
+			h1.payload		= 127;
+		}
+		else
+		{
+			h1.payload		= 126;
+			nExtraSizeBytes = 2;
+		}
+		uint64_t nCount = Size;
+		for(uint32_t i = 0; i < nExtraSizeBytes; ++i)
+		{
+			nExtraSize[nExtraSizeBytes - i - 1] = nCount & 0xff;
+			nCount >>= 8;
+		}
+
+		uint32_t SizeSum = 0;
+		for(uint32_t i = 0; i < nExtraSizeBytes; i++)
+		{
+			SizeSum <<= 8;
+			SizeSum += nExtraSize[i];
+		}
+		MWS_ASSERT(SizeSum == Size); // verify
+	}
+	else
+	{
+		h1.payload = Size;
+	}
+	char* Out = (char*)Dst;
+
+	*Out++ = *(char*)&h0;
+	*Out++ = *(char*)&h1;
+	if(nExtraSizeBytes)
+	{
+		memcpy(Out, &nExtraSize[0], nExtraSizeBytes);
+		Out += nExtraSizeBytes;
+	}
+	return 2 + nExtraSizeBytes;
+}
+
+uint32_t MicroWSWrite(uint8_t* Dst, const void* Src, uint32_t Size, uint8_t Opcode)
+{
+	uint32_t HeaderSize = MicroWSWriteHeader(Dst, Size, Opcode);
+	memcpy(Dst + HeaderSize, Src, Size);
+	return HeaderSize + Size;
+}
+
+// Sends a close frame, the last thing that goes out. After it only the peer's close frame is looked for in what it
+// sends, Closing tells the io side whether to wait for that. If there is no room for the frame nothing more is sent,
+// and the close timeout closes the socket.
+static void MicroWSSendClose(uint32_t i, const uint8_t* Payload, uint32_t Size, uint8_t Closing)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	C.RecvMode			 = MICROWS_RECV_FAILED;
+	uint32_t Sending	 = MICROWS_STREAM_SENDING;
+	C.SendStream.compare_exchange_strong(Sending, MICROWS_STREAM_CANCEL, std::memory_order_relaxed);
+	if(!MicroWSSendFrame(i, Payload, Size, MICROWS_OPCODE_CLOSE))
+		C.SendReserve.fetch_or(MICROWS_SEND_CLOSED, std::memory_order_relaxed);
+	C.Closing.store(Closing, std::memory_order_release);
+	MicroWSAppMarkReady(i);
+}
+
+// Protocol error, or a message we won't take: starts the close handshake with Code
+static void MicroWSRecvFail(uint32_t i, uint16_t Code)
+{
+	mws_log(MicroWSGetConnection(i).AppId, "closing: %d\n", Code);
+	uint8_t Payload[2] = {(uint8_t)(Code >> 8), (uint8_t)Code};
+	MicroWSSendClose(i, Payload, sizeof(Payload), MICROWS_CLOSING_SENT);
+}
+
+// Codes a peer may send in a close frame. 1004-1006 and 1015 are only for reporting, never sent
+static bool MicroWSCloseCodeValid(uint16_t Code)
+{
+	return (Code >= 1000 && Code <= 1003) || (Code >= 1007 && Code <= 1014) || (Code >= 3000 && Code <= 4999);
+}
+
+// Makes room for Size bytes in the arena of slot i
+static bool MicroWSArenaGrow(uint32_t i, uint64_t Size)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(Size <= C.ArenaCapacity)
+		return true;
+	if(Size > MICROWS_MESSAGE_MAX_SIZE)
+		return false;
+	uint64_t Capacity = MicroWSMax<uint64_t>(C.ArenaCapacity, 256);
+	while(Capacity < Size)
+		Capacity *= 2;
+	Capacity		= MicroWSMin<uint64_t>(Capacity, MICROWS_MESSAGE_MAX_SIZE);
+	uint8_t* Arena = (uint8_t*)realloc(C.Arena, (size_t)Capacity);
+	if(!Arena)
+		return false;
+	C.Arena			= Arena;
+	C.ArenaCapacity = (uint32_t)Capacity;
+	return true;
+}
+
+#if MICROWS_DEFLATE
+static const uint8_t MicroWSDeflateTail[4] = {0, 0, 0xff, 0xff}; // the end of a sync flush, left off every compressed message
+
+static z_stream* MicroWSInflater(uint32_t i)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(!C.Inflater)
+	{
+		z_stream* Z = (z_stream*)calloc(1, sizeof(z_stream));
+		if(Z && inflateInit2(Z, -C.Deflate.ClientBits) != Z_OK)
+		{
+			free(Z);
+			Z = nullptr;
+		}
+		C.Inflater = Z;
+	}
+	return C.Inflater;
+}
+
+// Inflates compressed payload of the message on slot i into the arena, which grows up to MICROWS_MESSAGE_MAX_SIZE. Past
+// that the message goes to the stream callback an arena at a time. Returns false if the connection failed.
+static bool MicroWSRecvInflate(uint32_t i, const uint8_t* Data, uint32_t Bytes)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	z_stream*		   Z = MicroWSInflater(i);
+	if(!Z)
+	{
+		MicroWSRecvFail(i, MICROWS_CLOSE_INTERNAL_ERROR);
+		return false;
+	}
+	Z->next_in	= (Bytef*)Data;
+	Z->avail_in = Bytes;
+	do
+	{
+		uint32_t Used = (uint32_t)(C.MessageRead - C.MessageFlushed);
+		if(Used == C.ArenaCapacity && !MicroWSArenaGrow(i, Used + 1))
+		{
+			if(!S.StreamCallback)
+			{
+				MicroWSRecvFail(i, MICROWS_CLOSE_TOO_BIG);
+				return false;
+			}
+			C.RecvMode = MICROWS_RECV_STREAM;
+			S.StreamCallback(C.AppId, C.Arena, Used, C.MessageFlushed, false, S.StreamUser);
+			C.MessageFlushed = C.MessageRead;
+			Used			 = 0;
+		}
+		Z->next_out	 = C.Arena + Used;
+		Z->avail_out = C.ArenaCapacity - Used;
+		int Result	 = inflate(Z, Z_SYNC_FLUSH);
+		C.MessageRead += C.ArenaCapacity - Used - Z->avail_out;
+		if(Result == Z_STREAM_END)
+		{
+			// the client ended the deflate stream with a final block, the next message starts a new one
+			inflateReset(Z);
+			Z->avail_in = 0;
+		}
+		else if(Result != Z_OK && Result != Z_BUF_ERROR)
+		{
+			MicroWSRecvFail(i, MICROWS_CLOSE_INVALID_DATA);
+			return false;
+		}
+	} while(Z->avail_in || !Z->avail_out);
+	return true;
+}
+#endif
+
+// The current frame of slot i has been read out of the ring
+static void MicroWSRecvFrameEnd(uint32_t i, bool Empty)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(!C.FrameFin)
+		return;
+#if MICROWS_DEFLATE
+	if(C.RecvInflate)
+	{
+		if(!MicroWSRecvInflate(i, MicroWSDeflateTail, sizeof(MicroWSDeflateTail)))
+			return;
+		if(C.Deflate.ClientReset)
+			inflateReset(C.Inflater);
+		if(C.RecvMode == MICROWS_RECV_STREAM)
+			S.StreamCallback(C.AppId, C.Arena, (uint32_t)(C.MessageRead - C.MessageFlushed), C.MessageFlushed, true, S.StreamUser);
+		C.RecvMode = C.RecvMode == MICROWS_RECV_ARENA ? MICROWS_RECV_READY : MICROWS_RECV_IDLE;
+		return;
+	}
+#endif
+	if(C.RecvMode == MICROWS_RECV_ARENA)
+	{
+		C.RecvMode = MICROWS_RECV_READY;
+	}
+	else
+	{
+		if(Empty) // the last piece already went out without knowing it was the last
+			S.StreamCallback(C.AppId, nullptr, 0, C.MessageRead, true, S.StreamUser);
+		C.RecvMode = MICROWS_RECV_IDLE;
+	}
+}
+
+// Reads Bytes of payload of the current frame out of the receive ring of slot i, into the arena or the stream callback
+static void MicroWSRecvPayload(uint32_t i, uint8_t* Data, uint32_t Bytes)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(C.FrameMask)
+	{
+		MicroWSUnmask(Data, Bytes, C.FrameMask);
+		C.FrameMask = MicroWSRotateMask(C.FrameMask, Bytes);
+	}
+	C.FrameLeft -= Bytes;
+#if MICROWS_DEFLATE
+	if(C.RecvInflate)
+	{
+		bool Inflated = MicroWSRecvInflate(i, Data, Bytes);
+		MicroWSAppConsume(i, Bytes);
+		if(Inflated && !C.FrameLeft)
+			MicroWSRecvFrameEnd(i, false);
+		return;
+	}
+#endif
+	if(C.RecvMode == MICROWS_RECV_ARENA)
+		memcpy(C.Arena + C.MessageRead, Data, Bytes);
+	else
+		S.StreamCallback(C.AppId, Data, Bytes, C.MessageRead, C.FrameFin && !C.FrameLeft, S.StreamUser);
+	C.MessageRead += Bytes;
+	MicroWSAppConsume(i, Bytes);
+	if(!C.FrameLeft)
+		MicroWSRecvFrameEnd(i, false);
+}
+
+// Pings are answered with their payload. Pongs need nothing, any bytes from the peer count as a sign of life to the io side
+static void MicroWSRecvControl(uint32_t i, const MicroWSFrame& Frame, const uint8_t* Payload)
+{
+	MicroWSConnection& C	= MicroWSGetConnection(i);
+	uint32_t		   Size = (uint32_t)Frame.Length;
+	uint8_t			   Body[125];
+	memcpy(Body, Payload, Size);
+	if(Frame.Mask)
+		MicroWSUnmask(Body, Size, Frame.Mask);
+	if(Frame.Opcode == MICROWS_OPCODE_PING)
+	{
+		if(MicroWSSendFrame(i, Body, Size, MICROWS_OPCODE_PONG))
+			MicroWSAppMarkReady(i);
+	}
+	else if(Frame.Opcode == MICROWS_OPCODE_CLOSE)
+	{
+		// the peer started the close handshake: ours echoes its code, then the io side closes the socket
+		C.Fail88++;
+		uint16_t Code = Size >= 2 ? (uint16_t)((Body[0] << 8) | Body[1]) : MICROWS_CLOSE_NORMAL;
+		if(Size == 1 || !MicroWSCloseCodeValid(Code))
+			Code = MICROWS_CLOSE_PROTOCOL_ERROR;
+		uint8_t Reply[2] = { (uint8_t)(Code >> 8), (uint8_t)(Code & 0xff) };
+		MicroWSSendClose(i, Reply, 2, MICROWS_CLOSING_DONE);
+	}
+}
+
+// Next complete message on slot i. A message that came in a single frame that fits in the receive ring is returned where
+// it is, with the ring bytes it takes in RingBytes. Anything else is read out of the ring as it arrives, into the arena
+// (RingBytes 0) or to the stream callback. Returns the payload, or nullptr if there is no complete message yet.
+static uint8_t* MicroWSPeekSlot(uint32_t i, uint32_t* Size, uint32_t* RingBytes)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	while(C.RecvMode != MICROWS_RECV_READY)
+	{
+		uint32_t Put   = C.RecvPut.load(std::memory_order_acquire);
+		uint32_t Get   = C.RecvGet.load(std::memory_order_relaxed);
+		uint32_t Bytes = MicroWSGetSpace(Get, Put, C.RecvSize);
+		if(!Bytes)
+			return nullptr;
+		uint8_t* Data = C.RecvBuffer + Get;
+		if(C.RecvMode == MICROWS_RECV_FAILED)
+		{
+			// after our close frame everything is skipped unread, up to the peer's close frame
+			if(C.FrameLeft)
+			{
+				uint32_t Skip = (uint32_t)MicroWSMin<uint64_t>(Bytes, C.FrameLeft);
+				C.FrameLeft -= Skip;
+				MicroWSAppConsume(i, Skip);
+				continue;
+			}
+			MicroWSFrame Frame;
+			uint32_t	 HeaderSize = MicroWSParseHeader(Data, Bytes, &Frame);
+			if(!HeaderSize)
+				return nullptr;
+			if(Frame.Opcode == MICROWS_OPCODE_CLOSE && C.Closing.load(std::memory_order_relaxed) == MICROWS_CLOSING_SENT)
+			{
+				C.Closing.store(MICROWS_CLOSING_DONE, std::memory_order_release);
+				MicroWSAppMarkReady(i);
+			}
+			C.FrameLeft = Frame.Length;
+			MicroWSAppConsume(i, HeaderSize);
+			continue;
+		}
+		if(C.FrameLeft)
+		{
+			MicroWSRecvPayload(i, Data, (uint32_t)MicroWSMin<uint64_t>(Bytes, C.FrameLeft));
+			continue;
+		}
+		MicroWSFrame Frame;
+		uint32_t	 HeaderSize = MicroWSParseHeader(Data, Bytes, &Frame);
+		if(!HeaderSize)
+			return nullptr;
+		// RSV1 on the first frame of a data message marks it compressed, if permessage-deflate was negotiated
+		if(Frame.Rsv && (Frame.Rsv != 4 || !C.Deflate.Enabled || Frame.Opcode == MICROWS_OPCODE_CONTINUATION || (Frame.Opcode & 8)))
+		{
+			C.FailRSV++;
+			MicroWSRecvFail(i, MICROWS_CLOSE_PROTOCOL_ERROR);
+			continue;
+		}
+		if((Frame.Opcode > MICROWS_OPCODE_BINARY && Frame.Opcode < MICROWS_OPCODE_CLOSE) || Frame.Opcode > MICROWS_OPCODE_PONG)
+		{
+			MicroWSRecvFail(i, MICROWS_CLOSE_PROTOCOL_ERROR); // reserved opcode
+			continue;
+		}
+		if(Frame.Opcode & 8)
+		{
+			// control frames are small and unfragmented, and may come between the fragments of a message
+			if(!Frame.Fin || Frame.Length > 125)
+			{
+				MicroWSRecvFail(i, MICROWS_CLOSE_PROTOCOL_ERROR);
+				continue;
+			}
+			if(Bytes < HeaderSize + Frame.Length)
+				return nullptr;
+			MicroWSRecvControl(i, Frame, Data + HeaderSize);
+			MicroWSAppConsume(i, HeaderSize + (uint32_t)Frame.Length);
+			continue;
+		}
+		bool Continuation = Frame.Opcode == MICROWS_OPCODE_CONTINUATION;
+		if(Continuation != (C.RecvMode != MICROWS_RECV_IDLE))
+		{
+			MicroWSRecvFail(i, MICROWS_CLOSE_PROTOCOL_ERROR); // a continuation with nothing to continue, or a new message before the last one finished
+			continue;
+		}
+		if(!Continuation && !Frame.Rsv && Frame.Fin && Frame.Length <= MICROWS_MESSAGE_MAX_SIZE && HeaderSize + Frame.Length < C.RecvSize)
+		{
+			// the common case, returned in place once all of it is in the ring
+			if(Bytes < HeaderSize + Frame.Length)
+				return nullptr;
+			uint8_t* Payload = Data + HeaderSize;
+			if(Frame.Mask)
+			{
+				MicroWSUnmask(Payload, (uint32_t)Frame.Length, Frame.Mask);
+				memset(Payload - 4, 0, 4); // clear so we can run code repeatedly if caller calls with a buffer too small.
+			}
+			C.RecvOpcode = Frame.Opcode;
+			*Size		 = (uint32_t)Frame.Length;
+			*RingBytes	 = HeaderSize + (uint32_t)Frame.Length;
+			return Payload;
+		}
+		if(!Continuation)
+		{
+			C.RecvMode		 = MICROWS_RECV_ARENA;
+			C.RecvInflate	 = Frame.Rsv != 0;
+			C.RecvOpcode	 = Frame.Opcode;
+			C.MessageSize	 = 0;
+			C.MessageRead	 = 0;
+			C.MessageFlushed = 0;
+		}
+		C.MessageSize += Frame.Length;
+		if(!C.RecvInflate && C.RecvMode == MICROWS_RECV_ARENA && (C.MessageSize > MICROWS_MESSAGE_MAX_SIZE || !MicroWSArenaGrow(i, C.MessageSize)))
+		{
+			if(!S.StreamCallback)
+			{
+				MicroWSRecvFail(i, MICROWS_CLOSE_TOO_BIG);
+				continue;
+			}
+			// too big to buffer, so what's in the arena and the rest of the message goes to the callback
+			C.RecvMode = MICROWS_RECV_STREAM;
+			if(C.MessageRead)
+				S.StreamCallback(C.AppId, C.Arena, (uint32_t)C.MessageRead, 0, false, S.StreamUser);
+		}
+		C.FrameLeft = Frame.Length;
+		C.FrameMask = Frame.Mask;
+		C.FrameFin	= Frame.Fin;
+		MicroWSAppConsume(i, HeaderSize);
+		if(!C.FrameLeft)
+			MicroWSRecvFrameEnd(i, true);
+	}
+	*Size	   = (uint32_t)C.MessageRead;
+	*RingBytes = 0;
+	return C.Arena;
+}
+
+// The app is done with the message MicroWSPeekSlot returned
+static void MicroWSConsumeSlot(uint32_t i, uint32_t RingBytes)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	C.PeekBytes			 = 0;
+	if(RingBytes)
+		MicroWSAppConsume(i, RingBytes);
+	else if(C.RecvMode == MICROWS_RECV_READY)
+		C.RecvMode = MICROWS_RECV_IDLE;
+}
+
+// MicroWSPeekSlot, with the topic requests of clients handled and consumed on the way
+static uint8_t* MicroWSNextMessage(uint32_t i, uint32_t* Size, uint32_t* RingBytes)
+{
+	uint8_t* Message;
+	while((Message = MicroWSPeekSlot(i, Size, RingBytes)) && S.ClientTopics && MicroWSTopicRequest(i, Message, *Size))
+		MicroWSConsumeSlot(i, *RingBytes);
+	return Message;
+}
+
+// The message after the Offset ring bytes already handed out on slot i, if it's a complete single frame data message
+// that can be returned in place. Anything else waits for MicroWSPeekSlot, once those bytes are consumed.
+static uint8_t* MicroWSPeekAfter(uint32_t i, uint32_t Offset, uint32_t* Size, uint32_t* RingBytes)
+{
+	MicroWSConnection& C	 = MicroWSGetConnection(i);
+	uint32_t		   Get	 = C.RecvGet.load(std::memory_order_relaxed);
+	uint32_t		   Bytes = MicroWSGetSpace(Get, C.RecvPut.load(std::memory_order_acquire), C.RecvSize) - Offset;
+	if(C.RecvMode != MICROWS_RECV_IDLE || !Bytes)
+		return nullptr;
+	uint8_t*	 Data = C.RecvBuffer + MicroWSRingPos(Get, Offset, C.RecvSize);
+	MicroWSFrame Frame;
+	uint32_t	 HeaderSize = MicroWSParseHeader(Data, Bytes, &Frame);
+	if(!HeaderSize || Frame.Rsv || !Frame.Fin || (Frame.Opcode != MICROWS_OPCODE_TEXT && Frame.Opcode != MICROWS_OPCODE_BINARY) || Bytes < HeaderSize + Frame.Length)
+		return nullptr;
+	if(Frame.Length > MICROWS_MESSAGE_MAX_SIZE)
+		return nullptr; // streamed or refused by MicroWSPeekSlot, like any message that big
+	uint8_t* Payload = Data + HeaderSize;
+	if(Frame.Mask)
+	{
+		MicroWSUnmask(Payload, (uint32_t)Frame.Length, Frame.Mask);
+		memset(Payload - 4, 0, 4); // MicroWSPeekSlot may read it again
 	}
+	bool Subscribe;
+	if(S.ClientTopics && Frame.Opcode == MICROWS_OPCODE_TEXT && MicroWSTopicPrefix(Payload, (uint32_t)Frame.Length, &Subscribe))
+		return nullptr; // left for MicroWSNextMessage to handle
+	C.RecvOpcode = Frame.Opcode;
+	*Size		 = (uint32_t)Frame.Length;
+	*RingBytes	 = HeaderSize + (uint32_t)Frame.Length;
+	return Payload;
+}
 
-	if(Placeholder2)
+// App list positions to look for messages in, from Start on and wrapping around, false if Connection can't have any.
+// Any connection starts after the one the app last got a message from, so they take turns.
+static bool MicroWSMessageRange(uint32_t Connection, uint32_t* Start, uint32_t* Count)
+{
+	*Start = S.RecvNext < S.NumApp ? S.RecvNext : 0;
+	*Count = S.NumApp;
+	if(Connection == MICROWS_ALL_CONNECTIONS)
+		return false;
+	if(Connection != MICROWS_ANY_CONNECTION && Connection != MICROWS_INVALID_CONNECTION)
 	{
-		VirtualFree(Placeholder2, 0, MEM_RELEASE);
+		uint32_t Index = MicroWSAppIndex(Connection);
+		if(Index == MICROWS_INVALID_CONNECTION)
+			return false;
+		*Start = MicroWSGetConnection(Index).AppIndex;
+		*Count = 1;
 	}
+	return true;
+}
 
-	if(View1)
+// Deficit round robin. Each turn of a connection adds RecvBudgetBytes to what it may take, which it keeps only while its
+// next message is too big for it. Returns false if the message of Size has to wait for the next turn.
+static bool MicroWSRecvTake(MicroWSConnection& C, uint32_t Size, uint32_t Taken)
+{
+	if(S.RecvBudgetMessages && Taken >= S.RecvBudgetMessages)
 	{
-		UnmapViewOfFileEx(View1, 0);
+		C.RecvDeficit = 0;
+		return false;
 	}
+	if(!S.RecvBudgetBytes)
+		return true;
+	if((int64_t)Size > C.RecvDeficit)
+		return false;
+	C.RecvDeficit -= Size;
+	return true;
+}
 
-	if(View2)
+static void MicroWSRecvTurn(MicroWSConnection& C)
+{
+	if(S.RecvBudgetBytes)
+		C.RecvDeficit += S.RecvBudgetBytes;
+}
+
+uint32_t MicroWSGetMessage(uint32_t Connection, uint8_t* OutBuffer, uint32_t BufferSize, uint32_t* ConnectionOut, bool* BinaryOut)
+{
+	uint32_t Start, Count;
+	if(!MicroWSMessageRange(Connection, &Start, &Count))
+		return 0;
+	for(uint32_t n = 0; n < Count; ++n)
 	{
-		UnmapViewOfFileEx(View2, 0);
+		uint32_t		   l = (Start + n) % S.NumApp;
+		uint32_t		   i = S.AppList[l];
+		MicroWSConnection& C = MicroWSGetConnection(i);
+		uint32_t		   MessageSize, RingBytes;
+		uint8_t*		   Message = MicroWSNextMessage(i, &MessageSize, &RingBytes);
+		if(Message && MessageSize <= BufferSize)
+		{
+			memcpy(OutBuffer, Message, MessageSize);
+			MicroWSConsumeSlot(i, RingBytes);
+			S.RecvNext = l + 1;
+			if(ConnectionOut)
+				*ConnectionOut = C.AppId;
+			if(BinaryOut)
+				*BinaryOut = C.RecvOpcode == MICROWS_OPCODE_BINARY;
+			return MessageSize;
+		}
 	}
+	return 0;
+}
 
-	return RingBuffer;
+const uint8_t* MicroWSPeekMessage(uint32_t Connection, uint32_t* Size, uint32_t* ConnectionOut, bool* BinaryOut)
+{
+	uint32_t Start, Count;
+	if(!MicroWSMessageRange(Connection, &Start, &Count))
+		return nullptr;
+	for(uint32_t n = 0; n < Count; ++n)
+	{
+		uint32_t		   i = S.AppList[(Start + n) % S.NumApp];
+		MicroWSConnection& C = MicroWSGetConnection(i);
+		uint32_t		   MessageSize, RingBytes;
+		uint8_t*		   Message = MicroWSNextMessage(i, &MessageSize, &RingBytes);
+		if(Message)
+		{
+			C.PeekBytes = RingBytes;
+			*Size		= MessageSize;
+			if(ConnectionOut)
+				*ConnectionOut = C.AppId;
+			if(BinaryOut)
+				*BinaryOut = C.RecvOpcode == MICROWS_OPCODE_BINARY;
+			return Message;
+		}
+	}
+	return nullptr;
 }
-#else
-static int MicroWSGetAnonFile()
+
+void MicroWSConsumeMessage(uint32_t Connection)
 {
-#ifdef __APPLE__
-	// tweaked verison of https://github.com/lassik/shm_open_anon/blob/master/shm_open_anon.c
-	int64_t PID = (int64_t)getpid();
-	static int Count = 1;
-	char Buffer[128];
+	uint32_t Index = MicroWSAppIndex(Connection);
+	if(Index == MICROWS_INVALID_CONNECTION)
+		return;
+	MicroWSConnection& C = MicroWSGetConnection(Index);
+	MicroWSConsumeSlot(Index, C.PeekBytes);
+	S.RecvNext = C.AppIndex + 1; // the peeked message is returned again until here, so the turn only moves on now
+}
 
-	for(int i = 0; i < 3; ++i)
+uint32_t MicroWSGetMessages(MicroWSMessageView* Views, uint32_t MaxViews)
+{
+	MicroWSConsumeMessages();
+	uint32_t Start, Count;
+	MicroWSMessageRange(MICROWS_ANY_CONNECTION, &Start, &Count);
+	uint32_t NumViews = 0;
+	for(uint32_t n = 0; n < Count && NumViews < MaxViews; ++n)
 	{
-		snprintf(Buffer, sizeof(Buffer)-1, "/shm-micro-ws-%" PRId64 "-%d", PID, Count);
-		Count++;
-		int fd = shm_open(Buffer, O_RDWR | O_CREAT | O_EXCL, 0600);
-		if(fd != -1)
+		uint32_t		   l = (Start + n) % S.NumApp;
+		uint32_t		   i = S.AppList[l];
+		MicroWSConnection& C = MicroWSGetConnection(i);
+		uint32_t		   Size, RingBytes;
+		uint8_t*		   Message = MicroWSNextMessage(i, &Size, &RingBytes);
+		if(!Message)
+			continue;
+		MicroWSRecvTurn(C);
+		if(!MicroWSRecvTake(C, Size, 0))
+			continue;
+		S.ViewList[S.NumView++] = i;
+		S.RecvNext				= l + 1;
+		// everything after the first message is read without consuming, and the ring bytes of all of them go at once
+		uint32_t Pending = 0;
+		uint32_t Taken	 = 0;
+		do
 		{
-			int save;
-			if(shm_unlink(Buffer) == -1)
+			MicroWSMessageView& V = Views[NumViews++];
+			V.Connection		  = C.AppId;
+			V.Data				  = Message;
+			V.Size				  = Size;
+			V.Binary			  = C.RecvOpcode == MICROWS_OPCODE_BINARY;
+			Pending += RingBytes;
+			Taken++;
+			Message = RingBytes && NumViews < MaxViews ? MicroWSPeekAfter(i, Pending, &Size, &RingBytes) : nullptr;
+		} while(Message && MicroWSRecvTake(C, Size, Taken));
+		if(!Message)
+			C.RecvDeficit = 0;
+		C.PeekBytes = Pending;
+	}
+	return NumViews;
+}
+
+void MicroWSConsumeMessages()
+{
+	for(uint32_t n = 0; n < S.NumView; ++n)
+		MicroWSConsumeSlot(S.ViewList[n], MicroWSGetConnection(S.ViewList[n]).PeekBytes);
+	S.NumView = 0;
+}
+
+// Hands the messages of the slots on the Received queues to S.OnMessage, a turn per slot. Only the entries queued when
+// it starts are looked at, so a connection that keeps sending can't keep MicroWSUpdate here, and a slot with messages
+// left over its budget is queued again for the next MicroWSUpdate. Shards take turns going first, so stopping at
+// S.UpdateBudgetUs doesn't always leave the same ones waiting.
+static void MicroWSDispatch()
+{
+	uint32_t First	= S.DispatchShard;
+	S.DispatchShard = (First + 1) % S.NumShards;
+	for(uint32_t h = 0; h < S.NumShards; ++h)
+	{
+		MicroWSQueue& Q		= S.Shards[(First + h) % S.NumShards].Received;
+		uint32_t	  Count = Q.Tail.load(std::memory_order_acquire) - Q.Head.load(std::memory_order_relaxed);
+		uint32_t	  i;
+		while(Count-- && MicroWSQueuePop(Q, &i))
+		{
+			MicroWSConnection& C = MicroWSGetConnection(i);
+			// cleared before the ring is read, so anything arriving after this queues the slot again
+			C.RecvNotify.exchange(0, std::memory_order_seq_cst);
+			uint32_t Id = C.AppId.load(std::memory_order_relaxed);
+			if(Id == MICROWS_INVALID_CONNECTION)
+				continue; // closed, or its open event hasn't been picked up yet, which queues it again
+			MicroWSRecvTurn(C);
+			uint32_t Size, RingBytes;
+			uint32_t Taken = 0;
+			uint8_t* Message;
+			while((Message = MicroWSNextMessage(i, &Size, &RingBytes)))
 			{
-				save = errno;
-				close(fd);
-				errno = save;
-				return -1;
+				if(!MicroWSRecvTake(C, Size, Taken))
+				{
+					MicroWSRecvNotify(i);
+					break;
+				}
+				S.OnMessage(Id, Message, Size, C.RecvOpcode == MICROWS_OPCODE_BINARY, S.CallbackUser);
+				MicroWSConsumeSlot(i, RingBytes);
+				Taken++;
 			}
-			return fd;
+			if(!Message)
+				C.RecvDeficit = 0;
+			if(S.UpdateBudgetUs && MicroWSNowUs() - S.UpdateStart >= S.UpdateBudgetUs)
+				return; // the rest stays queued
 		}
-		if(errno != EEXIST)
-			break;
 	}
-	return -1;
+}
 
+static MicroWSSharedFrame* MicroWSSharedAlloc(uint32_t MaxSize)
+{
+	void* Memory = malloc(sizeof(MicroWSSharedFrame) + WEBSOCKET_HEADER_MAX + MaxSize);
+	if(!Memory)
+		return nullptr;
+	MicroWSSharedFrame* Frame = new(Memory) MicroWSSharedFrame;
+	Frame->RefCount.store(1, std::memory_order_relaxed); // the caller's, released once every connection has been visited
+	Frame->Size = 0;
+	return Frame;
+}
 
-#else
-	return memfd_create("microws_ring", 0);
-#endif
+#if MICROWS_DEFLATE
+// Messages of Size to slot i go out compressed
+static bool MicroWSCompresses(uint32_t i, uint32_t Size)
+{
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	return C.Deflate.Enabled && C.DeflateLevel && Size >= C.DeflateMinSize;
 }
-static void* MicroWSAllocRing()
+
+static z_stream* MicroWSDeflateInit(int Level, uint32_t WindowBits)
 {
-	int fd = MicroWSGetAnonFile();
-	if (fd == -1)
+	z_stream* Z = (z_stream*)calloc(1, sizeof(z_stream));
+	if(Z && deflateInit2(Z, Level, Z_DEFLATED, -(int)WindowBits, MICROWS_DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		free(Z);
+		Z = nullptr;
+	}
+	return Z;
+}
+
+// Compresses Size bytes at Src into a frame at Dst, which has room for a header and Bound bytes of payload. Returns
+// the frame size.
+static uint32_t MicroWSDeflateFrame(z_stream* Z, uint8_t* Dst, const void* Src, uint32_t Size, uint32_t Bound, uint8_t Opcode)
+{
+	uint32_t Header = MicroWSHeaderSize(Bound);
+	Z->next_in		= (Bytef*)Src;
+	Z->avail_in		= Size;
+	Z->next_out		= Dst + Header;
+	Z->avail_out	= Bound;
+	int Result		= deflate(Z, Z_SYNC_FLUSH);
+	MWS_ASSERT(Result == Z_OK && !Z->avail_in && Z->avail_out);
+	uint32_t Compressed = Bound - Z->avail_out - sizeof(MicroWSDeflateTail); // the receiver puts the tail back
+	uint32_t HeaderSize = MicroWSHeaderSize(Compressed);
+	if(HeaderSize != Header)
+		memmove(Dst + HeaderSize, Dst + Header, Compressed);
+	MicroWSWriteHeader(Dst, Compressed, Opcode);
+	Dst[0] |= MICROWS_FRAME_RSV1;
+	return HeaderSize + Compressed;
+}
+
+// Payload bytes a compressed message of Size can take. deflateBound covers Z_FINISH, the sync flush adds at most an
+// empty stored block.
+static uint32_t MicroWSDeflateBound(z_stream* Z, uint32_t Size)
+{
+	return (uint32_t)deflateBound(Z, Size) + 16;
+}
+
+// Compresses a broadcast once, without history, so every client decompresses it the same whatever it saw before.
+// Returns nullptr if none of the slots takes it compressed.
+static MicroWSSharedFrame* MicroWSBroadcastDeflate(const void* Payload, uint32_t Size, uint8_t Opcode, const uint32_t* Slots, uint32_t NumSlots)
+{
+	bool Wanted = false;
+	for(uint32_t l = 0; l < NumSlots && !Wanted; ++l)
+		Wanted = MicroWSCompresses(Slots[l], Size);
+	if(!Wanted)
 		return nullptr;
-	ftruncate(fd, MICROWS_BUFFER_SPACE);
-	void* Buffer = mmap(NULL, MICROWS_BUFFER_SPACE * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (Buffer == MAP_FAILED)
+	if(!S.BroadcastDeflater)
+		S.BroadcastDeflater = MicroWSDeflateInit(S.DeflateLevel ? S.DeflateLevel : Z_DEFAULT_COMPRESSION, S.DeflateWindowBits);
+	if(!S.BroadcastDeflater)
 		return nullptr;
-	void* p0 = mmap(Buffer, MICROWS_BUFFER_SPACE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
-	void* p1 = mmap((char*)Buffer + MICROWS_BUFFER_SPACE, MICROWS_BUFFER_SPACE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
-	return Buffer;
+	uint32_t			Bound = MicroWSDeflateBound(S.BroadcastDeflater, Size);
+	MicroWSSharedFrame* Frame = MicroWSSharedAlloc(Bound);
+	if(!Frame)
+		return nullptr;
+	Frame->Size = MicroWSDeflateFrame(S.BroadcastDeflater, Frame->Data, Payload, Size, Bound, Opcode);
+	deflateReset(S.BroadcastDeflater);
+	return Frame;
 }
 #endif
 
-
-static uint32_t MicroWSFindConnection()
+// Queues a framed message on each of the slots, by reference when it's big enough to be worth it. Releases the
+// caller's reference. Connections that take Payload compressed get it compressed once for all of them.
+static bool MicroWSBroadcastFrame(MicroWSSharedFrame* Frame, const void* Payload, uint32_t Size, uint8_t Opcode, const uint32_t* Slots, uint32_t NumSlots)
 {
-	uint32_t ConnectionId = MICROWS_INVALID_CONNECTION;
-	uint32_t Last		  = S.LastConnection;
-	if(Last >= MICROWS_ALL_CONNECTIONS || (Last + MICROWS_MAX_CONNECTIONS >= MICROWS_ALL_CONNECTIONS) || (Last + MICROWS_MAX_CONNECTIONS < Last))
-		Last = 0;
-	for(uint32_t i = 0; i < MICROWS_MAX_CONNECTIONS; ++i)
+	MicroWSSharedFrame* Frames[2] = {Frame, nullptr};
+#if MICROWS_DEFLATE
+	Frames[1] = MicroWSBroadcastDeflate(Payload, Size, Opcode, Slots, NumSlots);
+#else
+	(void)Payload;
+	(void)Size;
+	(void)Opcode;
+#endif
+	int Failed = 0;
+	for(uint32_t l = 0; l < NumSlots; ++l)
 	{
-		uint32_t		   id	 = i + Last;
-		uint32_t		   index = id % MICROWS_MAX_CONNECTIONS;
-		MicroWSConnection& C	 = S.Connections[index];
-		if(C.Opening == C.Closed)
+		uint32_t			i = Slots[l];
+		MicroWSConnection&	C = MicroWSGetConnection(i);
+		MicroWSSharedFrame* F = Frame;
+#if MICROWS_DEFLATE
+		// a client that limited our window can't take a frame compressed with the full one
+		bool Deflate = Frames[1] && MicroWSCompresses(i, Size) && C.Deflate.ServerBits >= S.DeflateWindowBits;
+		if(Deflate)
+			F = Frames[1];
+#endif
+		bool	 Share = F->Size >= MICROWS_SHARED_FRAME_MIN_SIZE && NumSlots > 1;
+		uint32_t Push  = C.SharedPush.load(std::memory_order_relaxed);
+		bool	 ByRef = Share && Push - C.SharedPop.load(std::memory_order_acquire) < MICROWS_SHARED_FRAMES;
+		uint32_t Pos, Ticket;
+		// a frame sent by reference still takes an empty span, which fixes where it goes among the MT sends
+		if(MicroWSSendSpace(i, (uint32_t)C.SendReserve.load(std::memory_order_relaxed) & ~MICROWS_SEND_FLAGS) < F->Size ||
+		   !MicroWSSendReserve(i, ByRef ? 0 : F->Size, false, &Pos, &Ticket))
 		{
-			MWS_ASSERT(C.Opening != id);
-			S.LastConnection = id;
-			ConnectionId	 = id;
-			break;
+			Failed++;
+			MicroWSSendFailed(i);
+			continue;
+		}
+		if(ByRef)
+		{
+			MicroWSSharedRef& Ref = C.Shared[Push % MICROWS_SHARED_FRAMES];
+			Ref.Frame			  = F;
+			Ref.RingPos			  = Pos;
+			F->RefCount.fetch_add(1, std::memory_order_relaxed);
+			C.SharedBytes.fetch_add(F->Size, std::memory_order_relaxed);
+			C.SharedPush.store(Push + 1, std::memory_order_release);
+		}
+		else
+		{
+			memcpy(C.SendBuffer + Pos, F->Data, F->Size);
 		}
+		MicroWSSendCommit(i, Ticket, Pos, ByRef ? 0 : F->Size, ByRef ? 0 : F->Size);
+		MicroWSAppMarkReady(i);
+#if MICROWS_DEFLATE
+		// the client's inflater now has the message in its window, so the connection's own compressor needs it in its
+		// history too before it compresses the next message
+		if(Deflate && C.Deflater && !C.Deflate.ServerReset)
+			deflateSetDictionary(C.Deflater, (const Bytef*)Payload, Size);
+#endif
 	}
-	return ConnectionId;
+	MicroWSSharedRelease(Frame);
+	if(Frames[1])
+		MicroWSSharedRelease(Frames[1]);
+	return Failed == 0;
 }
 
-static void MicroWSAssignConnection(uint32_t Id, MWSSocket Socket)
+// Frames a message straight into the send ring of slot i. Safe from any thread that keeps the slot alive.
+static bool MicroWSSendFrame(uint32_t i, const void* Ptr, uint32_t Size, uint8_t Opcode)
 {
+	uint32_t Bytes = MicroWSHeaderSize(Size) + Size;
+	uint32_t Pos, Ticket;
+	if(!MicroWSSendReserve(i, Bytes, Opcode >= MICROWS_OPCODE_CLOSE, &Pos, &Ticket, Opcode == MICROWS_OPCODE_CLOSE))
+		return false;
+	MicroWSWrite(MicroWSGetConnection(i).SendBuffer + Pos, Ptr, Size, Opcode);
+	MicroWSSendCommit(i, Ticket, Pos, Bytes, Bytes);
+	return true;
+}
 
-	uint32_t Index = Id % MICROWS_MAX_CONNECTIONS;
+// MicroWSSendFrame for the app thread, which owns the compressor of the connection. Messages the connection takes
+// compressed are compressed straight into the send ring. The ring space is reserved first, so a message that doesn't
+// fit never goes into the compressor's history.
+static bool MicroWSSendAppFrame(uint32_t i, const void* Ptr, uint32_t Size, uint8_t Opcode)
+{
+#if MICROWS_DEFLATE
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(MicroWSCompresses(i, Size))
+	{
+		if(!C.Deflater)
+			C.Deflater = MicroWSDeflateInit(C.DeflateLevel, C.Deflate.ServerBits);
+		uint32_t Bound = C.Deflater ? MicroWSDeflateBound(C.Deflater, Size) : 0;
+		uint32_t Bytes = MicroWSHeaderSize(Bound) + Bound + 2; // 2 spare, so what isn't used can always be padded
+		uint32_t Pos, Ticket;
+		if(C.Deflater && MicroWSSendReserve(i, Bytes, false, &Pos, &Ticket))
+		{
+			uint32_t Frame = MicroWSDeflateFrame(C.Deflater, C.SendBuffer + Pos, Ptr, Size, Bound, Opcode);
+			if(C.Deflate.ServerReset)
+				deflateReset(C.Deflater);
+			MicroWSSendCommit(i, Ticket, Pos, Bytes, Frame);
+			return true;
+		}
+		// it may still fit uncompressed
+	}
+#endif
+	return MicroWSSendFrame(i, Ptr, Size, Opcode);
+}
 
-	MicroWSConnection& C = S.Connections[Index];
-	MWS_ASSERT(C.Opening == C.Closed);
-	if(!C.SendBuffer)
-		C.SendBuffer = (uint8_t*)MicroWSAllocRing();
-	if(!C.RecvBuffer)
-		C.RecvBuffer = (uint8_t*)MicroWSAllocRing();
+// Sends a data message to each of the slots
+static bool MicroWSSendSlots(const uint32_t* Slots, uint32_t NumSlots, const void* Ptr, uint32_t Size, uint8_t Opcode)
+{
+	// broadcasts are framed once and referenced from each connection's send queue instead of copied into every ring
+	if(Size >= MICROWS_SHARED_FRAME_MIN_SIZE && NumSlots > 1)
+	{
+		MicroWSSharedFrame* Frame = MicroWSSharedAlloc(Size);
+		if(Frame)
+		{
+			Frame->Size = MicroWSWrite(Frame->Data, Ptr, Size, Opcode);
+			return MicroWSBroadcastFrame(Frame, Ptr, Size, Opcode, Slots, NumSlots);
+		}
+	}
+	int Failed = 0;
+	for(uint32_t l = 0; l < NumSlots; ++l)
+	{
+		uint32_t i = Slots[l];
+		if(MicroWSSendAppFrame(i, Ptr, Size, Opcode))
+		{
+			MicroWSAppMarkReady(i);
+		}
+		else
+		{
+			Failed++;
+			MicroWSSendFailed(i);
+		}
+	}
+	return Failed == 0;
+}
 
-	C.Opening = Id;
-	C.Socket  = Socket;
+// Sends a data message to one connection, any connection or all of them
+static bool MicroWSSendData(uint32_t Connection, const void* Ptr, uint32_t Size, uint8_t Opcode)
+{
+	if(Connection == MICROWS_ALL_CONNECTIONS || Connection == MICROWS_ANY_CONNECTION)
+		return MicroWSSendSlots(S.AppList, S.NumApp, Ptr, Size, Opcode);
+	uint32_t Index = MicroWSAppIndex(Connection);
+	return Index != MICROWS_INVALID_CONNECTION && MicroWSSendSlots(&Index, 1, Ptr, Size, Opcode);
+}
 
-	S.ConnectionVersion++;
+bool MicroWSSendMessage(uint32_t Connection, const void* Ptr, uint32_t Size)
+{
+	return MicroWSSendData(Connection, Ptr, Size, MICROWS_OPCODE_TEXT);
+}
 
-	C.SendBlocked = 0;
-	C.SendPut	  = 0;
-	C.SendGet	  = 0;
-	C.RecvPut	  = 0;
-	C.RecvGet	  = 0;
-	C.Fail88	  = 0;
-	C.FailRSV	  = 0;
-	mws_log(Id, "->ASSIGN\n");
+bool MicroWSSendBinary(uint32_t Connection, const void* Ptr, uint32_t Size)
+{
+	return MicroWSSendData(Connection, Ptr, Size, MICROWS_OPCODE_BINARY);
 }
 
-void MicroWSGetState(MicroWSConnectionState& State)
+// Sends the message for Key to slot i, or holds it in place of the one held for Key until the ring has room. A
+// message is never sent ahead of an older held one of its key.
+static bool MicroWSSendLatestTo(uint32_t i, uint32_t Key, const void* Ptr, uint32_t Size, uint8_t Opcode)
 {
-	uint32_t NumConnections = 0;
-	for(uint32_t i = 0; i < MICROWS_MAX_CONNECTIONS; ++i)
+	MicroWSConnection& C	= MicroWSGetConnection(i);
+	uint32_t		   Held = 0;
+	while(Held < C.NumLatest && C.Latest[Held].Key != Key)
+		Held++;
+	if(Held == C.NumLatest)
 	{
-		MicroWSConnection& C = S.Connections[i];
-		if(MicroWSOpen(i))
+		if(MicroWSSendAppFrame(i, Ptr, Size, Opcode))
 		{
-			uint32_t Put = C.RecvPut;
-			uint32_t Get = C.RecvGet;
-
-			State.Connections[NumConnections] = C.Open;
-			State.Data[NumConnections]		  = MicroWSGetSpace(Get, Put);
-			NumConnections++;
+			MicroWSAppMarkReady(i);
+			return true;
+		}
+		MicroWSSendFailed(i);
+		if(C.NumLatest == C.LatestCapacity)
+		{
+			uint32_t	   Capacity = MicroWSMax(C.LatestCapacity * 2, 4u);
+			MicroWSLatest* Latest	= (MicroWSLatest*)realloc(C.Latest, Capacity * sizeof(MicroWSLatest));
+			if(!Latest)
+				return false;
+			memset(Latest + C.LatestCapacity, 0, (Capacity - C.LatestCapacity) * sizeof(MicroWSLatest));
+			C.Latest		 = Latest;
+			C.LatestCapacity = Capacity;
 		}
 	}
-	State.NumConnections	= NumConnections;
-	State.ConnectionVersion = S.ConnectionVersion;
+	MicroWSLatest& L = C.Latest[Held];
+	if(Size > L.Capacity)
+	{
+		uint8_t* Data = (uint8_t*)realloc(L.Data, Size);
+		if(!Data)
+			return false;
+		L.Data	   = Data;
+		L.Capacity = Size;
+	}
+	memcpy(L.Data, Ptr, Size);
+	L.Key	 = Key;
+	L.Size	 = Size;
+	L.Opcode = Opcode;
+	if(Held == C.NumLatest)
+		C.NumLatest++;
+	if(!C.LatestQueued)
+	{
+		C.LatestQueued				= 1;
+		S.LatestList[S.NumLatest++] = i;
+	}
+	return true;
 }
 
-void MicroWSUpdate(uint32_t* ConnectionsVersion, uint32_t* MaxMessageData)
+void MicroWSBeginBatch()
+{
+	S.BatchDepth++;
+}
+
+void MicroWSEndBatch()
 {
-	for(int i = 0; i < MAX_CONNECTIONS_PER_UPDATE; ++i)
+	if(S.BatchDepth && !--S.BatchDepth)
+		MicroWSBatchFlush();
+}
+
+bool MicroWSSendLatest(uint32_t Connection, uint32_t Key, const void* Ptr, uint32_t Size, bool Binary)
+{
+	uint8_t Opcode = Binary ? MICROWS_OPCODE_BINARY : MICROWS_OPCODE_TEXT;
+	if(MicroWSHeaderSize(Size) + Size >= S.SendRingMaxSize)
+		return false; // would be held forever
+	if(Connection != MICROWS_ALL_CONNECTIONS && Connection != MICROWS_ANY_CONNECTION)
 	{
-		uint32_t NewConnection = MicroWSFindConnection();
-		if(NewConnection == MICROWS_INVALID_CONNECTION)
-			break; // don't accept if we dont have a slot to accept the connection
-		MWSSocket Socket = accept(S.ListenerSocket, 0, 0);
-		if(MWS_INVALID_SOCKET(Socket))
-		{
-#ifdef _WIN32
-			int err1 = WSAGetLastError();
-			if(err1 != WSAEWOULDBLOCK)
-			{
-				mws_log(MICROWS_INVALID_CONNECTION, "No Connection WSA Error: %d:%s\n", err1, WSAGetErrorString(err1));
-			}
-#endif
-			break;
-		}
-		MicroWSSetNonBlocking(Socket, 1);
-		MicroWSAssignConnection(NewConnection, Socket);
+		uint32_t Index = MicroWSAppIndex(Connection);
+		return Index != MICROWS_INVALID_CONNECTION && MicroWSSendLatestTo(Index, Key, Ptr, Size, Opcode);
 	}
-	uint32_t MaxData = MicroWSDrain();
-	if(MaxMessageData)
-		*MaxMessageData = MaxData;
-	if(ConnectionsVersion)
-		*ConnectionsVersion = S.ConnectionVersion;
+	bool Sent = true;
+	for(uint32_t l = 0; l < S.NumApp; ++l)
+		Sent = MicroWSSendLatestTo(S.AppList[l], Key, Ptr, Size, Opcode) && Sent;
+	return Sent;
 }
 
-#define WEBSOCKET_HEADER_MAX 18
-struct MicroWSWebSocketHeader0
+// Retries the held messages of every connection in S.LatestList, in key order, and drops connections left with none
+static void MicroWSLatestFlush()
 {
-	union
+	uint32_t Out = 0;
+	for(uint32_t n = 0; n < S.NumLatest; ++n)
 	{
-		struct
+		uint32_t		   i	= S.LatestList[n];
+		MicroWSConnection& C	= MicroWSGetConnection(i);
+		uint32_t		   Kept = 0;
+		for(uint32_t k = 0; k < C.NumLatest; ++k)
 		{
-			uint8_t opcode : 4;
-			uint8_t RSV3 : 1;
-			uint8_t RSV2 : 1;
-			uint8_t RSV1 : 1;
-			uint8_t FIN : 1;
-		};
-		uint8_t v;
-	};
-};
+			MicroWSLatest& L = C.Latest[k];
+			if(MicroWSSendAppFrame(i, L.Data, L.Size, L.Opcode))
+			{
+				MicroWSAppMarkReady(i);
+				continue;
+			}
+			if(k != Kept)
+			{
+				MicroWSLatest Sent = C.Latest[Kept]; // keeps its buffer for reuse
+				C.Latest[Kept]	   = L;
+				L				   = Sent;
+			}
+			Kept++;
+		}
+		C.NumLatest = Kept;
+		if(Kept)
+			S.LatestList[Out++] = i;
+		else
+			C.LatestQueued = 0;
+	}
+	S.NumLatest = Out;
+}
 
-struct MicroWSWebSocketHeader1
+static void MicroWSLatestFree(uint32_t i)
 {
-	union
-	{
-		struct
-		{
-			uint8_t payload : 7;
-			uint8_t MASK : 1;
-		};
-		uint8_t v;
-	};
-};
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	for(uint32_t k = 0; k < C.LatestCapacity; ++k)
+		free(C.Latest[k].Data);
+	free(C.Latest);
+	C.Latest		 = nullptr;
+	C.NumLatest		 = 0;
+	C.LatestCapacity = 0;
+}
 
-uint32_t MicroWSTryRead(void* Src, uint32_t Size, uint32_t& OutOffset, uint32_t Connection)
+static uint32_t MicroWSTopicFind(const char* Name, uint32_t NameLen)
 {
+	for(uint32_t t = 0; t < S.NumTopics; ++t)
+		if(S.Topics[t].NameLen == NameLen && 0 == memcmp(S.Topics[t].Name, Name, NameLen))
+			return t;
+	return MICROWS_INVALID_TOPIC;
+}
 
-	//  0                   1                   2                   3
-	//  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-	// +-+-+-+-+-------+-+-------------+-------------------------------+
-	// |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
-	// |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
-	// |N|V|V|V|       |S|             |   (if payload len==126/127)   |
-	// | |1|2|3|       |K|             |                               |
-	// +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
-	MicroWSConnection& C = S.Connections[Connection];
-	if(Size < 2)
-		return 0;
-	uint8_t* Data	   = (uint8_t*)Src;
-	uint8_t* DataStart = Data;
-	uint8_t* DataEnd   = Data + Size;
+uint32_t MicroWSTopic(const char* Name)
+{
+	uint32_t NameLen = (uint32_t)strlen(Name);
+	uint32_t Topic	 = MicroWSTopicFind(Name, NameLen);
+	if(Topic != MICROWS_INVALID_TOPIC || NameLen >= MICROWS_TOPIC_NAME_MAX || S.NumTopics == MICROWS_MAX_TOPICS || !S.MaxConnections)
+		return Topic;
+	MicroWSTopicEntry& T = S.Topics[S.NumTopics];
+	T.Subscribers		 = (uint64_t*)calloc(S.MaxConnections / 64, sizeof(uint64_t));
+	if(!T.Subscribers)
+		return MICROWS_INVALID_TOPIC;
+	memcpy(T.Name, Name, NameLen + 1);
+	T.NameLen		 = NameLen;
+	T.NumSubscribers = 0;
+	return S.NumTopics++;
+}
 
-	MicroWSWebSocketHeader0* h0 = (MicroWSWebSocketHeader0*)(Data++);
-	MicroWSWebSocketHeader1* h1 = (MicroWSWebSocketHeader1*)(Data++);
-	if(h0->v == 0x88)
+static void MicroWSTopicJoin(uint32_t i, uint32_t Topic)
+{
+	MicroWSTopicEntry& T   = S.Topics[Topic];
+	uint64_t		   Bit = 1ull << (i & 63);
+	if(!(T.Subscribers[i >> 6] & Bit))
 	{
-		C.Fail88++;
-		return 0; // should we discard it?
+		T.Subscribers[i >> 6] |= Bit;
+		T.NumSubscribers++;
 	}
+}
 
-	if(h0->RSV1 != 0 || h0->RSV2 != 0 || h0->RSV3 != 0)
+static void MicroWSTopicLeave(uint32_t i, uint32_t Topic)
+{
+	MicroWSTopicEntry& T   = S.Topics[Topic];
+	uint64_t		   Bit = 1ull << (i & 63);
+	if(T.Subscribers[i >> 6] & Bit)
 	{
-		C.FailRSV++;
-		return 0;
+		T.Subscribers[i >> 6] &= ~Bit;
+		T.NumSubscribers--;
 	}
+}
 
-	uint32_t PacketSize = h1->payload;
-	uint32_t NumBytes	= 0;
-	switch(PacketSize)
-	{
-	case 126:
-		NumBytes = 2;
-		break;
-	case 127:
-		NumBytes = 8;
-		break;
-	default:
-		break;
-	}
-	if(NumBytes)
-	{
-		PacketSize			   = 0;
-		uint64_t MessageLength = 0;
+static void MicroWSTopicLeaveAll(uint32_t i)
+{
+	for(uint32_t t = 0; t < S.NumTopics; ++t)
+		MicroWSTopicLeave(i, t);
+}
 
-		uint8_t* BytesMessage = Data;
-		Data += NumBytes;
-		if(Data > DataEnd)
-			return 0; // incomplete message
-		for(uint32_t i = 0; i < NumBytes; i++)
+bool MicroWSSubscribe(uint32_t Connection, uint32_t Topic)
+{
+	uint32_t Index = MicroWSAppIndex(Connection);
+	if(Index == MICROWS_INVALID_CONNECTION || Topic >= S.NumTopics)
+		return false;
+	MicroWSTopicJoin(Index, Topic);
+	return true;
+}
+
+void MicroWSUnsubscribe(uint32_t Connection, uint32_t Topic)
+{
+	uint32_t Index = MicroWSAppIndex(Connection);
+	if(Index != MICROWS_INVALID_CONNECTION && Topic < S.NumTopics)
+		MicroWSTopicLeave(Index, Topic);
+}
+
+// Length of the "subscribe:" or "unsubscribe:" a text message starts with, or 0
+static uint32_t MicroWSTopicPrefix(const uint8_t* Message, uint32_t Size, bool* Subscribe)
+{
+	static const uint32_t SubscribeLen	 = sizeof(MICROWS_TOPIC_SUBSCRIBE) - 1;
+	static const uint32_t UnsubscribeLen = sizeof(MICROWS_TOPIC_UNSUBSCRIBE) - 1;
+	*Subscribe							 = Size >= SubscribeLen && 0 == memcmp(Message, MICROWS_TOPIC_SUBSCRIBE, SubscribeLen);
+	if(*Subscribe)
+		return SubscribeLen;
+	return Size >= UnsubscribeLen && 0 == memcmp(Message, MICROWS_TOPIC_UNSUBSCRIBE, UnsubscribeLen) ? UnsubscribeLen : 0;
+}
+
+// Handles a "subscribe:<topic>" or "unsubscribe:<topic>" message from slot i. False if it's an ordinary message.
+static bool MicroWSTopicRequest(uint32_t i, const uint8_t* Message, uint32_t Size)
+{
+	if(MicroWSGetConnection(i).RecvOpcode != MICROWS_OPCODE_TEXT)
+		return false;
+	bool	 Subscribe;
+	uint32_t Prefix = MicroWSTopicPrefix(Message, Size, &Subscribe);
+	if(!Prefix)
+		return false;
+	uint32_t Topic = MicroWSTopicFind((const char*)Message + Prefix, Size - Prefix);
+	if(Topic == MICROWS_INVALID_TOPIC)
+		mws_log(MicroWSGetConnection(i).AppId, "no topic '%.*s'\n", (int)(Size - Prefix), Message + Prefix);
+	else if(Subscribe)
+		MicroWSTopicJoin(i, Topic);
+	else
+		MicroWSTopicLeave(i, Topic);
+	return true;
+}
+
+bool MicroWSPublish(uint32_t Topic, const void* Data, uint32_t Size, bool Binary)
+{
+	if(Topic >= S.NumTopics)
+		return false;
+	// the subscriber bits, as a list of slots
+	MicroWSTopicEntry& T		= S.Topics[Topic];
+	uint32_t		   NumSlots = 0;
+	for(uint32_t w = 0; NumSlots < T.NumSubscribers; ++w)
+	{
+		uint64_t Bits = T.Subscribers[w];
+		while(Bits)
 		{
-			PacketSize <<= 8;
-			PacketSize += BytesMessage[i];
+#if defined(_MSC_VER) && !defined(__clang__)
+			unsigned long Bit;
+			_BitScanForward64(&Bit, Bits);
+#else
+			uint32_t Bit = (uint32_t)__builtin_ctzll(Bits);
+#endif
+			S.TopicSlots[NumSlots++] = w * 64 + Bit;
+			Bits &= Bits - 1;
 		}
-
-		for(uint32_t i = 0; i < NumBytes; i++)
-			MessageLength |= BytesMessage[i] << ((NumBytes - 1 - i) * 8);
-		MWS_ASSERT(MessageLength == PacketSize);
 	}
-	uint8_t* pMask = nullptr;
-	if(h1->MASK)
+	return MicroWSSendSlots(S.TopicSlots, NumSlots, Data, Size, Binary ? MICROWS_OPCODE_BINARY : MICROWS_OPCODE_TEXT);
+}
+
+// Reserves a message of up to MaxSize on a connection and keeps its slot alive until the reservation is committed
+static void* MicroWSReserveMessage(MicroWSReservation& R, uint32_t Connection, uint32_t MaxSize)
+{
+	uint32_t Index = MicroWSSenderAcquire(Connection);
+	if(Index == MICROWS_INVALID_CONNECTION)
+		return nullptr;
+	MicroWSConnection& C = MicroWSGetConnection(Index);
+	R.Header			 = MicroWSHeaderSize(MaxSize);
+	R.MaxSize			 = MaxSize;
+	R.Bytes				 = R.Header + MaxSize + 2; // 2 spare, so what isn't used can always be padded if the span can't shrink
+	if(!MicroWSSendReserve(Index, R.Bytes, false, &R.Pos, &R.Ticket))
 	{
-		pMask = Data;
-		Data += 4;
-		if(Data > DataEnd)
-			return 0;
+		MicroWSSendFailed(Index);
+		MicroWSSenderRelease(Index);
+		return nullptr;
 	}
-	uint8_t* Bytes = Data;
+	R.Connection = Connection;
+	R.Index		 = Index;
+	return C.SendBuffer + R.Pos + R.Header;
+}
 
-	OutOffset = (uint32_t)(Data - DataStart);
-	Data += PacketSize;
-	if(Data > DataEnd)
-		return 0;
-	if(pMask && (pMask[0] != 0 || pMask[1] != 0 || pMask[2] != 0 || pMask[3] != 0))
+// Frames the first Size bytes of a reservation and commits it, or commits it empty if Send is false. Returns false if
+// the connection closed in the meantime.
+static bool MicroWSCommitReserved(MicroWSReservation& R, uint32_t Size, bool Send, uint8_t Opcode)
+{
+	MicroWSConnection& C	 = MicroWSGetConnection(R.Index);
+	uint32_t		   Bytes = 0;
+	if(Send)
 	{
-		for(uint32_t i = 0; i < PacketSize; ++i)
-			Bytes[i] ^= pMask[i & 3];
-		// clear so we can run code repeatedly if caller calls with a buffer too small.
-		pMask[0] = 0;
-		pMask[1] = 0;
-		pMask[2] = 0;
-		pMask[3] = 0;
+		MWS_ASSERT(Size <= R.MaxSize);
+		uint32_t HeaderSize = MicroWSHeaderSize(Size);
+		uint8_t* Dst		= C.SendBuffer + R.Pos;
+		if(HeaderSize != R.Header)
+			memmove(Dst + HeaderSize, Dst + R.Header, Size);
+		MicroWSWriteHeader(Dst, Size, Opcode);
+		Bytes = HeaderSize + Size;
 	}
-
-	return PacketSize;
+	MicroWSSendCommit(R.Index, R.Ticket, R.Pos, R.Bytes, Bytes);
+	bool Open	 = C.AppId.load(std::memory_order_acquire) == R.Connection;
+	R.Connection = MICROWS_INVALID_CONNECTION;
+	MicroWSSenderMarkReady(R.Index);
+	MicroWSSenderRelease(R.Index);
+	return Open;
 }
 
-uint32_t MicroWSWrite(uint8_t* Dst, const void* Src, uint32_t Size)
+void* MicroWSBeginMessage(uint32_t Connection, uint32_t MaxSize)
 {
-	MicroWSWebSocketHeader0 h0;
-	MicroWSWebSocketHeader1 h1;
-	h0.v					 = 0;
-	h1.v					 = 0;
-	h0.opcode				 = 1;
-	h0.FIN					 = 1;
-	uint32_t nExtraSizeBytes = 0;
-	uint8_t	 nExtraSize[8];
-	if(Size > 125)
+	// the previous reservation was never committed
+	if(S.ReserveFrame)
+		MicroWSSharedRelease(S.ReserveFrame);
+	else if(S.Reserve.Connection != MICROWS_INVALID_CONNECTION)
+		MicroWSCommitReserved(S.Reserve, 0, false, 0);
+	S.ReserveFrame		 = nullptr;
+	S.Reserve.Connection = MICROWS_INVALID_CONNECTION;
+	if(Connection == MICROWS_ALL_CONNECTIONS || Connection == MICROWS_ANY_CONNECTION)
 	{
-		if(Size > 0xffff)
-		{
-			nExtraSizeBytes = 8;
-			h1.payload		= 127;
-		}
-		else
-		{
-			h1.payload		= 126;
-			nExtraSizeBytes = 2;
-		}
-		uint64_t nCount = Size;
-		for(uint32_t i = 0; i < nExtraSizeBytes; ++i)
-		{
-			nExtraSize[nExtraSizeBytes - i - 1] = nCount & 0xff;
-			nCount >>= 8;
-		}
-
-		uint32_t SizeSum = 0;
-		for(uint32_t i = 0; i < nExtraSizeBytes; i++)
-		{
-			SizeSum <<= 8;
-			SizeSum += nExtraSize[i];
-		}
-		MWS_ASSERT(SizeSum == Size); // verify
+		// serialized once into a shared frame, fanned out on commit
+		S.ReserveFrame = MicroWSSharedAlloc(MaxSize);
+		if(!S.ReserveFrame)
+			return nullptr;
+		S.Reserve.Connection = Connection;
+		S.Reserve.MaxSize	 = MaxSize;
+		S.Reserve.Header	 = MicroWSHeaderSize(MaxSize);
+		return S.ReserveFrame->Data + S.Reserve.Header;
 	}
-	else
+	return MicroWSReserveMessage(S.Reserve, Connection, MaxSize);
+}
+
+bool MicroWSCommitMessage(uint32_t Size, bool Binary)
+{
+	uint8_t Opcode = Binary ? MICROWS_OPCODE_BINARY : MICROWS_OPCODE_TEXT;
+	if(S.Reserve.Connection == MICROWS_INVALID_CONNECTION)
+		return false;
+	if(S.ReserveFrame)
 	{
-		h1.payload = Size;
+		MicroWSSharedFrame* Frame = S.ReserveFrame;
+		S.ReserveFrame			  = nullptr;
+		S.Reserve.Connection	  = MICROWS_INVALID_CONNECTION;
+		MWS_ASSERT(Size <= S.Reserve.MaxSize);
+		uint32_t HeaderSize = MicroWSHeaderSize(Size);
+		if(HeaderSize != S.Reserve.Header)
+			memmove(Frame->Data + HeaderSize, Frame->Data + S.Reserve.Header, Size);
+		MicroWSWriteHeader(Frame->Data, Size, Opcode);
+		Frame->Size = HeaderSize + Size;
+		return MicroWSBroadcastFrame(Frame, Frame->Data + HeaderSize, Size, Opcode, S.AppList, S.NumApp);
 	}
-	char* Out = (char*)Dst;
+	return MicroWSCommitReserved(S.Reserve, Size, true, Opcode);
+}
 
-	*Out++ = *(char*)&h0;
-	*Out++ = *(char*)&h1;
-	if(nExtraSizeBytes)
+bool MicroWSSendMessageMT(uint32_t Connection, const void* Data, uint32_t Size, bool Binary)
+{
+	uint32_t Index = MicroWSSenderAcquire(Connection);
+	if(Index == MICROWS_INVALID_CONNECTION)
+		return false;
+	bool Sent = MicroWSSendFrame(Index, Data, Size, Binary ? MICROWS_OPCODE_BINARY : MICROWS_OPCODE_TEXT);
+	if(Sent)
+		MicroWSSenderMarkReady(Index);
+	else
+		MicroWSSendFailed(Index);
+	MicroWSSenderRelease(Index);
+	return Sent;
+}
+
+void* MicroWSBeginMessageMT(MicroWSReservation& Reservation, uint32_t Connection, uint32_t MaxSize)
+{
+	if(Reservation.Connection != MICROWS_INVALID_CONNECTION)
+		MicroWSCommitReserved(Reservation, 0, false, 0); // never committed
+	return MicroWSReserveMessage(Reservation, Connection, MaxSize);
+}
+
+bool MicroWSCommitMessageMT(MicroWSReservation& Reservation, uint32_t Size, bool Binary)
+{
+	if(Reservation.Connection == MICROWS_INVALID_CONNECTION)
+		return false;
+	return MicroWSCommitReserved(Reservation, Size, true, Binary ? MICROWS_OPCODE_BINARY : MICROWS_OPCODE_TEXT);
+}
+
+bool MicroWSSendStream(uint32_t Connection, const void* Data, uint64_t Size, MicroWSSendStreamCallback Callback, void* User)
+{
+	uint32_t Index = MicroWSAppIndex(Connection);
+	if(Index == MICROWS_INVALID_CONNECTION)
+		return false;
+	MicroWSConnection& C = MicroWSGetConnection(Index);
+	if(C.SendStream.load(std::memory_order_acquire) != MICROWS_STREAM_IDLE || C.RecvMode == MICROWS_RECV_FAILED)
 	{
-		memcpy(Out, &nExtraSize[0], nExtraSizeBytes);
-		Out += nExtraSizeBytes;
+		C.SendBlocked++;
+		return false;
 	}
-	memcpy(Out, Src, Size);
-	return 2 + nExtraSizeBytes + Size;
+	C.SendStreamData	 = (const uint8_t*)Data;
+	C.SendStreamCallback = Callback;
+	C.SendStreamUser	 = User;
+	C.SendStreamSize	 = Size;
+	C.SendStreamSent	 = 0;
+	// messages reserved from here on are refused until the last fragment is reserved, ones reserved before go out first
+	C.SendReserve.fetch_or(MICROWS_SEND_STREAMING, std::memory_order_relaxed);
+	C.SendStream.store(MICROWS_STREAM_SENDING, std::memory_order_release);
+	MicroWSAppMarkReady(Index);
+	return true;
 }
 
-uint32_t MicroWSGetMessage(uint32_t Connection, uint8_t* OutBuffer, uint32_t BufferSize, uint32_t* ConnectionOut)
+bool MicroWSSendStreamDone(uint32_t Connection)
 {
-	uint32_t start		   = 0;
-	uint32_t end		   = MICROWS_MAX_CONNECTIONS;
-	bool	 AnyConnection = Connection != MICROWS_ANY_CONNECTION;
+	uint32_t Index = MicroWSAppIndex(Connection);
+	return Index == MICROWS_INVALID_CONNECTION || MicroWSGetConnection(Index).SendStream.load(std::memory_order_acquire) == MICROWS_STREAM_IDLE;
+}
 
-	if(Connection == MICROWS_ALL_CONNECTIONS)
-		return 0;
-	if(!AnyConnection)
+static void MicroWSDeflateFree(uint32_t i)
+{
+#if MICROWS_DEFLATE
+	MicroWSConnection& C = MicroWSGetConnection(i);
+	if(C.Deflater)
 	{
-		start = (Connection % MICROWS_MAX_CONNECTIONS);
-		end	  = start + 1;
+		deflateEnd(C.Deflater);
+		free(C.Deflater);
+		C.Deflater = nullptr;
 	}
-	for(uint32_t i = start; i < end; ++i)
+	if(C.Inflater)
 	{
-		MicroWSConnection& C = S.Connections[i];
-		if(MicroWSOpen(i) && (AnyConnection || C.Open == Connection))
-		{
-			uint32_t Put   = C.RecvPut;
-			uint32_t Get   = C.RecvGet;
-			uint32_t Bytes = MicroWSGetSpace(Get, Put);
-			if(Bytes)
-			{
-
-				uint8_t* Data		   = C.RecvBuffer + Get;
-				uint32_t MessageOffset = 0;
-				uint32_t MessageSize   = MicroWSTryRead(Data, Bytes, MessageOffset, i);
-				if(MessageSize && MessageSize <= BufferSize)
-				{
-					memcpy(OutBuffer, Data + MessageOffset, MessageSize);
-					C.RecvGet = MicroWSGetAdvance(Get, Put, MessageOffset + MessageSize);
-					return MessageSize;
-				}
-			}
-		}
+		inflateEnd(C.Inflater);
+		free(C.Inflater);
+		C.Inflater = nullptr;
 	}
-	return 0;
+#else
+	(void)i;
+#endif
 }
 
-bool MicroWSSendMessage(uint32_t Connection, const void* Ptr, uint32_t Size)
+void MicroWSDisconnect(uint32_t Connection, uint16_t Code)
+{
+	uint32_t Index = MicroWSAppIndex(Connection);
+	if(Index == MICROWS_INVALID_CONNECTION || MicroWSGetConnection(Index).Closing.load(std::memory_order_relaxed))
+		return;
+	MicroWSRecvFail(Index, Code);
+}
+
+void MicroWSSetRingSize(uint32_t Connection, uint32_t Size)
+{
+	uint32_t Index = MicroWSAppIndex(Connection);
+	if(Index == MICROWS_INVALID_CONNECTION)
+		return;
+	MicroWSGetConnection(Index).SendWant.store(MicroWSRingSize(Size), std::memory_order_release);
+	MicroWSAppMarkReady(Index);
+}
+
+void MicroWSTrimRingPool(uint32_t Keep)
 {
-	uint32_t start			= 0;
-	uint32_t end			= MICROWS_MAX_CONNECTIONS;
-	bool	 AnyConnection	= Connection == MICROWS_ANY_CONNECTION;
-	bool	 AllConnections = Connection == MICROWS_ALL_CONNECTIONS;
-	if(Connection < MICROWS_ALL_CONNECTIONS)
+	if(!S.IsRunning)
+		return;
+	for(uint32_t h = 0; h < S.NumShards; ++h)
 	{
-		start = (Connection % MICROWS_MAX_CONNECTIONS);
-		end	  = start + 1;
+		MicroWSShard& H = S.Shards[h];
+		H.PoolTrim.store(2 * ((Keep + S.NumShards - 1) / S.NumShards), std::memory_order_seq_cst); // pairs with MicroWSIoIdle
+		if(S.Threaded && H.IoSleeping.load(std::memory_order_seq_cst))
+			MicroWSWakeIo(H);
 	}
-	int Failed = 0;
-	for(uint32_t i = start; i < end; ++i)
+}
+
+void MicroWSGetRingStats(MicroWSRingStats& Stats)
+{
+	Stats.Bytes		  = S.RingBytes.load(std::memory_order_relaxed);
+	Stats.Rings		  = S.NumRings.load(std::memory_order_relaxed);
+	Stats.PooledBytes = S.PooledRingBytes.load(std::memory_order_relaxed);
+	Stats.PooledRings = S.NumPooledRings.load(std::memory_order_relaxed);
+}
+
+void MicroWSSetCompression(uint32_t Connection, int Level, uint32_t MinSize)
+{
+	uint32_t Index = MicroWSAppIndex(Connection);
+	if(Index == MICROWS_INVALID_CONNECTION)
+		return;
+	MicroWSConnection& C = MicroWSGetConnection(Index);
+	Level				 = MicroWSClamp(Level, 0, 9);
+#if MICROWS_DEFLATE
+	if(C.Deflater && Level != C.DeflateLevel)
 	{
-		MicroWSConnection& C = S.Connections[i];
-		if(MicroWSOpen(i) && (AnyConnection || AllConnections || C.Open == Connection))
-		{
-			uint32_t Put   = C.SendPut;
-			uint32_t Get   = C.SendGet;
-			uint32_t Bytes = MicroWSPutSpace(Put, Get);
-			if(Bytes >= Size + WEBSOCKET_HEADER_MAX)
-			{
-				uint8_t* SendData	= C.SendBuffer + Put;
-				uint32_t WriteBytes = MicroWSWrite(SendData, Ptr, Size);
-				C.SendPut			= MicroWSPutAdvance(Put, Get, WriteBytes);
-			}
-			else
-			{
-				Failed++;
-				C.SendBlocked++;
-			}
-		}
+		// dropped, the next message starts a new one at the new level. A fresh compressor never refers back to
+		// earlier messages, so the client can't tell
+		deflateEnd(C.Deflater);
+		free(C.Deflater);
+		C.Deflater = nullptr;
 	}
-	return Failed == 0;
+#endif
+	C.DeflateLevel	 = Level;
+	C.DeflateMinSize = MinSize;
 }
+
 void MicroWSShutdown()
 {
 	if(S.IsRunning)
@@ -1131,7 +5288,7 @@ void MicroWSShutdown()
 
 bool MicroWSOpening(uint32_t i)
 {
-	MicroWSConnection& C		 = S.Connections[i];
+	MicroWSConnection& C		 = MicroWSGetConnection(i);
 	uint32_t		   Openening = C.Opening;
 	uint32_t		   Closed	 = C.Closed;
 	return int32_t(Openening - Closed) > 0;
@@ -1139,7 +5296,7 @@ bool MicroWSOpening(uint32_t i)
 
 bool MicroWSOpen(uint32_t i)
 {
-	MicroWSConnection& C	  = S.Connections[i];
+	MicroWSConnection& C	  = MicroWSGetConnection(i);
 	uint32_t		   Open	  = C.Open;
 	uint32_t		   Closed = C.Closed;
 	return int32_t(Open - Closed) > 0;
@@ -1163,81 +5320,384 @@ void MicroWSSetNonBlocking(MWSSocket Socket, int NonBlocking)
 #endif
 }
 
+// Creates the listener of a shard. Shard 0 looks for a free port starting at the requested one, the others bind to the
+// port it found with SO_REUSEPORT, or share its listener where that isn't supported.
+static MWSSocket MicroWSListenSocket(bool ReusePort)
+{
+	MWSSocket Socket = socket(PF_INET, SOCK_STREAM, 6);
+	MWS_ASSERT(!MWS_INVALID_SOCKET(Socket));
+	MicroWSSetNonBlocking(Socket, 1);
+
+	int r  = 0;
+	int on = 1;
+#if defined(_WIN32)
+	r = setsockopt(Socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+#else
+	r = setsockopt(Socket, SOL_SOCKET, SO_REUSEADDR, (void*)&on, sizeof(on));
+#if defined(SO_REUSEPORT)
+	if(ReusePort)
+		r |= setsockopt(Socket, SOL_SOCKET, SO_REUSEPORT, (void*)&on, sizeof(on));
+#endif
+#endif
+	(void)r;
+	(void)ReusePort;
+	return Socket;
+}
+
+static void MicroWSCloseListenSocket(MWSSocket Socket)
+{
+#ifdef _WIN32
+	closesocket(Socket);
+#else
+	close(Socket);
+#endif
+}
+
+static bool MicroWSListen(MicroWSShard& H)
+{
+	H.OwnsListener = false;
+#if !defined(SO_REUSEPORT)
+	if(H.Index > 0)
+	{
+		H.ListenerSocket = S.Shards[0].ListenerSocket;
+		return true;
+	}
+#endif
+
+	struct sockaddr_in Addr;
+	Addr.sin_family		 = AF_INET;
+	Addr.sin_addr.s_addr = INADDR_ANY;
+	if(H.Index == 0)
+	{
+		// ports are probed without SO_REUSEPORT, so a port another process listens on with it is skipped instead of shared
+		H.ListenerSocket = MicroWSListenSocket(false);
+		int nStartPort	 = S.nWebServerPort;
+		for(int i = 0; i < 20; ++i)
+		{
+			Addr.sin_port = htons(nStartPort + i);
+			if(0 != bind(H.ListenerSocket, (sockaddr*)&Addr, sizeof(Addr)))
+				continue;
+#if defined(SO_REUSEPORT)
+			if(S.NumShards > 1)
+			{
+				// the other shards bind the chosen port too, so it's bound again by a socket that allows that
+				MicroWSCloseListenSocket(H.ListenerSocket);
+				H.ListenerSocket = MicroWSListenSocket(true);
+				if(0 != bind(H.ListenerSocket, (sockaddr*)&Addr, sizeof(Addr)))
+				{
+					MicroWSCloseListenSocket(H.ListenerSocket);
+					H.ListenerSocket = MicroWSListenSocket(false);
+					continue; // taken in between
+				}
+			}
+#endif
+			S.nWebServerPort = (uint32_t)(nStartPort + i);
+			break;
+		}
+	}
+	else
+	{
+		H.ListenerSocket = MicroWSListenSocket(true);
+		Addr.sin_port	 = htons(S.nWebServerPort);
+		if(0 != bind(H.ListenerSocket, (sockaddr*)&Addr, sizeof(Addr)))
+		{
+			mws_log(MICROWS_INVALID_CONNECTION, "shard %d can't bind port %d, sharing the listener of shard 0\n", H.Index, S.nWebServerPort);
+			MicroWSCloseListenSocket(H.ListenerSocket);
+			H.ListenerSocket = S.Shards[0].ListenerSocket;
+			return true;
+		}
+	}
+	listen(H.ListenerSocket, (int)MicroWSMin(S.ShardMaxConnections, (uint32_t)SOMAXCONN));
+	H.OwnsListener = true;
+	return true;
+}
+
+#if defined(__linux__)
+static bool MicroWSWaitAdd(int Fd)
+{
+	struct epoll_event Event;
+	Event.events   = EPOLLIN;
+	Event.data.u32 = 0;
+	return 0 == epoll_ctl(S.WaitFd, EPOLL_CTL_ADD, Fd, &Event);
+}
+#endif
+
+// Sets up the fds of MicroWSWait. Without io threads the portable backend has no fd for its sockets, so there is nothing
+// to wait on
+static void MicroWSWaitStart()
+{
+#if defined(__linux__)
+	for(uint32_t h = 0; h < S.NumShards; ++h)
+	{
+		if(!S.Threaded && S.Shards[h].Backend == MICROWS_BACKEND_POLL)
+			return;
+	}
+	S.AppWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	S.WaitFd	= epoll_create1(EPOLL_CLOEXEC);
+	bool Ok		= S.AppWakeFd >= 0 && S.WaitFd >= 0 && MicroWSWaitAdd(S.AppWakeFd);
+	for(uint32_t h = 0; h < S.NumShards && Ok && !S.Threaded; ++h)
+	{
+		MicroWSShard& H = S.Shards[h];
+#if MICROWS_EPOLL
+		if(H.Backend == MICROWS_BACKEND_EPOLL)
+			Ok = MicroWSWaitAdd(H.EpollFd);
+#endif
+#if MICROWS_IO_URING
+		if(H.Backend == MICROWS_BACKEND_IO_URING)
+			Ok = MicroWSWaitAdd(H.Uring.Fd);
+#endif
+	}
+	if(!Ok)
+	{
+		mws_log(MICROWS_INVALID_CONNECTION, "wait fd setup failed: %d:%s\n", errno, strerror(errno));
+		if(S.WaitFd >= 0)
+			close(S.WaitFd);
+		if(S.AppWakeFd >= 0)
+			close(S.AppWakeFd);
+		S.WaitFd	= -1;
+		S.AppWakeFd = -1;
+	}
+#endif
+}
+
 bool MicroWSWebServerStart()
 {
 	S.nWebServerDataSent = 0;
-	S.LastConnection	 = 0;
 	S.RejectCount		 = 0;
 
-	for(MicroWSConnection& C : S.Connections)
+	uint32_t ShardMaxConnections = (S.RequestedMaxConnections + S.RequestedShards - 1) / S.RequestedShards;
+	if(S.NumShards != S.RequestedShards || S.ShardMaxConnections != ShardMaxConnections)
 	{
-		C.SendPut	  = 0;
-		C.SendGet	  = 0;
-		C.RecvPut	  = 0;
-		C.RecvGet	  = 0;
-		C.Opening	  = MICROWS_INVALID_CONNECTION;
-		C.Open		  = MICROWS_INVALID_CONNECTION;
-		C.Closed	  = MICROWS_INVALID_CONNECTION;
-		C.Socket	  = INVALID_SOCKET;
-		C.SendBlocked = 0;
+		for(uint32_t h = 0; h < S.NumShards; ++h)
+		{
+			MicroWSShard& H = S.Shards[h];
+			for(uint32_t i = 0; i < H.NumSlots; ++i)
+			{
+				MicroWSConnection& C = MicroWSGetConnection(H.Base + i);
+				if(C.SendBuffer)
+					MicroWSRingUnmap(C.SendBuffer, C.SendSize.load(std::memory_order_relaxed));
+				if(C.RecvBuffer)
+					MicroWSRingUnmap(C.RecvBuffer, C.RecvSize);
+			}
+			MicroWSRingPoolTrim(H, 0);
+			free(H.RingPool);
+		}
+		for(uint32_t i = 0; i < S.MaxConnections; i += MICROWS_SLAB_SIZE)
+			delete[] S.Slabs[i >> MICROWS_SLAB_SHIFT];
+		for(uint32_t h = 0; h < S.NumShards; ++h)
+		{
+			MicroWSShard& H = S.Shards[h];
+			free(H.FreeList);
+			free(H.LiveList);
+			free(H.ReadyList);
+			free(H.DrainList);
+			free(H.Events.Items);
+			free(H.Commands.Items);
+			free(H.Received.Items);
+		}
+		delete[] S.Shards;
+		free(S.Slabs);
+		free(S.AppList);
+		free(S.LatestList);
+		free(S.ViewList);
+		free(S.TopicSlots);
+		free(S.BatchList);
+		S.NumShards			  = S.RequestedShards;
+		S.ShardMaxConnections = ShardMaxConnections;
+		S.ShardSlots		  = (ShardMaxConnections + MICROWS_SLAB_SIZE - 1) & ~(MICROWS_SLAB_SIZE - 1);
+		S.MaxConnections	  = S.NumShards * S.ShardSlots;
+		S.Shards			  = new MicroWSShard[S.NumShards];
+		S.Slabs				  = (MicroWSConnection**)calloc(S.MaxConnections / MICROWS_SLAB_SIZE, sizeof(MicroWSConnection*));
+		S.AppList			  = (uint32_t*)malloc(S.NumShards * ShardMaxConnections * sizeof(uint32_t));
+		S.LatestList		  = (uint32_t*)malloc(S.NumShards * ShardMaxConnections * sizeof(uint32_t));
+		S.ViewList			  = (uint32_t*)malloc(S.NumShards * ShardMaxConnections * sizeof(uint32_t));
+		S.TopicSlots		  = (uint32_t*)malloc(S.NumShards * ShardMaxConnections * sizeof(uint32_t));
+		S.BatchList			  = (uint32_t*)malloc(S.MaxConnections * sizeof(uint32_t));
+		if(!S.Slabs || !S.AppList || !S.LatestList || !S.ViewList || !S.TopicSlots || !S.BatchList)
+			return false;
+		for(uint32_t h = 0; h < S.NumShards; ++h)
+		{
+			MicroWSShard& H = S.Shards[h];
+			H.Index			= h;
+			H.Base			= h * S.ShardSlots;
+			H.FreeList		= (uint32_t*)malloc(ShardMaxConnections * sizeof(uint32_t));
+			H.LiveList		= (uint32_t*)malloc(ShardMaxConnections * sizeof(uint32_t));
+			H.ReadyList		= (uint32_t*)malloc(ShardMaxConnections * sizeof(uint32_t));
+			H.DrainList		= (uint32_t*)malloc(ShardMaxConnections * sizeof(uint32_t));
+			if(!H.FreeList || !H.LiveList || !H.ReadyList || !H.DrainList)
+				return false;
+			if(!MicroWSQueueInit(H.Events, 2 * ShardMaxConnections) || !MicroWSQueueInit(H.Commands, 2 * ShardMaxConnections) || !MicroWSQueueInit(H.Received, ShardMaxConnections))
+				return false;
+		}
 	}
-	MicroWSConnection& C = S.Connections[0];
-	if(!C.SendBuffer)
+	S.NumApp	= 0;
+	S.NumLatest = 0;
+	S.NumView	= 0;
+	S.NumBatch	= 0;
+	S.BatchDepth = 0;
+	for(uint32_t t = 0; t < S.NumTopics; ++t)
+		free(S.Topics[t].Subscribers);
+	S.NumTopics = 0;
+	S.IoStop.store(0, std::memory_order_relaxed);
+	for(uint32_t h = 0; h < S.NumShards; ++h)
 	{
-		C.SendBuffer = (uint8_t*)MicroWSAllocRing();
-		if(!C.SendBuffer)
+		MicroWSShard& H = S.Shards[h];
+		H.NumReady		= 0;
+		H.NumFree		= 0;
+		H.NumLive		= 0;
+		H.NumOpen		= 0;
+		H.Cpu			= S.ShardCpus[h];
+		H.Now			= MicroWSNow();
+		H.WheelTime		= H.Now;
+		H.WheelPos		= 0;
+		H.NumTimers		= 0;
+		for(uint32_t t = 0; t < MICROWS_TIMER_SLOTS; ++t)
+			H.Wheel[t] = MICROWS_INVALID_CONNECTION;
+		MicroWSQueueReset(H.Events);
+		MicroWSQueueReset(H.Commands);
+		MicroWSQueueReset(H.Received);
+		H.IoSleeping.store(0, std::memory_order_relaxed);
+		uint32_t PoolCapacity = 2 * MicroWSMax((S.RingPoolMax + S.NumShards - 1) / S.NumShards, 1u);
+		if(H.PoolCapacity != PoolCapacity)
+		{
+			MicroWSRingPoolTrim(H, PoolCapacity);
+			MicroWSPooledRing* Pool = (MicroWSPooledRing*)realloc(H.RingPool, PoolCapacity * sizeof(MicroWSPooledRing));
+			if(!Pool)
+				return false;
+			H.RingPool	   = Pool;
+			H.PoolCapacity = PoolCapacity;
+		}
+		H.PoolTrim.store(MICROWS_POOL_KEEP_ALL, std::memory_order_relaxed);
+		for(uint32_t i = H.NumSlots; i > 0; --i)
+		{
+			MicroWSConnection& C = MicroWSGetConnection(H.Base + i - 1);
+			C.InReadyList		 = 0;
+			C.RecvPut			 = 0;
+			C.RecvGet			 = 0;
+			C.Opening			 = MICROWS_INVALID_CONNECTION;
+			C.Open				 = MICROWS_INVALID_CONNECTION;
+			C.Closed			 = MICROWS_INVALID_CONNECTION;
+			C.Socket			 = INVALID_SOCKET;
+			C.SendBlocked		 = 0;
+			C.FreePending		 = 0;
+			C.AppId				 = MICROWS_INVALID_CONNECTION;
+			C.Users				 = 0;
+			C.AppReady			 = 0;
+			C.RecvBlocked		 = 0;
+			C.RecvNotify		 = 0;
+			C.LatestQueued		 = 0;
+			C.InBatch			 = 0;
+			MicroWSSharedReset(H.Base + i - 1);
+			MicroWSSendReset(H.Base + i - 1);
+			C.UringRecv			 = 0;
+			C.UringSend			 = 0;
+			C.UringRegistered	 = 0; // the io_uring is gone
+			C.TimerSlot			 = MICROWS_TIMER_NONE;
+			MicroWSRingPut(H, C.SendBuffer, C.SendSize.load(std::memory_order_relaxed));
+			MicroWSRingPut(H, C.RecvBuffer, C.RecvSize);
+			C.SendBuffer			= nullptr;
+			C.RecvBuffer			= nullptr;
+			H.FreeList[H.NumFree++] = H.Base + i - 1;
+		}
+		if(!H.NumSlots && !MicroWSAllocSlab(H))
+			return false;
+		if(!MicroWSRingPoolFill(H, MicroWSMax((S.RingPoolSize + S.NumShards - 1) / S.NumShards, 1u)))
 			return false; // failed to allocate ring.
 	}
 
 #ifdef _WIN32
 	WSADATA wsa;
 	if(WSAStartup(MAKEWORD(2, 2), &wsa))
-	{
-		S.ListenerSocket = (MWSSocket)-1;
 		return false;
-	}
 #endif
 
-	S.ListenerSocket = socket(PF_INET, SOCK_STREAM, 6);
-	MWS_ASSERT(!MWS_INVALID_SOCKET(S.ListenerSocket));
-	MicroWSSetNonBlocking(S.ListenerSocket, 1);
-
+	for(uint32_t h = 0; h < S.NumShards; ++h)
 	{
-		int r  = 0;
-		int on = 1;
-#if defined(_WIN32)
-		r = setsockopt(S.ListenerSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
-#else
-		r = setsockopt(S.ListenerSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&on, sizeof(on));
+		MicroWSShard& H = S.Shards[h];
+		MicroWSListen(H);
+#if defined(__linux__)
+		if(S.Threaded)
+		{
+			H.WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if(H.WakeFd < 0)
+				mws_error(MICROWS_INVALID_CONNECTION, "eventfd failed: %d:%s\n", errno, strerror(errno));
+		}
 #endif
-		(void)r;
-	}
-
-	int nStartPort = S.nWebServerPort;
 
-	struct sockaddr_in Addr;
-	Addr.sin_family		 = AF_INET;
-	Addr.sin_addr.s_addr = INADDR_ANY;
-	for(int i = 0; i < 20; ++i)
+		H.Backend		= MICROWS_BACKEND_POLL;
+		H.ListenerReady = true;
+#if MICROWS_IO_URING
+		if(S.RequestedBackend == MICROWS_BACKEND_IO_URING && MicroWSUringStart(H))
+			H.Backend = MICROWS_BACKEND_IO_URING;
+#endif
+#if MICROWS_EPOLL
+		if(H.Backend == MICROWS_BACKEND_POLL && S.RequestedBackend != MICROWS_BACKEND_POLL && MicroWSEpollStart(H))
+			H.Backend = MICROWS_BACKEND_EPOLL;
+#endif
+		if(S.RequestedBackend != MICROWS_BACKEND_DEFAULT && S.RequestedBackend != H.Backend)
+		{
+			mws_log(MICROWS_INVALID_CONNECTION, "requested backend %d unavailable, using %d\n", S.RequestedBackend, H.Backend);
+		}
+	}
+	MicroWSWaitStart();
+	if(S.Threaded)
 	{
-		Addr.sin_port = htons(nStartPort + i);
-		if(0 == bind(S.ListenerSocket, (sockaddr*)&Addr, sizeof(Addr)))
+		for(uint32_t h = 0; h < S.NumShards; ++h)
 		{
-			S.nWebServerPort = (uint32_t)(nStartPort + i);
-			break;
+			MicroWShreadStart(&S.Shards[h].IoThread, MicroWSIoThread, &S.Shards[h]);
+			S.Shards[h].IoRunning = true;
 		}
 	}
-	listen(S.ListenerSocket, MICROWS_MAX_CONNECTIONS);
 	return true;
 }
 
 void MicroWSWebServerStop()
 {
+	// also runs at exit after MicroWSShutdown, so everything here has to be safe to do twice
+	S.IoStop.store(1, std::memory_order_seq_cst);
+	for(uint32_t h = 0; h < S.NumShards; ++h)
+		MicroWSWakeIo(S.Shards[h]);
+	for(uint32_t h = 0; h < S.NumShards; ++h)
+	{
+		if(S.Shards[h].IoRunning)
+			MicroWSThreadJoin(&S.Shards[h].IoThread);
+		S.Shards[h].IoRunning = false;
+	}
+	for(uint32_t h = 0; h < S.NumShards; ++h)
+	{
+		MicroWSShard& H = S.Shards[h];
+#if MICROWS_EPOLL
+		MicroWSEpollStop(H);
+#endif
+#if MICROWS_IO_URING
+		MicroWSUringStop(H);
+#endif
+#if defined(__linux__)
+		if(H.WakeFd >= 0)
+			close(H.WakeFd);
+		H.WakeFd = -1;
+#endif
+		if(H.OwnsListener)
+		{
 #ifdef _WIN32
-	closesocket(S.ListenerSocket);
-	WSACleanup();
+			closesocket(H.ListenerSocket);
 #else
-	close(S.ListenerSocket);
+			close(H.ListenerSocket);
+#endif
+		}
+		H.OwnsListener = false;
+	}
+#if defined(__linux__)
+	if(S.WaitFd >= 0)
+		close(S.WaitFd);
+	if(S.AppWakeFd >= 0)
+		close(S.AppWakeFd);
+	S.WaitFd	= -1;
+	S.AppWakeFd = -1;
+	S.AppArmed.store(0, std::memory_order_relaxed);
+#endif
+#ifdef _WIN32
+	WSACleanup();
 #endif
 }
 
@@ -1517,10 +5977,10 @@ void mws_log_impl(int error, uint32_t ConnectionId, const char* fmt, ...)
 		char				Buffer[BUF_SIZE];
 		uint32_t			Index  = -1;
 		MWSSocket			Socket = INVALID_SOCKET;
-		if(ConnectionId < MICROWS_ALL_CONNECTIONS)
+		if(MicroWSConnectionIndex(ConnectionId) != MICROWS_INVALID_CONNECTION)
 		{
-			Index  = ConnectionId % MICROWS_MAX_CONNECTIONS;
-			Socket = S.Connections[Index].Socket;
+			Index  = MicroWSConnectionIndex(ConnectionId);
+			Socket = MicroWSGetConnection(Index).Socket;
 		}
 
 		int		l = stbsp_snprintf(Buffer, sizeof(Buffer) - 1, "MicroWS:%5x(%02x)[Sock:%d] ", ConnectionId, Index, Socket);
@@ -8,33 +8,261 @@
 #define MICROWS_INVALID_CONNECTION ((uint32_t)0xffffffff)
 #define MICROWS_ANY_CONNECTION ((uint32_t)0xfffffffe)
 #define MICROWS_ALL_CONNECTIONS ((uint32_t)0xfffffffd)
+#define MICROWS_INVALID_TOPIC ((uint32_t)0xffffffff)
 
 #ifndef MICROWS_BUFFER_SPACE
-#define MICROWS_BUFFER_SPACE (64llu << 10llu) // must be a multiple of the page size, so we can map it twice for use as a ring buffer/
+#define MICROWS_BUFFER_SPACE (64llu << 10llu) // default size of both rings of a connection. Must be a multiple of the page size, so we can map it twice for use as a ring buffer/
 #endif
 
 #ifndef MICROWS_MESSAGE_MAX_SIZE
-#define MICROWS_MESSAGE_MAX_SIZE (8llu << 10llu)
+#define MICROWS_MESSAGE_MAX_SIZE (1llu << 20llu) // bigger messages go to the stream callback, or close the connection without one
 #endif // MICROWS_MESSAGE_MAX_SIZE
 
+#ifndef MICROWS_HANDSHAKE_MAX_SIZE
+#define MICROWS_HANDSHAKE_MAX_SIZE (8llu << 10llu) // connections that send a longer http request are closed
+#endif
+
+#ifndef MICROWS_SHARED_FRAMES
+#define MICROWS_SHARED_FRAMES 16 // broadcast frames a connection can reference before broadcasts to it are copied into its ring
+#endif
+
+#ifndef MICROWS_SHARED_FRAME_MIN_SIZE
+#define MICROWS_SHARED_FRAME_MIN_SIZE 128 // smaller broadcasts are cheaper to copy into each ring
+#endif
+
+#ifndef MICROWS_SEND_RESERVATIONS
+#define MICROWS_SEND_RESERVATIONS 32 // sends a connection can have reserved but not yet committed, across all threads. Power of two
+#endif
+
+#ifndef MICROWS_MAX_TOPICS
+#define MICROWS_MAX_TOPICS 64 // see MicroWSTopic
+#endif
+
+#ifndef MICROWS_TOPIC_NAME_MAX
+#define MICROWS_TOPIC_NAME_MAX 64 // longest topic name, terminator included
+#endif
+
 #ifndef MICROWS_MAX_CONNECTIONS
-#define MICROWS_MAX_CONNECTIONS (16)
+#define MICROWS_MAX_CONNECTIONS (16) // default for MicroWSInitParams::MaxConnections
 #endif // MICROWS_MESSAGE_MAX_SIZE
 
+#ifndef MICROWS_STATE_PAGE_SIZE
+#define MICROWS_STATE_PAGE_SIZE MICROWS_MAX_CONNECTIONS // connections returned per MicroWSGetState call
+#endif
+
+#ifndef MICROWS_MAX_SHARDS
+#define MICROWS_MAX_SHARDS 64
+#endif
+
 #ifndef MAX_CONNECTIONS_PER_UPDATE
 #define MAX_CONNECTIONS_PER_UPDATE 2
 #endif // MAX_CONNECTIONS_PER_UPDATE
 
+enum MicroWSBackend
+{
+	MICROWS_BACKEND_DEFAULT,  // best available, falls back to the next one if unavailable: io_uring is opt-in, then epoll, then portable
+	MICROWS_BACKEND_POLL,	  // portable, calls recv/send on every slot every update
+	MICROWS_BACKEND_EPOLL,	  // linux, only touches sockets epoll reported ready
+	MICROWS_BACKEND_IO_URING, // linux, keeps recv/send in flight on an io_uring. Update only reaps completions
+};
+
+// Gets a message bigger than MICROWS_MESSAGE_MAX_SIZE in pieces as it arrives, instead of it being buffered. Offset is
+// where Data goes in the message, Last is set on the final piece. Called from MicroWSGetMessage and MicroWSPeekMessage
+// when they read the connection, or from MicroWSUpdate with OnMessage.
+typedef void (*MicroWSStreamCallback)(uint32_t Connection, const uint8_t* Data, uint32_t Size, uint64_t Offset, bool Last, void* User);
+
+// Fills Data with Size bytes of a streamed send, from Offset in the message. See MicroWSSendStream.
+typedef void (*MicroWSSendStreamCallback)(uint32_t Connection, uint8_t* Data, uint32_t Size, uint64_t Offset, void* User);
+
+// Callback dispatch, see MicroWSInitParams::OnMessage. Data is where the message sits in the receive ring, or its
+// reassembly buffer, and is only valid during the call.
+typedef void (*MicroWSOpenCallback)(uint32_t Connection, void* User);
+typedef void (*MicroWSMessageCallback)(uint32_t Connection, const uint8_t* Data, uint32_t Size, bool Binary, void* User);
+typedef void (*MicroWSCloseCallback)(uint32_t Connection, void* User);
+
+struct MicroWSInitParams
+{
+	uint16_t	   ListenPort	  = 1999;
+	MicroWSBackend Backend		  = MICROWS_BACKEND_DEFAULT;
+	uint32_t	   MaxConnections = MICROWS_MAX_CONNECTIONS; // slots are allocated in slabs as needed, up to this
+	bool		   Threaded		  = false; // sockets are serviced by an io thread. The api must still be called from a single thread, except the MT sends
+	uint32_t	   NumShards	  = 1;		 // io shards, each with its own listener, share of MaxConnections and io thread when Threaded
+	const int*	   ShardCpus	  = nullptr; // optional, NumShards cpus to pin the io threads to. -1 leaves a shard unpinned
+	MicroWSStreamCallback StreamCallback = nullptr; // optional, see MicroWSStreamCallback
+	void*				  StreamUser	 = nullptr;
+	// Called from MicroWSUpdate as connections open, get messages and close. With OnMessage set, MicroWSUpdate hands every
+	// complete message to it and consumes it, visiting only connections that received something, instead of the app
+	// polling every connection with MicroWSGetMessage. OnClose is called while the id still names the connection.
+	MicroWSOpenCallback	   OnOpen		= nullptr;
+	MicroWSMessageCallback OnMessage	= nullptr;
+	MicroWSCloseCallback   OnClose		= nullptr;
+	void*				   CallbackUser = nullptr;
+	// Receive scheduling, so a busy connection can't hold up the others. Connections take turns: MicroWSGetMessage and
+	// MicroWSPeekMessage with MICROWS_ANY_CONNECTION start after the connection the app last got a message from, and
+	// MicroWSGetMessages and the OnMessage dispatch give each connection at most RecvBudgetMessages messages and
+	// RecvBudgetBytes of payload per turn, the bytes in deficit round robin so a bigger message waits for a turn or two
+	// instead of being stuck. Each io pass reads at most RecvBudgetBytes from a connection before going on to the next.
+	// MicroWSUpdate stops dispatching once it has taken UpdateBudgetUs and carries on in the next one. 0 is no limit.
+	uint32_t RecvBudgetBytes	= 0;
+	uint32_t RecvBudgetMessages = 0;
+	uint32_t UpdateBudgetUs		= 0;
+	// Keepalive. Connections that have sent nothing for PingIntervalMs are pinged, and connections that have sent nothing
+	// for IdleTimeoutMs are closed, handshakes included. Live clients answer pings, so keep the timeout above the
+	// interval. 0 turns either off. Pings are answered by the app thread as it reads messages.
+	uint32_t PingIntervalMs = 0;
+	uint32_t IdleTimeoutMs	= 0;
+	// Text messages "subscribe:<topic>" and "unsubscribe:<topic>" from clients are handled by the library instead of
+	// returned to the app. Only topics created with MicroWSTopic can be joined.
+	bool ClientTopics = false;
+	// Send coalescing. In threaded mode what the app thread sends to a connection is held until the connection has
+	// CoalesceBytes unsent, or the first held message is CoalesceUs old, so small messages go out together instead of a
+	// send each. The age is checked as the app sends and calls MicroWSUpdate. 0 CoalesceUs turns it off, 0 CoalesceBytes
+	// holds up to half the send ring. Without an io thread everything sent between two MicroWSUpdate calls already goes
+	// out in one send per connection. The portable backend sends what's queued on every pass, so it holds nothing.
+	uint32_t CoalesceUs	   = 0;
+	uint32_t CoalesceBytes = 0;
+	bool	 NoDelay	   = false; // TCP_NODELAY: sends go out when they are made, instead of after the acks of earlier ones
+	// Ring sizes, rounded up to whole pages. 0 is MICROWS_BUFFER_SPACE. The send ring of a connection whose sends fail
+	// because it's full doubles, up to SendRingMaxSize, and halves back towards SendRingSize once no send has failed for
+	// SendRingShrinkMs. The send that failed isn't retried, the ring is only bigger for the next one. 0 SendRingMaxSize
+	// keeps it fixed, 0 SendRingShrinkMs never shrinks it. See also MicroWSSetRingSize.
+	uint32_t SendRingSize	  = 0;
+	uint32_t SendRingMaxSize  = 0;
+	uint32_t SendRingShrinkMs = 10000;
+	uint32_t RecvRingSize	  = 0; // messages that don't fit are reassembled in a buffer of their own
+	// Rings of closed connections are kept for new ones, up to RingPoolMax connections' worth, so accepting doesn't wait
+	// on mapping them and faulting them in. RingPoolSize connections' worth, at least one per shard, are mapped by
+	// MicroWSInit. Rings resized away from the sizes above aren't kept. See also MicroWSTrimRingPool.
+	uint32_t RingPoolSize = 0;
+	uint32_t RingPoolMax  = 16;
+	// permessage-deflate, for clients that offer it. Needs MICROWS_DEFLATE
+	bool	 Deflate				 = false;
+	uint8_t	 DeflateWindowBits		 = 15;	 // 9-15, window of what we compress. Smaller uses less memory per connection
+	uint8_t	 DeflateClientWindowBits = 15;	 // 8-15, asked of clients that let us pick the window they compress with
+	bool	 DeflateContextTakeover	 = true; // false compresses every message on its own, trading ratio for memory
+	int		 DeflateLevel			 = 6;	 // default for MicroWSSetCompression
+	uint32_t DeflateMinSize			 = 256;
+};
+
+// A message reserved with MicroWSBeginMessageMT, owned by the calling thread until it's committed
+struct MicroWSReservation
+{
+	uint32_t Connection = MICROWS_INVALID_CONNECTION;
+	uint32_t Index;
+	uint32_t Pos;	 // ring position of the frame
+	uint32_t Ticket; // order of the reservation on the connection
+	uint32_t Bytes;	 // reserved ring bytes
+	uint32_t Header; // header bytes left in front of the payload
+	uint32_t MaxSize;
+};
+
+// Memory of the rings of every connection plus the pool, each counted once though it's mapped twice
+struct MicroWSRingStats
+{
+	uint64_t Bytes;
+	uint32_t Rings;
+	uint64_t PooledBytes; // of which kept in the pool
+	uint32_t PooledRings;
+};
+
+// A message returned by MicroWSGetMessages
+struct MicroWSMessageView
+{
+	uint32_t	   Connection;
+	const uint8_t* Data;
+	uint32_t	   Size;
+	bool		   Binary;
+};
+
+// One page of open connections. When there are more than MICROWS_STATE_PAGE_SIZE, call MicroWSGetState again with
+// NextPage until it returns 0.
 struct MicroWSConnectionState
 {
-	uint32_t NumConnections;
+	uint32_t NumConnections; // in this page
+	uint32_t TotalConnections;
+	uint32_t NextPage;
 	uint32_t ConnectionVersion;
-	uint32_t Connections[MICROWS_MAX_CONNECTIONS];
-	uint32_t Data[MICROWS_MAX_CONNECTIONS];
+	uint32_t Connections[MICROWS_STATE_PAGE_SIZE];
+	uint32_t Data[MICROWS_STATE_PAGE_SIZE];
 };
-bool	 MicroWSInit(uint16_t ListenPort);
+bool		   MicroWSInit(uint16_t ListenPort);
+bool		   MicroWSInit(const MicroWSInitParams& Params);
+MicroWSBackend MicroWSGetBackend();
 void	 MicroWSUpdate(uint32_t* ConnectionsVersion = nullptr, uint32_t* MessageData = nullptr);
-void	 MicroWSGetState(MicroWSConnectionState& State);
-uint32_t MicroWSGetMessage(uint32_t Connection, uint8_t* OutBuffer, uint32_t BufferSize, uint32_t* ConnectionOut = nullptr);
+// Blocks until there is work for MicroWSUpdate or TimeoutUs has passed. The wait is cut short for MicroWSSendLatest
+// retries and held sends coming due, and without io threads for the next timer or ping. Without io threads it first
+// sends what the app queued since MicroWSUpdate. The portable backend without io threads has nothing to block on and
+// sleeps for at most a millisecond (MICROWS_THREAD_POLL_MS).
+void	 MicroWSWait(uint32_t TimeoutUs);
+// File descriptor that is readable while MicroWSUpdate has work, for adding to the app's own poll or epoll loop. -1 when
+// there is none: not on linux, or the portable backend without io threads. Without io threads sends only go out in
+// MicroWSUpdate and MicroWSWait, and timers and pings need a MicroWSUpdate every 100 ms (MICROWS_TIMER_TICK_MS).
+int		 MicroWSGetWaitFd();
+void	 MicroWSGetState(MicroWSConnectionState& State, uint32_t FirstConnection = 0);
+// BinaryOut, when set, tells binary messages from text ones
+uint32_t MicroWSGetMessage(uint32_t Connection, uint8_t* OutBuffer, uint32_t BufferSize, uint32_t* ConnectionOut = nullptr, bool* BinaryOut = nullptr);
+// Zero copy receive: returns the next message of Connection (or of any connection) where it sits in the receive ring,
+// or nullptr. It stays valid and is returned again until MicroWSConsumeMessage is called with the connection it came from.
+// Fragmented messages and messages bigger than the ring are reassembled in a per connection buffer and returned from there.
+const uint8_t* MicroWSPeekMessage(uint32_t Connection, uint32_t* Size, uint32_t* ConnectionOut = nullptr, bool* BinaryOut = nullptr);
+void		   MicroWSConsumeMessage(uint32_t Connection);
+// Batch receive: fills Views with up to MaxViews messages, every complete one each connection has within its receive
+// budget, read like MicroWSPeekMessage. They stay valid until MicroWSConsumeMessages consumes all of them at once, which
+// the next MicroWSGetMessages or MicroWSUpdate also does. Returns the number of views.
+uint32_t MicroWSGetMessages(MicroWSMessageView* Views, uint32_t MaxViews);
+void	 MicroWSConsumeMessages();
 bool	 MicroWSSendMessage(uint32_t Connection, const void* Data, uint32_t Size);
+// Same as MicroWSSendMessage, as a binary frame instead of a text one
+bool	 MicroWSSendBinary(uint32_t Connection, const void* Data, uint32_t Size);
+// Conflated send, for state where only the newest value matters. Messages are tagged with a Key. When the send ring of a
+// connection is too full, instead of being dropped the message is held, replacing whatever is still held for the same
+// key, and sent by MicroWSUpdate once there is room. Slow connections get the latest value of each key rather than a
+// backlog of stale ones. Returns false only if the message can't be sent or held. Meant for a handful of keys.
+bool	 MicroWSSendLatest(uint32_t Connection, uint32_t Key, const void* Data, uint32_t Size, bool Binary = false);
+// Explicit batch: in threaded mode what the app thread sends between MicroWSBeginBatch and MicroWSEndBatch is held and
+// handed to the io side at the end, as with coalescing. Batches nest. The MT sends are never held.
+void MicroWSBeginBatch();
+void MicroWSEndBatch();
+// Topics. MicroWSTopic finds or creates a named topic and returns its id, or MICROWS_INVALID_TOPIC when the name is too
+// long or MICROWS_MAX_TOPICS exist. Call it after MicroWSInit, the ids are valid until the next one. Connections are unsubscribed when they
+// close. MicroWSPublish frames a message once and queues it only on the subscribers of the topic, like a broadcast.
+uint32_t MicroWSTopic(const char* Name);
+bool	 MicroWSSubscribe(uint32_t Connection, uint32_t Topic);
+void	 MicroWSUnsubscribe(uint32_t Connection, uint32_t Topic);
+bool	 MicroWSPublish(uint32_t Topic, const void* Data, uint32_t Size, bool Binary = false);
+// Zero copy send: reserves MaxSize bytes in the send ring of Connection and returns where to write the payload, or
+// nullptr if there isn't room. MicroWSCommitMessage sends the first Size bytes, as a text frame unless Binary is set.
+// One message can be reserved at a time.
+// MICROWS_ALL_CONNECTIONS reserves a shared frame instead, which is queued on every connection on commit.
+void* MicroWSBeginMessage(uint32_t Connection, uint32_t MaxSize);
+bool  MicroWSCommitMessage(uint32_t Size, bool Binary = false);
+// Thread safe send: unlike the rest of the api these can be called from any thread, concurrently with each other and
+// with the thread calling MicroWSUpdate, for a single connection id the app has seen open. Each call reserves its bytes
+// in the send ring with an atomic and commits them when written, so producers never wait for each other. Messages from
+// one thread go out in the order they were reserved. Nothing reserved after an uncommitted message goes out before it,
+// so write it and commit promptly.
+bool  MicroWSSendMessageMT(uint32_t Connection, const void* Data, uint32_t Size, bool Binary = false);
+void* MicroWSBeginMessageMT(MicroWSReservation& Reservation, uint32_t Connection, uint32_t MaxSize);
+bool  MicroWSCommitMessageMT(MicroWSReservation& Reservation, uint32_t Size, bool Binary = false);
+// Streamed send, for messages bigger than the send ring: Size bytes go out as fragments, each written into the ring as
+// it drains. They are read from Data, which has to stay valid until MicroWSSendStreamDone returns true, or filled by
+// Callback when it's set. Callback is called from the io side: MicroWSUpdate, or the io thread in threaded mode.
+// One stream per connection at a time. Until it's done other messages to the connection fail as if the ring was full,
+// only control frames go out between its fragments.
+bool MicroWSSendStream(uint32_t Connection, const void* Data, uint64_t Size, MicroWSSendStreamCallback Callback = nullptr, void* User = nullptr);
+bool MicroWSSendStreamDone(uint32_t Connection);
+// Sets the send ring of Connection to Size bytes, rounded up to whole pages, as soon as what's queued fits. It's the
+// size the ring shrinks back to from then on. Messages bigger than the ring fail, or go out with MicroWSSendStream.
+void MicroWSSetRingSize(uint32_t Connection, uint32_t Size);
+// Unmaps pooled rings until no more than Keep connections' worth are left, for when memory is short. Done by the next
+// pass of the io side. MicroWSGetRingStats can be called from any thread.
+void MicroWSTrimRingPool(uint32_t Keep = 0);
+void MicroWSGetRingStats(MicroWSRingStats& Stats);
+// Compression of what is sent to a connection that negotiated permessage-deflate: messages of at least MinSize bytes
+// are compressed with zlib Level 1-9, 0 sends everything uncompressed. Applies to MicroWSSendMessage and broadcasts,
+// the zero copy, MT and streamed sends always go out uncompressed.
+void MicroWSSetCompression(uint32_t Connection, int Level, uint32_t MinSize);
+// Starts the close handshake: sends a close frame with Code and drops what the client sends until it answers with its
+// own, or MICROWS_CLOSE_TIMEOUT_MS passes. The connection closes as usual after that.
+void MicroWSDisconnect(uint32_t Connection, uint16_t Code = 1000);
 void	 MicroWSShutdown();
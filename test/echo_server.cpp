@@ -0,0 +1,165 @@
+// Echo server driven by test/echo_test.py: echo_server <port> <backend> [threaded], backend being a MicroWSBackend
+// Every message comes back prefixed with "echo:", in the opcode it came in with, except:
+//   "mt"    each producer thread sends MT_MESSAGES messages "mt:<thread>:<seq>:<padding>" to the sender with the MT sends
+//   "quit"  shuts down and exits
+// Every 10 updates "tick <n>" goes to all connections, and every 5 "topic:a:<n>" is published to topic a, which clients
+// join with "subscribe:a".
+
+#include "../microws.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define MT_THREADS 4
+#define MT_MESSAGES 500
+
+static std::atomic<uint32_t> MtConnection{MICROWS_INVALID_CONNECTION};
+static std::atomic<uint32_t> MtRequests{0};
+static std::atomic<bool>	 MtStop{false};
+
+static uint32_t MtPadding(uint32_t Thread, uint32_t Seq)
+{
+	return (Seq * 131 + Thread * 7) % 1500;
+}
+
+// Sends every message in order, alternating between MicroWSSendMessageMT and a reservation that is bigger than needed.
+// A full ring is retried, a connection that went away is given up on.
+static void MtProducer(uint32_t Thread)
+{
+	MicroWSReservation Reservation;
+	char			   Message[2048];
+	uint32_t		   Done = 0;
+	while(!MtStop.load(std::memory_order_relaxed))
+	{
+		if(MtRequests.load(std::memory_order_acquire) == Done)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		Done++;
+		uint32_t Connection = MtConnection.load(std::memory_order_relaxed);
+		auto	 Start		= std::chrono::steady_clock::now();
+		for(uint32_t Seq = 0; Seq < MT_MESSAGES && !MtStop.load(std::memory_order_relaxed);)
+		{
+			int		 Size	 = snprintf(Message, 64, "mt:%u:%u:", Thread, Seq);
+			uint32_t Padding = MtPadding(Thread, Seq);
+			for(uint32_t i = 0; i < Padding; ++i)
+				Message[Size++] = 'a' + i % 26;
+			bool Sent;
+			if((Seq + Thread) & 1)
+			{
+				Sent = MicroWSSendMessageMT(Connection, Message, Size);
+			}
+			else
+			{
+				void* Data = MicroWSBeginMessageMT(Reservation, Connection, Size + (Seq % 5) * 60);
+				Sent	   = Data != nullptr;
+				if(Data)
+				{
+					memcpy(Data, Message, Size);
+					Sent = MicroWSCommitMessageMT(Reservation, Size);
+				}
+			}
+			if(Sent)
+			{
+				Seq++;
+				Start = std::chrono::steady_clock::now();
+			}
+			else if(std::chrono::steady_clock::now() - Start > std::chrono::seconds(10))
+			{
+				printf("mt %u: gave up at %u\n", Thread, Seq);
+				fflush(stdout);
+				break;
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+}
+
+static uint8_t Buffer[1 << 17];
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		printf("usage: echo_server <port> <backend> [threaded]\n");
+		return 1;
+	}
+	MicroWSInitParams Params;
+	Params.ListenPort	= (uint16_t)atoi(argv[1]);
+	Params.Backend		= (MicroWSBackend)atoi(argv[2]);
+	Params.Threaded		= argc > 3 && 0 == strcmp(argv[3], "threaded");
+	Params.ClientTopics = true;
+	Params.SendRingSize = 256 << 10; // room for the echo of a message with a 64 bit length
+	if(!MicroWSInit(Params))
+	{
+		printf("init failed\n");
+		return 1;
+	}
+	uint32_t TopicA = MicroWSTopic("a");
+	printf("backend %d%s\n", MicroWSGetBackend(), Params.Threaded ? " threaded" : "");
+	fflush(stdout);
+
+	std::thread Producers[MT_THREADS];
+	for(uint32_t t = 0; t < MT_THREADS; ++t)
+		Producers[t] = std::thread(MtProducer, t);
+
+	bool	 Quit = false;
+	uint32_t Tick = 0;
+	while(!Quit)
+	{
+		MicroWSUpdate();
+		uint32_t Size, From;
+		bool	 Binary;
+		while(!Quit && (Size = MicroWSGetMessage(MICROWS_ANY_CONNECTION, Buffer + 5, sizeof(Buffer) - 5, &From, &Binary)))
+		{
+			if(Size == 4 && 0 == memcmp(Buffer + 5, "quit", 4))
+			{
+				Quit = true;
+			}
+			else if(Size == 2 && 0 == memcmp(Buffer + 5, "mt", 2))
+			{
+				MtConnection.store(From, std::memory_order_relaxed);
+				MtRequests.fetch_add(1, std::memory_order_release);
+			}
+			else
+			{
+				memcpy(Buffer, "echo:", 5);
+				if(!(Binary ? MicroWSSendBinary : MicroWSSendMessage)(From, Buffer, Size + 5))
+				{
+					printf("echo of %u bytes refused\n", Size);
+					fflush(stdout);
+				}
+			}
+		}
+		if(Tick % 10 == 0)
+		{
+			char Message[64];
+			int	 Length = snprintf(Message, sizeof(Message), "tick %u", Tick);
+			MicroWSSendMessage(MICROWS_ALL_CONNECTIONS, Message, Length);
+		}
+		if(Tick % 5 == 0)
+		{
+			char Message[64];
+			int	 Length = snprintf(Message, sizeof(Message), "topic:a:%u", Tick);
+			MicroWSPublish(TopicA, Message, Length);
+		}
+		Tick++;
+		MicroWSWait(1000);
+	}
+
+	MtStop.store(true, std::memory_order_relaxed);
+	for(std::thread& Producer : Producers)
+		Producer.join();
+	MicroWSShutdown();
+	printf("done\n");
+	return 0;
+}
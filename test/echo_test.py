@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+# Scripted client for test/echo_server.cpp: echo_test.py <echo_server binary> <backend> [threaded]
+# Starts the server, checks echoes of text and binary messages, fragmented messages with a ping in between, broadcasts,
+# topics and the MT sends of its producer threads, reconnects, then asks it to quit. Exits non zero on any failure,
+# including the server's own exit status, so a ThreadSanitizer build fails the run when it reports something.
+import base64, os, random, socket, struct, subprocess, sys, time
+
+TIMEOUT = 20 # generous, sanitizer builds are slow
+MT_THREADS = 4
+MT_MESSAGES = 500
+
+class Client:
+    def __init__(self, port):
+        for attempt in range(100):
+            try:
+                self.sock = socket.create_connection(('127.0.0.1', port))
+                break
+            except ConnectionRefusedError:
+                if attempt == 99: raise
+                time.sleep(0.05)
+        key = base64.b64encode(os.urandom(16)).decode()
+        request = ('GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n'
+                   'Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n' % key)
+        self.sock.sendall(request.encode())
+        self.sock.settimeout(TIMEOUT)
+        self.buf = b''
+        while b'\r\n\r\n' not in self.buf:
+            data = self.sock.recv(4096)
+            assert data, 'closed during the handshake'
+            self.buf += data
+        end = self.buf.index(b'\r\n\r\n') + 4
+        assert self.buf.startswith(b'HTTP/1.1 101'), self.buf[:end]
+        self.buf = self.buf[end:]
+        self.last_tick = -1
+        self.topics = 0
+        self.pongs = 0
+
+    def send(self, payload, opcode=1, fin=True):
+        if isinstance(payload, str): payload = payload.encode()
+        mask = os.urandom(4)
+        header = bytes([(0x80 if fin else 0) | opcode])
+        n = len(payload)
+        if n < 126: header += bytes([0x80 | n])
+        elif n < 65536: header += bytes([0x80 | 126]) + struct.pack('>H', n)
+        else: header += bytes([0x80 | 127]) + struct.pack('>Q', n)
+        self.sock.sendall(header + mask + bytes(b ^ mask[i & 3] for i, b in enumerate(payload)))
+
+    def frame(self, timeout):
+        # (opcode, payload), or None once timeout has passed
+        deadline = time.time() + timeout
+        while True:
+            if len(self.buf) >= 2:
+                assert self.buf[0] & 0x80, 'the server fragmented a message'
+                n = self.buf[1] & 0x7f; offset = 2
+                if n == 126 and len(self.buf) >= 4: n = struct.unpack('>H', self.buf[2:4])[0]; offset = 4
+                elif n == 127 and len(self.buf) >= 10: n = struct.unpack('>Q', self.buf[2:10])[0]; offset = 10
+                if n < 126 or offset > 2:
+                    if len(self.buf) >= offset + n:
+                        op, payload = self.buf[0] & 0xf, self.buf[offset:offset + n]
+                        self.buf = self.buf[offset + n:]
+                        return op, payload
+            left = deadline - time.time()
+            if left <= 0: return None
+            self.sock.settimeout(left)
+            try:
+                data = self.sock.recv(65536)
+            except socket.timeout:
+                return None
+            assert data, 'connection closed'
+            self.buf += data
+
+    def next(self, timeout=TIMEOUT):
+        # next message that isn't a broadcast tick, a topic message or a pong. Ticks have to keep going up
+        deadline = time.time() + timeout
+        while True:
+            f = self.frame(deadline - time.time())
+            if f is None: return None
+            op, payload = f
+            if op == 0xa: self.pongs += 1; continue
+            if payload.startswith(b'tick '):
+                tick = int(payload[5:])
+                assert tick > self.last_tick, ('tick out of order', tick, self.last_tick)
+                self.last_tick = tick; continue
+            if payload.startswith(b'topic:a:'): self.topics += 1; continue
+            return f
+
+    def expect_echo(self, payload, opcode=1):
+        if isinstance(payload, str): payload = payload.encode()
+        f = self.next()
+        assert f is not None, ('no echo', len(payload))
+        assert f == (opcode, b'echo:' + payload), ('wrong echo', len(payload), f[0], f[1][:40])
+
+    def drain(self, secs):
+        while self.next(secs) is not None: pass
+
+def free_port():
+    s = socket.socket(); s.bind(('127.0.0.1', 0)); port = s.getsockname()[1]; s.close()
+    return port
+
+def main():
+    binary, backend = sys.argv[1], sys.argv[2]
+    port = free_port()
+    server = subprocess.Popen([binary, str(port), backend] + sys.argv[3:])
+    try:
+        clients = [Client(port) for _ in range(4)]
+
+        # echo, text and binary, around the frame length encodings
+        for _ in range(20):
+            for c in clients:
+                payload = os.urandom(random.choice([1, 125, 126, 1000, 65535, 65536, 20000]))
+                op = random.choice([1, 2])
+                if op == 1: payload = bytes(b & 0x7f for b in payload) # valid utf-8
+                c.send(payload, op)
+                c.expect_echo(payload, op)
+
+        # fragmented, with a ping between the fragments
+        c = clients[0]
+        for _ in range(10):
+            payload = bytes(random.randrange(32, 127) for _ in range(random.randint(4, 5000)))
+            cuts = sorted(random.sample(range(1, len(payload)), 3))
+            pieces = [payload[a:b] for a, b in zip([0] + cuts, cuts + [len(payload)])]
+            for k, piece in enumerate(pieces):
+                c.send(piece, 1 if k == 0 else 0, fin=k == len(pieces) - 1)
+                if k < len(pieces) - 1: c.send(b'ping', 9)
+            c.expect_echo(payload)
+        c.send('after'); c.expect_echo('after')
+        assert c.pongs == 30, ('pongs', c.pongs)
+
+        # topics: only subscribers get them, and not after they unsubscribe
+        subscriber, other = clients[1], clients[2]
+        subscriber.send('subscribe:a'); subscriber.send('x'); subscriber.expect_echo('x')
+        subscriber.topics = other.topics = 0
+        subscriber.drain(1.0); other.drain(0.1)
+        assert subscriber.topics > 0 and other.topics == 0, (subscriber.topics, other.topics)
+        subscriber.send('unsubscribe:a'); subscriber.send('y'); subscriber.expect_echo('y')
+        subscriber.topics = 0
+        subscriber.drain(0.5)
+        assert subscriber.topics == 0, subscriber.topics
+
+        # MT sends: every producer's messages arrive complete and in order
+        c = clients[3]
+        for _ in range(2):
+            c.send('mt')
+            seq = [0] * MT_THREADS
+            while sum(seq) < MT_THREADS * MT_MESSAGES:
+                f = c.next()
+                assert f is not None, ('mt messages missing', seq)
+                assert f[0] == 1 and f[1].startswith(b'mt:'), f[1][:40]
+                _, thread, n, padding = f[1].split(b':', 3)
+                thread, n = int(thread), int(n)
+                assert n == seq[thread], ('mt out of order', thread, n, seq[thread])
+                assert len(padding) == (n * 131 + thread * 7) % 1500, ('mt padding', thread, n)
+                seq[thread] += 1
+            c.send('after mt'); c.expect_echo('after mt')
+
+        # slots of closed connections are reused
+        clients[0].sock.close(); clients[1].sock.shutdown(socket.SHUT_WR)
+        time.sleep(0.2)
+        clients = clients[2:] + [Client(port) for _ in range(2)]
+        for c in clients:
+            c.send('again'); c.expect_echo('again')
+
+        clients[0].send('quit')
+        status = server.wait(TIMEOUT)
+        assert status == 0, ('server exited with', status)
+    finally:
+        if server.poll() is None:
+            server.kill()
+            server.wait()
+    print('echo_test passed: backend %s %s' % (backend, ' '.join(sys.argv[3:])))
+
+if __name__ == '__main__':
+    main()